@@ -0,0 +1,628 @@
+// Multi-link gateway daemon.
+// Serves file transfers on many serial ports from a single epoll loop, using
+// the link layer connection handles. Jobs are submitted on a local socket,
+// one line per connection:
+//
+//     tx|rx <serial port> <file>
+//
+// The gateway answers "OK <job>" (or "ERR <reason>") and, once the transfer
+// ends, "DONE <bytes>" or "FAILED <bytes>" before closing the connection.
+//
+// Every link is set up from the same settings: the defaults below, then a
+// config file and options as for the application (see config.h). Only the
+// link settings and payload apply; a capture is per link, so it is refused.
+//
+// Usage: gateway [options] <socket path> [baud rate]
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "application_layer.h"
+#include "config.h"
+#include "file_hash.h"
+#include "file_output.h"
+#include "link_layer.h"
+
+#define BAUDRATE 19200
+#define TIMEOUT 4
+#define N_TRIES 3
+#define KEEPALIVE_MS 2000
+
+#define MAX_EVENTS 64
+#define MAX_COMMAND_SIZE 256
+
+// Link setup blocks for up to nRetransmissions * timeout, so it runs on a
+// short-lived thread; data transfer and disconnection run on the event loop.
+typedef enum
+{
+    JOB_OPENING,
+    JOB_RUNNING,
+    JOB_CLOSING,
+} JobState;
+
+typedef enum
+{
+    WATCH_LISTEN,
+    WATCH_NOTIFY,
+    WATCH_CLIENT,
+    WATCH_LINK,
+} WatchKind;
+
+// What an epoll event refers to
+typedef struct
+{
+    WatchKind kind;
+    void *owner;
+} Watch;
+
+typedef struct
+{
+    Watch watch;
+    int fd;
+    char line[MAX_COMMAND_SIZE];
+    int size;
+} Client;
+
+// Stages of the transmitter, one control or data packet each
+typedef enum
+{
+    SEND_START,
+    SEND_DATA,
+    SEND_END,
+    SEND_DONE,
+} SendStage;
+
+typedef struct Job
+{
+    Watch watch;
+    int id;
+    int client; // Socket the result is reported to
+    LinkLayer params;
+    LinkConnection *conn;
+    JobState state;
+    int ok; // TRUE if the transfer completed
+    int closeResult;
+    long long startMs;
+    struct Job *next;
+
+    // Transmitter
+    FILE *file;
+    unsigned long long fileSize;
+    SendStage stage;
+    unsigned char *packet; // Built but not taken yet, the window was full
+    unsigned int packetSize;
+
+    // Receiver
+    FileOutput output;
+    int outputOpen;
+    int finished; // CP_END received, or the file cannot be written
+    char filename[200];
+
+    unsigned long long bytes; // File bytes sent or received
+    FileHash hash; // Of those bytes, sent in CP_END and checked against it
+} Job;
+
+static int epollFd;
+static int notifyPipe[2];
+static Job *jobs = NULL;
+static int nextJobId = 1;
+static Config config;
+
+static long long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static void reply(int fd, const char *format, ...)
+{
+    char line[MAX_COMMAND_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    int size = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (size >= (int) sizeof(line)) size = sizeof(line) - 1;
+
+    // If the client went away the job carries on regardless
+    send(fd, line, size, MSG_NOSIGNAL);
+}
+
+static int watch(int fd, Watch *watch)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = watch;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static void notify(Job *job)
+{
+    if (write(notifyPipe[1], &job, sizeof(job)) != sizeof(job)) perror("write");
+}
+
+static void *openerThread(void *arg)
+{
+    Job *job = (Job *)arg;
+    job->conn = linkOpen(job->params);
+    notify(job);
+    return NULL;
+}
+
+// Closes a received file, which waits for it to reach the disk.
+static void *finalizerThread(void *arg)
+{
+    FileOutput *output = (FileOutput *)arg;
+    fileOutputClose(output);
+    free(output);
+    return NULL;
+}
+
+static int startThread(void *(*function)(void *), void *arg)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, function, arg) != 0) {
+        printf("Error creating thread.\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Closes the received file off the event loop.
+static void finalizeOutput(Job *job)
+{
+    FileOutput *output = (FileOutput *)malloc(sizeof(FileOutput));
+
+    if (output != NULL) *output = job->output;
+    if (output == NULL || startThread(finalizerThread, output) == -1) {
+        free(output);
+        fileOutputClose(&job->output);
+    }
+    job->outputOpen = FALSE;
+}
+
+// Reports the result and frees the job.
+static void finishJob(Job *job)
+{
+    double seconds = (nowMs() - job->startMs) / 1000.0;
+    int ok = job->ok && job->closeResult == 1;
+
+    printf("Job %d: %s %s %s: %s, %llu bytes in %.1f s\n", job->id, job->params.role == LLTX ? "tx" : "rx",
+           job->params.serialPort, job->filename, ok ? "done" : "failed", job->bytes, seconds);
+    reply(job->client, "%s %llu\n", ok ? "DONE" : "FAILED", job->bytes);
+
+    for (Job **link = &jobs; *link != NULL; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+
+    if (job->file != NULL) fclose(job->file);
+    if (job->outputOpen) finalizeOutput(job);
+    free(job->packet);
+    close(job->client);
+    free(job);
+}
+
+// Starts disconnecting the link; the receiver finalizes its file meanwhile.
+static void closeJob(Job *job, int ok)
+{
+    job->ok = ok;
+    job->state = JOB_CLOSING;
+
+    if (job->outputOpen) finalizeOutput(job);
+    linkShutdown(job->conn, 0);
+}
+
+// Frees the link once it is disconnected.
+static void endJob(Job *job)
+{
+    if (epoll_ctl(epollFd, EPOLL_CTL_DEL, linkFd(job->conn), NULL) == -1) perror("epoll_ctl");
+
+    if (job->params.role == LLTX) {
+        LinkQuality quality;
+        linkGetQuality(job->conn, &quality);
+        printf("Job %d: round trip %d ms, error rate %.2g per byte, %d of %d probes lost\n", job->id,
+               quality.rttMs, quality.errorRate, quality.probesLost, quality.probesSent);
+    }
+
+    job->closeResult = linkClose(job->conn, FALSE, NULL);
+    job->conn = NULL;
+    finishJob(job);
+}
+
+// Builds the next packet of the transmitter.
+// Returns "0" on success or "-1" on error.
+static int nextPacket(Job *job)
+{
+    unsigned long long size = job->fileSize;
+
+    switch (job->stage) {
+        case SEND_START:
+            job->packet = createControlPacket(CP_START, &size);
+            job->packetSize = size;
+            job->stage = SEND_DATA;
+            break;
+        case SEND_DATA: {
+            // Packets shrink as the link gets noisier, so a damaged frame costs less to resend
+            LinkQuality quality;
+            linkGetQuality(job->conn, &quality);
+
+            int payloadSize = quality.payloadSize < config.payloadSize ? quality.payloadSize : config.payloadSize;
+
+            unsigned char data[MAX_PAYLOAD_SIZE];
+            unsigned int dataSize = fread(data, 1, payloadSize - DP_HEADER_SIZE, job->file);
+
+            if (dataSize == 0) {
+                if (ferror(job->file)) return -1;
+                job->stage = SEND_END;
+                return nextPacket(job);
+            }
+            fileHashUpdate(&job->hash, data, dataSize);
+            job->bytes += dataSize;
+            job->packetSize = dataSize;
+            job->packet = createDataPacket(data, &job->packetSize);
+            break;
+        }
+        case SEND_END:
+            job->packet = createEndPacket(fileHashDigest(&job->hash), &size);
+            job->packetSize = size;
+            job->stage = SEND_DONE;
+            break;
+        default:
+            return 0;
+    }
+    return job->packet == NULL ? -1 : 0;
+}
+
+// Fills the send window of a transmitter.
+// Returns "0" on success or "-1" on error.
+static int pumpTransmitter(Job *job)
+{
+    while (TRUE) {
+        if (job->packet == NULL) {
+            if (job->stage == SEND_DONE) return 0;
+            if (nextPacket(job) == -1) return -1;
+        }
+
+        int res = linkSend(job->conn, job->packet, job->packetSize);
+        if (res == -1) return -1;
+        if (res == 0) return 0;
+
+        free(job->packet);
+        job->packet = NULL;
+    }
+}
+
+static void onPacket(LinkConnection *conn, const unsigned char *packet, int size, void *user)
+{
+    Job *job = (Job *)user;
+    unsigned long long fileSize = 0;
+
+    if (size < 1 || job->finished) return;
+
+    if (!job->outputOpen) {
+        if (packet[0] != CP_START || parseControlPacket((unsigned char *)packet, size, &fileSize) < 0) return;
+
+        if (fileOutputOpen(&job->output, job->filename, fileSize, OUTPUT_MMAP) == -1) {
+            job->finished = TRUE;
+            return;
+        }
+        job->outputOpen = TRUE;
+        return;
+    }
+
+    if (packet[0] == CP_END) {
+        unsigned long long fileHash = 0;
+
+        job->ok = parseFileHash(packet, size, &fileHash) == -1 || fileHash == fileHashDigest(&job->hash);
+        if (!job->ok) printf("Job %d: file hash mismatch.\n", job->id);
+        job->finished = TRUE;
+        return;
+    }
+
+    unsigned char data[MAX_PAYLOAD_SIZE];
+    int dataSize = parseDataPacket((unsigned char *)packet, size, data);
+
+    if (dataSize < 0) return;
+    if (fileOutputWriteAt(&job->output, job->bytes, data, dataSize) == -1) {
+        printf("Job %d: error writing file.\n", job->id);
+        job->finished = TRUE;
+        return;
+    }
+    fileHashUpdate(&job->hash, data, dataSize);
+    job->bytes += dataSize;
+}
+
+// Processes a link, after input or a timeout.
+static void serviceJob(Job *job)
+{
+    if (job->state == JOB_CLOSING) {
+        linkPoll(job->conn);
+        if (linkClosed(job->conn)) endJob(job);
+        return;
+    }
+
+    if (linkPoll(job->conn) == -1) {
+        closeJob(job, FALSE);
+        return;
+    }
+
+    if (job->params.role == LLTX) {
+        if (pumpTransmitter(job) == -1) closeJob(job, FALSE);
+        else if (job->stage == SEND_DONE && job->packet == NULL && linkPending(job->conn) == 0) closeJob(job, TRUE);
+    }
+    else if (job->finished) closeJob(job, job->ok);
+
+    if (job->state == JOB_CLOSING) serviceJob(job);
+}
+
+// Moves a job on once its opener thread is done.
+static void jobNotified(Job *job)
+{
+    if (job->conn == NULL) {
+        job->closeResult = -1;
+        finishJob(job);
+        return;
+    }
+
+    LinkCallbacks callbacks = {onPacket, NULL, NULL, job};
+    linkSetCallbacks(job->conn, &callbacks);
+
+    job->state = JOB_RUNNING;
+    job->watch.kind = WATCH_LINK;
+    job->watch.owner = job;
+
+    if (watch(linkFd(job->conn), &job->watch) == -1) {
+        job->closeResult = linkClose(job->conn, FALSE, NULL);
+        job->conn = NULL;
+        finishJob(job);
+        return;
+    }
+    serviceJob(job);
+}
+
+// Starts the job in a command line, taking over the client socket.
+// Returns "0" on success or "-1" if the command was rejected.
+static int startJob(int client, char *line)
+{
+    char role[8], port[50], filename[200];
+
+    if (sscanf(line, "%7s %49s %199s", role, port, filename) != 3 || (strcmp(role, "tx") && strcmp(role, "rx"))) {
+        reply(client, "ERR usage: tx|rx <serial port> <file>\n");
+        return -1;
+    }
+
+    for (Job *other = jobs; other != NULL; other = other->next) {
+        if (!strcmp(other->params.serialPort, port)) {
+            reply(client, "ERR %s is busy\n", port);
+            return -1;
+        }
+    }
+
+    Job *job = (Job *)calloc(1, sizeof(Job));
+    if (job == NULL) {
+        perror("calloc");
+        reply(client, "ERR out of memory\n");
+        return -1;
+    }
+
+    job->id = nextJobId++;
+    job->client = client;
+    job->startMs = nowMs();
+    fileHashInit(&job->hash);
+    strcpy(job->filename, filename);
+
+    job->params = config.link;
+    strcpy(job->params.serialPort, port);
+    job->params.role = strcmp(role, "tx") ? LLRX : LLTX;
+
+    if (job->params.role == LLTX) {
+        job->file = fopen(filename, "rb");
+        if (job->file == NULL) {
+            reply(client, "ERR cannot open %s\n", filename);
+            free(job);
+            return -1;
+        }
+        fseek(job->file, 0, SEEK_END);
+        job->fileSize = ftell(job->file);
+        fseek(job->file, 0, SEEK_SET);
+    }
+
+    job->state = JOB_OPENING;
+    job->next = jobs;
+    jobs = job;
+
+    reply(client, "OK %d\n", job->id);
+    printf("Job %d: %s %s %s\n", job->id, role, port, filename);
+
+    if (startThread(openerThread, job) == -1) finishJob(job);
+    return 0;
+}
+
+static void acceptClient(int listenFd)
+{
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+        perror("accept");
+        return;
+    }
+
+    Client *client = (Client *)calloc(1, sizeof(Client));
+    if (client == NULL) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    client->watch.kind = WATCH_CLIENT;
+    client->watch.owner = client;
+    client->fd = fd;
+
+    if (watch(fd, &client->watch) == -1) {
+        close(fd);
+        free(client);
+    }
+}
+
+// Reads a client command, starting the job once the line is complete.
+static void readClient(Client *client)
+{
+    int res = read(client->fd, client->line + client->size, sizeof(client->line) - 1 - client->size);
+
+    if (res > 0) {
+        client->size += res;
+        client->line[client->size] = '\0';
+        if (strchr(client->line, '\n') == NULL && client->size < (int) sizeof(client->line) - 1) return;
+    }
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    if (res <= 0 || startJob(client->fd, client->line) == -1) close(client->fd);
+    free(client);
+}
+
+static int listenOn(const char *path)
+{
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, 16) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the milliseconds until the next retransmission deadline of any link, or "-1" for none.
+static int nextTimeout()
+{
+    int timeout = -1;
+
+    for (Job *job = jobs; job != NULL; job = job->next) {
+        if (job->state == JOB_OPENING) continue;
+
+        int remaining = linkTimeout(job->conn);
+        if (remaining >= 0 && (timeout == -1 || remaining < timeout)) timeout = remaining;
+    }
+    return timeout;
+}
+
+// Services the links whose retransmission timer expired.
+static void serviceTimeouts()
+{
+    Job *job = jobs;
+
+    while (job != NULL) {
+        Job *next = job->next;
+        if (job->state != JOB_OPENING && linkTimeout(job->conn) == 0) serviceJob(job);
+        job = next;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    configDefaults(&config, BAUDRATE, N_TRIES, TIMEOUT);
+    config.link.quiet = TRUE;
+    config.link.keepalive = KEEPALIVE_MS;
+
+    int first = configParseArgs(&config, argc, argv);
+    if (first == -1 || first >= argc) {
+        configUsage(argv[0], "<socket path> [baud rate]");
+        return 1;
+    }
+    if (first + 1 < argc && configSet(&config, "baud", argv[first + 1]) == -1) return 1;
+
+    if (config.link.captureFile[0] != '\0') {
+        printf("The gateway cannot capture: every link would write the same file\n");
+        return 1;
+    }
+    const char *socketPath = argv[first];
+
+    // One line per job event, also when logging to a file
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int listenFd = listenOn(socketPath);
+    if (listenFd < 0) return 1;
+
+    epollFd = epoll_create1(0);
+    if (epollFd < 0 || pipe(notifyPipe) == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    Watch listenWatch = {WATCH_LISTEN, NULL};
+    Watch notifyWatch = {WATCH_NOTIFY, NULL};
+
+    if (watch(listenFd, &listenWatch) == -1 || watch(notifyPipe[0], &notifyWatch) == -1) return 1;
+
+    printf("Gateway listening on %s\n", socketPath);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (TRUE) {
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, nextTimeout());
+
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            Watch *watch = (Watch *)events[i].data.ptr;
+
+            switch (watch->kind) {
+                case WATCH_LISTEN:
+                    acceptClient(listenFd);
+                    break;
+                case WATCH_NOTIFY: {
+                    Job *job;
+                    if (read(notifyPipe[0], &job, sizeof(job)) == sizeof(job)) jobNotified(job);
+                    break;
+                }
+                case WATCH_CLIENT:
+                    readClient((Client *)watch->owner);
+                    break;
+                case WATCH_LINK: {
+                    Job *job = (Job *)watch->owner;
+                    if (job->state != JOB_OPENING) serviceJob(job);
+                    break;
+                }
+            }
+        }
+        serviceTimeouts();
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+    return 1;
+}
@@ -0,0 +1,33 @@
+// AEAD header.
+
+#ifndef _AEAD_H_
+#define _AEAD_H_
+
+// ChaCha20-Poly1305 authenticated encryption (RFC 8439), used by the link
+// layer to encrypt I-frames when both ends share a key. Portable C: about
+// 10 CPU cycles per byte, far below the line time of any serial port.
+
+#define AEAD_KEY_SIZE 32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE 16
+
+// Encrypt size bytes of data in place and compute the tag over aad (which
+// may be NULL) and the ciphertext. A nonce must never be used twice with the
+// same key.
+void aeadSeal(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, int aadSize,
+              unsigned char *data, int size, unsigned char *tag);
+
+// Check the tag of size bytes of ciphertext and decrypt them in place.
+// Return "0" on success, or "-1" if the tag does not match (data is left as is).
+int aeadOpen(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, int aadSize,
+             unsigned char *data, int size, const unsigned char *tag);
+
+// Derive a key for one use (e.g. a session) from a long-term key, as the
+// first half of the ChaCha20 block for the context.
+void aeadDeriveKey(const unsigned char *key, const unsigned char *context, unsigned char *derived);
+
+// Read a key from a file: AEAD_KEY_SIZE raw bytes or 2 * AEAD_KEY_SIZE hex digits.
+// Return "0" on success or "-1" on error.
+int aeadLoadKey(const char *path, unsigned char *key);
+
+#endif // _AEAD_H_
@@ -4,6 +4,9 @@
 #ifndef _APPLICATION_LAYER_H_
 #define _APPLICATION_LAYER_H_
 
+#include "config.h"
+#include "delta.h"
+
 // Control packet header size.
 #define CP_HEADER_SIZE 3
 #define DP_HEADER_SIZE 3
@@ -11,8 +14,23 @@
 #define CP_START 0x02
 #define CP_END 0x03
 #define DP_DATA 0x01
+#define DP_COPY 0x04 // Delta mode: blocks of the receiver's copy, block (4 bytes) and count (2 bytes) big-endian
+#define DP_SIGNATURES 0x05 // Delta mode: block signatures of the receiver's copy, as DP_DATA
+#define DP_MESSAGE 0x06 // Operator message, as DP_DATA, sent ahead of the file data
+#define DP_ZERO 0x07 // Run of zero bytes in the file, its size (4 bytes) big-endian
+
+// Longest run of zeros in a DP_ZERO packet. Longer runs take several.
+#define MAX_ZERO_RUN_SIZE (1U << 30)
+
+// Longest operator message
+#define MAX_MESSAGE_SIZE (MAX_PAYLOAD_SIZE - DP_HEADER_SIZE)
 
 #define CP_T_FILE_SIZE 0
+#define CP_T_FILE_HASH 1 // XXH64 of the file, 8 bytes big-endian, in CP_END
+#define CP_T_BLOCK_SIZE 2 // Delta mode: block size of the signatures, in their CP_START
+
+// Block signatures that fit in a DP_SIGNATURES packet
+#define SIGNATURES_PER_PACKET ((MAX_PAYLOAD_SIZE - DP_HEADER_SIZE) / DELTA_SIGNATURE_SIZE)
 
 // Application layer main function.
 // Arguments:
@@ -25,12 +43,62 @@
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename);
 
+// Application layer main function, with every setting taken from config (see config.h).
+void applicationLayerWithConfig(const char *serialPort, const char *role, const char *filename, const Config *config);
+
 unsigned char* createControlPacket(unsigned char controlField, unsigned long long* packetSize);
 
 unsigned char* createDataPacket(unsigned char* data, unsigned int* packetSize);
 
+// Parse a CP_START / CP_END packet, reading the file size from CP_START.
+// Return "0" on success or "-1" if the packet is malformed.
 int parseControlPacket(unsigned char* packet, unsigned int packetSize, unsigned long long* fileSize);
 
+// Create a CP_END packet carrying the hash of the file sent.
+unsigned char* createEndPacket(unsigned long long fileHash, unsigned long long* packetSize);
+
+// Find the file hash in a control packet.
+// Return "0" on success or "-1" if it carries none (e.g. from an older transmitter).
+int parseFileHash(const unsigned char* packet, unsigned int packetSize, unsigned long long* fileHash);
+
+// Create the CP_START of the block signatures: the size of the receiver's
+// copy of the file and the block size.
+unsigned char* createBasisPacket(unsigned long long basisSize, unsigned int blockSize, unsigned long long* packetSize);
+
+// Find the block size in a control packet.
+// Return "0" on success or "-1" if it carries none.
+int parseBlockSize(const unsigned char* packet, unsigned int packetSize, unsigned int* blockSize);
+
+// Create a DP_SIGNATURES packet with count (at most SIGNATURES_PER_PACKET) signatures.
+unsigned char* createSignaturePacket(const BlockSignature* blocks, unsigned int count, unsigned int* packetSize);
+
+// Copy the signatures of a DP_SIGNATURES packet to blocks (at most maxCount).
+// Return their number, or "-1" if the packet is malformed.
+int parseSignaturePacket(const unsigned char* packet, unsigned int packetSize, BlockSignature* blocks, unsigned int maxCount);
+
+// Create a DP_COPY packet.
+unsigned char* createCopyPacket(unsigned int block, unsigned int count, unsigned int* packetSize);
+
+// Read the blocks asked for by a DP_COPY packet.
+// Return "0" on success or "-1" if the packet is malformed.
+int parseCopyPacket(const unsigned char* packet, unsigned int packetSize, unsigned int* block, unsigned int* count);
+
+// Create a DP_ZERO packet for a run of size zero bytes (at most MAX_ZERO_RUN_SIZE).
+unsigned char* createZeroPacket(unsigned int size, unsigned int* packetSize);
+
+// Read the size of the run of zeros of a DP_ZERO packet.
+// Return "0" on success or "-1" if the packet is malformed.
+int parseZeroPacket(const unsigned char* packet, unsigned int packetSize, unsigned int* size);
+
+// Create a DP_MESSAGE packet with packetSize bytes of message (at most MAX_MESSAGE_SIZE).
+unsigned char* createMessagePacket(const unsigned char* message, unsigned int* packetSize);
+
+// Copy the message of a DP_MESSAGE packet to message (at most packetSize - DP_HEADER_SIZE bytes).
+// Return the message size, or "-1" if the packet is malformed.
+int parseMessagePacket(const unsigned char* packet, unsigned int packetSize, unsigned char* message);
+
+// Copy the data of a data packet to data (at most packetSize - DP_HEADER_SIZE bytes).
+// Return the data size, or "-1" if the packet is malformed.
 int parseDataPacket(unsigned char* packet, unsigned int packetSize, unsigned char* data);
 
 #endif // _APPLICATION_LAYER_H_
@@ -0,0 +1,100 @@
+// Capture header.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "link_layer.h"
+
+// Record of what crossed the serial port of one connection, for tools/replay.
+// The file starts with a CaptureHeader, followed by records of:
+//   time since the previous record in microseconds (varint)
+//   type (1 byte, CaptureRecordType)
+//   size (varint)
+//   size bytes
+// Varints are 7 bits per byte, least significant first, with the top bit set
+// on all bytes but the last.
+
+#define CAPTURE_MAGIC 0x50434C4C // "LLCP"
+#define CAPTURE_VERSION 2
+
+// Largest record. Longer writes are split.
+#define CAPTURE_MAX_RECORD 4096
+
+typedef enum
+{
+    CAPTURE_RECEIVED, // Bytes read from the port
+    CAPTURE_SENT, // Bytes written to the port
+    CAPTURE_PACKET, // Packet handed to the link layer to send
+} CaptureRecordType;
+
+// The parameters the connection was opened with, to open the same one again
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t role;
+    uint8_t fcs;
+    int32_t baudRate;
+    int32_t maxBaudRate;
+    int32_t nRetransmissions;
+    int32_t timeout;
+    int32_t windowSize;
+    int32_t flowControl;
+    int32_t keepalive;
+    int32_t fastConnect;
+    uint32_t randomSeed;
+    int32_t fer;
+    int64_t startTime; // Wall clock time the capture was opened, in microseconds
+} CaptureHeader;
+
+typedef struct
+{
+    FILE *file;
+    pthread_mutex_t lock; // The transmit pipeline frames packets on its own thread
+    long long lastUs; // Monotonic time of the last record
+} Capture;
+
+typedef struct
+{
+    FILE *file;
+    CaptureHeader header;
+    unsigned long long timeUs; // Of the last record read, since the capture was opened
+} CaptureReader;
+
+typedef struct
+{
+    CaptureRecordType type;
+    unsigned long long timeUs; // Since the capture was opened
+    int size;
+    unsigned char data[CAPTURE_MAX_RECORD];
+} CaptureRecord;
+
+// Create the capture file for a connection opened with params, drawing its
+// random numbers from randomSeed.
+// Return the capture, or NULL on error.
+Capture *captureOpen(const char *path, const LinkLayer *params, unsigned int randomSeed);
+
+// Append a record of size bytes. Each record is flushed to the file, so the
+// capture survives the process. Safe to call from any thread.
+void captureRecord(Capture *capture, CaptureRecordType type, const unsigned char *data, int size);
+
+void captureClose(Capture *capture);
+
+// Open a capture file for reading, filling in reader->header.
+// Return "0" on success or "-1" on error.
+int captureReaderOpen(CaptureReader *reader, const char *path);
+
+// Read the next record.
+// Return "1" with it in record, "0" at the end of the capture or "-1" if it is truncated.
+int captureReaderNext(CaptureReader *reader, CaptureRecord *record);
+
+void captureReaderClose(CaptureReader *reader);
+
+// Fill in the parameters of the captured connection, on serialPort.
+void captureLinkLayer(const CaptureHeader *header, const char *serialPort, LinkLayer *params);
+
+#endif // _CAPTURE_H_
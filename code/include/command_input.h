@@ -0,0 +1,28 @@
+// Operator command input header.
+
+#ifndef _COMMAND_INPUT_H_
+#define _COMMAND_INPUT_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Reads operator commands a line at a time from a file descriptor (e.g. a
+// control pipe) while a transfer runs, and queues each as an urgent
+// DP_MESSAGE, which the link layer sends ahead of the file data. Lines longer
+// than MAX_MESSAGE_SIZE are truncated.
+typedef struct
+{
+    int fd; // Link layer connection the messages are queued on
+    int inputFd;
+    atomic_int stopping;
+    pthread_t thread;
+} CommandInput;
+
+// Start reading commands from inputFd for the connection open on fd.
+// Return "0" on success or "-1" on error.
+int commandInputStart(CommandInput *input, int fd, int inputFd);
+
+// Stop reading commands. Those already queued are still sent.
+void commandInputStop(CommandInput *input);
+
+#endif // _COMMAND_INPUT_H_
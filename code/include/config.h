@@ -0,0 +1,69 @@
+// Configuration header.
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include "link_layer.h"
+
+// Settings of a transfer, from a config file and command line options, so
+// each line can be tuned without a rebuild. Both use the same names:
+//   config file:   name = value    (one per line, "#" starts a comment)
+//   command line:  --name value, or --name=value
+// Boolean settings take yes / no (or 1 / 0, true / false), and may be given
+// on the command line without a value to mean yes.
+//
+//   baud, max-baud         baud rate, and highest one to negotiate ("0" to keep baud)
+//   timeout                frame timeout in seconds
+//   retries                transmissions of a frame before giving up
+//   connect-timeout        deadline for the connection, in milliseconds ("0" for none)
+//   fast-connect           retry SET with exponential backoff
+//   payload                largest packet, up to MAX_PAYLOAD_SIZE
+//   window                 frames in flight, up to MAX_WINDOW_SIZE
+//   fcs                    bcc2, crc16 or aead
+//   fer                    simulated frame error rate, in percentage
+//   flow                   none, rts-cts or xon-xoff
+//   low-latency            low latency mode of the driver
+//   keepalive              idle time before probing the link, in milliseconds
+//   key                    shared key file, to encrypt the link
+//   trace, capture         event trace and traffic capture files
+//   frame-threads          cores building large I-frames ("0" for the calling thread alone)
+//   seed                   seed of the simulated errors ("0" for a random one)
+//   quiet                  print errors only
+//   progress-fd            where progress goes ("-1" for nowhere)
+//   delta, sparse          delta mode, and runs of zeros as holes
+//   command-fd             operator messages read from this descriptor ("-1" for none)
+
+#define CONFIG_MAX_LINE 256
+
+typedef struct
+{
+    LinkLayer link; // serialPort and role are set by the caller, quiet applies to the whole transfer
+    int payloadSize; // Largest packet, header included
+    int progressFd;
+    int delta;
+    int sparse;
+    int commandFd;
+} Config;
+
+// Fill config with the defaults, for the given baud rate, retries and timeout.
+void configDefaults(Config *config, int baudRate, int nTries, int timeout);
+
+// Apply one setting.
+// Return "0" on success or "-1" (after printing why) if the name or value is invalid.
+int configSet(Config *config, const char *name, const char *value);
+
+// Apply the settings of a config file.
+// Return "0" on success or "-1" on error.
+int configLoadFile(Config *config, const char *path);
+
+// Apply the options at the start of argv: the file of "--config" first, then
+// the others, so the command line overrides the file. "--" ends the options.
+// Return the index of the first argument that is not an option, or "-1" on
+// error or "--help".
+int configParseArgs(Config *config, int argc, char *argv[]);
+
+// Print the options understood by configParseArgs, for a program taking
+// the given arguments after them.
+void configUsage(const char *program, const char *arguments);
+
+#endif // _CONFIG_H_
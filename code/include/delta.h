@@ -0,0 +1,93 @@
+// Delta transfer header.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+
+// rsync-style delta encoding. The receiver describes the copy of the file it
+// already has (the basis) by a signature per block: a weak checksum that can
+// be rolled a byte at a time and a strong XXH64. The transmitter slides over
+// the new version looking for those blocks, and sends copy instructions for
+// the blocks found and literal data for the rest.
+
+#define DELTA_MIN_BLOCK_SIZE 512
+#define DELTA_MAX_BLOCK_SIZE 65536
+#define DELTA_SIGNATURE_SIZE 12 // On the wire: weak (4 bytes) and strong (8 bytes), big-endian
+#define DELTA_MAX_COPY 65535 // Blocks in one copy instruction
+
+typedef struct
+{
+    uint32_t weak;
+    uint64_t strong;
+} BlockSignature;
+
+// Signatures of the full blocks of the basis, indexed by weak checksum
+typedef struct
+{
+    unsigned int blockSize;
+    unsigned int count;
+    BlockSignature *blocks;
+    int *buckets; // First block of each hash chain, "-1" for none
+    int *chain; // Next block with the same hash
+    unsigned int bucketMask;
+} DeltaSignatures;
+
+typedef enum
+{
+    DELTA_LITERAL, // size bytes of the new file, from offset
+    DELTA_COPY, // count blocks of the basis, from block
+} DeltaOpType;
+
+typedef struct
+{
+    DeltaOpType type;
+    unsigned long long offset; // In the new file, for both types
+    unsigned int size; // Bytes of the new file covered
+    unsigned int block;
+    unsigned int count;
+} DeltaOp;
+
+typedef struct
+{
+    const DeltaSignatures *signatures;
+    const unsigned char *data; // The new file
+    unsigned long long size;
+    unsigned int maxLiteral;
+    unsigned long long pos; // Start of the window being matched
+    unsigned long long literalStart;
+    uint32_t weak; // Of the window at pos, when rolling
+    int rolling;
+    unsigned int copyBlock; // Copy pending while the following blocks keep matching
+    unsigned int copyCount;
+} DeltaEncoder;
+
+// Return the block size to use for a basis of the given size, about its square
+// root, so that signatures and unmatched data both stay small.
+unsigned int deltaBlockSize(unsigned long long basisSize);
+
+// Return the weak checksum of a block.
+uint32_t deltaWeakChecksum(const unsigned char *data, unsigned int size);
+
+// Return the strong checksum of a block.
+uint64_t deltaStrongChecksum(const unsigned char *data, unsigned int size);
+
+// Allocate room for count signatures of blocks of blockSize bytes.
+// Return "0" on success or "-1" on error.
+int deltaSignaturesInit(DeltaSignatures *signatures, unsigned int blockSize, unsigned int count);
+
+// Build the index once every signature is filled in.
+void deltaSignaturesIndex(DeltaSignatures *signatures);
+
+void deltaSignaturesFree(DeltaSignatures *signatures);
+
+// Start encoding the new file of size bytes against indexed signatures.
+// Literal runs are split at maxLiteral bytes.
+void deltaEncoderInit(DeltaEncoder *encoder, const DeltaSignatures *signatures,
+                      const unsigned char *data, unsigned long long size, unsigned int maxLiteral);
+
+// Take the next instruction, in file order.
+// Return "1" with it in op, or "0" once the whole file is covered.
+int deltaEncoderNext(DeltaEncoder *encoder, DeltaOp *op);
+
+#endif // _DELTA_H_
@@ -0,0 +1,30 @@
+// File hash header.
+
+#ifndef _FILE_HASH_H_
+#define _FILE_HASH_H_
+
+#include <stdint.h>
+
+// Streaming XXH64 (seed 0) of a file, updated as its data is packetized or
+// received so that no second pass over the file is needed.
+typedef struct
+{
+    uint64_t acc[4];
+    uint64_t totalSize;
+    unsigned char buffer[32]; // Tail of the input, less than a stripe
+    unsigned int bufferSize;
+} FileHash;
+
+// Start a new hash.
+void fileHashInit(FileHash *hash);
+
+// Add size bytes of data to the hash.
+void fileHashUpdate(FileHash *hash, const unsigned char *data, unsigned int size);
+
+// Add size zero bytes to the hash, for a run of zeros sent without its data.
+void fileHashUpdateZeros(FileHash *hash, unsigned long long size);
+
+// Return the hash of the data added so far. More data can still be added.
+uint64_t fileHashDigest(const FileHash *hash);
+
+#endif // _FILE_HASH_H_
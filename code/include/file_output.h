@@ -0,0 +1,45 @@
+// Received file output header.
+
+#ifndef _FILE_OUTPUT_H_
+#define _FILE_OUTPUT_H_
+
+#include <stdio.h>
+
+typedef enum
+{
+    OUTPUT_STDIO, // Sequential fwrite
+    OUTPUT_MMAP,  // Preallocated and memory mapped, written in place
+} FileOutputMode;
+
+typedef struct
+{
+    FileOutputMode mode;
+    int fd;
+    FILE *stream;
+    unsigned char *map;
+    unsigned long long size; // Announced size
+    unsigned long long end;  // Highest offset written so far
+} FileOutput;
+
+// Create (or truncate) filename for a file of the announced size.
+// OUTPUT_MMAP preallocates the file and maps it; it falls back to OUTPUT_STDIO
+// when the size is 0 or the file cannot be mapped (e.g. a pipe).
+// Return "0" on success or "-1" on error.
+int fileOutputOpen(FileOutput *output, const char *filename, unsigned long long size, FileOutputMode mode);
+
+// Write data at the given offset of the file. Offsets may arrive in any order
+// with OUTPUT_MMAP, but must be sequential with OUTPUT_STDIO.
+// Return "0" on success or "-1" on error (including writes past the announced size).
+int fileOutputWriteAt(FileOutput *output, unsigned long long offset, const unsigned char *data, unsigned int dataSize);
+
+// Leave size bytes at the given offset as zeros, without writing them: as a
+// hole where the file system supports it. Same rules on offsets as fileOutputWriteAt.
+// Return "0" on success or "-1" on error.
+int fileOutputZeroAt(FileOutput *output, unsigned long long offset, unsigned long long size);
+
+// Unmap and close the file, truncating it to the bytes written if the
+// transfer ended early, and wait for it to reach the disk (fsync).
+// Return "0" on success or "-1" on error.
+int fileOutputClose(FileOutput *output);
+
+#endif // _FILE_OUTPUT_H_
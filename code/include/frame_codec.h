@@ -0,0 +1,125 @@
+// Frame codec header.
+
+#ifndef _FRAME_CODEC_H_
+#define _FRAME_CODEC_H_
+
+#include "link_layer.h"
+
+// Byte classes, looked up in frameByteClass instead of comparing each byte
+// against FLAG / ESC / XON / XOFF.
+#define BYTE_PLAIN 0x00
+#define BYTE_DELIMITER 0x01 // FLAG and ESC, always escaped
+#define BYTE_FLOW 0x02      // XON and XOFF, escaped with XON / XOFF flow control
+
+// Escape masks an encoder is specialized on
+#define ESCAPE_BASIC BYTE_DELIMITER
+#define ESCAPE_FLOW (BYTE_DELIMITER | BYTE_FLOW)
+
+extern const unsigned char frameByteClass[256];
+extern const unsigned short crc16Table[256];
+
+// Frame check sequences. Each FCS type X provides FCS_INIT_X, FCS_UPDATE_X,
+// FCS_SIZE_X and FCS_BYTE_X (the i-th byte sent), so the codecs below can be
+// specialized on it by token pasting. Both are chosen so that running the
+// FCS over the data followed by its FCS bytes gives 0.
+#define FCS_INIT_BCC2 0
+#define FCS_UPDATE_BCC2(fcs, byte) ((fcs) ^ (byte))
+#define FCS_SIZE_BCC2 1
+#define FCS_BYTE_BCC2(fcs, i) (fcs)
+
+// CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF), sent big-endian
+#define FCS_INIT_CRC16 0xFFFF
+#define FCS_UPDATE_CRC16(fcs, byte) ((((fcs) << 8) ^ crc16Table[(((fcs) >> 8) ^ (byte)) & 0xFF]) & 0xFFFF)
+#define FCS_SIZE_CRC16 2
+#define FCS_BYTE_CRC16(fcs, i) (((fcs) >> (8 * (1 - (i)))) & 0xFF)
+
+// The AEAD tag, the largest trailer
+#define FCS_MAX_SIZE 16
+
+// Largest I-frame for a payload bound: header, every data and FCS byte
+// escaped, and the trailing FLAG.
+#define FRAME_MAX_SIZE(maxPayload, fcsSize) (FH_SIZE + 2 * ((maxPayload) + (fcsSize)) + 1)
+
+// Builds an I-frame for buf into frame, which must hold FRAME_MAX_SIZE bytes.
+// Returns the frame size, or "-1" if buf is empty or over the payload bound.
+typedef int (*FrameEncoder)(const unsigned char* buf, int bufSize, unsigned char control, unsigned char* frame);
+
+// Checks the FCS of a destuffed data field (payload followed by its FCS).
+// Returns the payload size, or "-1" if the field is too short, too long or damaged.
+typedef int (*FrameChecker)(const unsigned char* field, int fieldSize);
+
+// Data field of a received frame, destuffed incrementally as bytes arrive.
+typedef struct {
+    unsigned char data[MAX_PAYLOAD_SIZE + FCS_MAX_SIZE];
+    int size;
+    int escaped; // The last byte fed was ESC
+    int malformed; // Over the size bound, or with an invalid escape sequence
+    int overflowed; // Over the size bound: the closing FLAG was lost, so this is no longer one frame
+} FieldDecoder;
+
+// Defines an encoder with a fixed address, FCS type, escape mask and payload
+// bound, so the per-byte loop has no configuration left to test.
+#define DEFINE_FRAME_ENCODER(NAME, ADDRESS, FCS, ESCAPE_MASK, MAX_PAYLOAD) \
+int NAME(const unsigned char* buf, int bufSize, unsigned char control, unsigned char* frame) \
+{ \
+    if (bufSize < 1 || bufSize > (MAX_PAYLOAD)) return -1; \
+    \
+    int j = 0; \
+    frame[j++] = FLAG; \
+    frame[j++] = (ADDRESS); \
+    frame[j++] = control; \
+    frame[j++] = (ADDRESS) ^ control; \
+    \
+    unsigned int fcs = FCS_INIT_##FCS; \
+    for (int i = 0; i < bufSize; i++) { \
+        unsigned char byte = buf[i]; \
+        fcs = FCS_UPDATE_##FCS(fcs, byte); \
+        if (frameByteClass[byte] & (ESCAPE_MASK)) { \
+            frame[j++] = ESC; \
+            frame[j++] = byte ^ 0x20; \
+        } \
+        else frame[j++] = byte; \
+    } \
+    for (int i = 0; i < FCS_SIZE_##FCS; i++) { \
+        unsigned char byte = FCS_BYTE_##FCS(fcs, i); \
+        if (frameByteClass[byte] & (ESCAPE_MASK)) { \
+            frame[j++] = ESC; \
+            frame[j++] = byte ^ 0x20; \
+        } \
+        else frame[j++] = byte; \
+    } \
+    frame[j++] = FLAG; \
+    return j; \
+}
+
+// Defines an FCS checker with a fixed FCS type and payload bound.
+#define DEFINE_FRAME_CHECKER(NAME, FCS, MAX_PAYLOAD) \
+int NAME(const unsigned char* field, int fieldSize) \
+{ \
+    if (fieldSize <= FCS_SIZE_##FCS || fieldSize > (MAX_PAYLOAD) + FCS_SIZE_##FCS) return -1; \
+    \
+    unsigned int fcs = FCS_INIT_##FCS; \
+    for (int i = 0; i < fieldSize; i++) { \
+        fcs = FCS_UPDATE_##FCS(fcs, field[i]); \
+    } \
+    return fcs == 0 ? fieldSize - FCS_SIZE_##FCS : -1; \
+}
+
+// Returns the number of bytes the FCS type appends to each I-frame.
+int fcsSize(FcsType fcs);
+
+// Returns the encoder for I-frames from the transmitter with the given FCS
+// type and escaping, bounded by MAX_PAYLOAD_SIZE.
+FrameEncoder frameEncoderFor(FcsType fcs, int escapeFlowControl);
+
+// Returns the checker for the given FCS type, bounded by MAX_PAYLOAD_SIZE.
+FrameChecker frameCheckerFor(FcsType fcs);
+
+void fieldDecoderReset(FieldDecoder* field);
+
+// Destuffs received bytes into the field, up to and including the FLAG that
+// closes the frame. Runs of plain bytes are found with memchr and copied in bulk.
+// Returns the number of bytes consumed, setting complete to TRUE if the FLAG was reached.
+int fieldDecoderFeed(FieldDecoder* field, const unsigned char* buf, int size, int* complete);
+
+#endif // _FRAME_CODEC_H_
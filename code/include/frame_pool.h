@@ -0,0 +1,43 @@
+// Frame pool header.
+
+#ifndef _FRAME_POOL_H_
+#define _FRAME_POOL_H_
+
+#include "frame_codec.h"
+
+// Worker threads that build one large I-frame together. The payload is split
+// in segments: a first pass computes the FCS of each segment and counts the
+// bytes to escape, the partial FCS are combined (a CRC can be shifted past
+// the bytes that follow it), and a second pass stuffs every segment straight
+// into its place in the frame. The pool can be shared: concurrent callers
+// queue their segments to the same workers and help run them while waiting.
+
+#define FRAME_POOL_MAX_THREADS 64
+
+// Smallest segment worth handing to another thread. Payloads of up to twice
+// this size are encoded by the caller alone.
+#define FRAME_POOL_MIN_SEGMENT 8192
+
+typedef struct FramePool FramePool;
+
+// Start a pool of worker threads (up to FRAME_POOL_MAX_THREADS - 1). The
+// calling thread works on its own frames too, so a pool of n - 1 workers
+// uses n cores.
+// Return the pool, or NULL on error.
+FramePool *framePoolCreate(int workers);
+
+// Stop the workers and free the pool. No encoding may be in progress.
+void framePoolDestroy(FramePool *pool);
+
+// Build an I-frame for bufSize bytes of buf, like a FrameEncoder without a
+// payload bound, into frame, which must hold FRAME_MAX_SIZE(bufSize, fcsSize(fcs))
+// bytes. pool may be NULL to encode on the calling thread alone.
+// Return the frame size, or "-1" if buf is empty.
+int framePoolEncode(FramePool *pool, unsigned char address, FcsType fcs, int escapeFlowControl,
+                    const unsigned char *buf, int bufSize, unsigned char control, unsigned char *frame);
+
+// Return the CRC-16 of the concatenation of two blocks, from the CRC of the
+// first (started from FCS_INIT_CRC16) and the CRC of the second started from 0.
+unsigned int crc16Combine(unsigned int crcFirst, unsigned int crcSecond, unsigned long long secondSize);
+
+#endif // _FRAME_POOL_H_
@@ -15,17 +15,36 @@
 #include <signal.h>
 #include <time.h>
 
+// The library is built with hidden symbols: only what is declared here is exported.
+#pragma GCC visibility push(default)
+
 #define FLAG 0x7E
 #define ESC 0x7D
+#define XON 0x11
+#define XOFF 0x13
 #define A_TRANSMITTER 0x03
 #define A_RECEIVER 0x01
 #define C_SET 0x03
 #define C_UA 0x07
 #define C_DISC 0x0B
+#define C_PROBE 0x05 // RR from the transmitter: the receiver answers with its current RR
 #define C_RR(Nr) ((Nr << 7) | 0x05)
 #define C_REJ(Nr) ((Nr << 7) | 0x01)
 #define C_INFO_FRAME(Ns) (Ns << 6)
-#define FER 10 // in percentage
+
+// Extended control fields with modulo 8 sequence numbers in the 3 high bits,
+// used instead of the ones above when a window larger than 1 is negotiated.
+#define C_RR_EXT(Nr) ((Nr << 5) | 0x05)
+#define C_REJ_EXT(Nr) ((Nr << 5) | 0x01)
+#define C_SREJ_EXT(Nr) ((Nr << 5) | 0x0D)
+#define C_INFO_FRAME_EXT(Ns) (Ns << 5)
+#define C_SEQ_EXT(C) (((C) >> 5) & 0x07)
+#define C_TYPE_EXT(C) ((C) & 0x1F)
+#define SEQ_MODULUS_EXT 8
+
+// Selective repeat needs the window to be at most half the sequence space
+#define MAX_WINDOW_SIZE (SEQ_MODULUS_EXT / 2)
+#define FER 10 // LinkLayer.fer of the classroom application (main), in percentage
 
 typedef enum {
     START,
@@ -42,21 +61,83 @@ typedef enum
     LLRX,
 } LinkLayerRole;
 
+typedef enum
+{
+    FLOW_NONE,
+    FLOW_RTS_CTS,
+    FLOW_XON_XOFF, // XON / XOFF are byte stuffed inside frames
+} FlowControl;
+
+typedef enum
+{
+    FCS_BCC2, // XOR of the data bytes
+    FCS_CRC16, // CRC-16/CCITT
+    FCS_AEAD, // ChaCha20-Poly1305 tag, with the payload encrypted (needs keyFile on both ends)
+} FcsType;
+
+// Classes of queued messages. A message is sent once every message of a more
+// urgent class has been, and before frames passed to linkSendFrame.
+typedef enum
+{
+    LINK_PRIORITY_URGENT, // Commands, sent at the next frame boundary
+    LINK_PRIORITY_BULK,
+    LINK_PRIORITIES
+} LinkPriority;
+
 typedef struct
 {
     char serialPort[50];
     LinkLayerRole role;
     int baudRate;
+    int maxBaudRate; // Highest rate to negotiate after SET/UA, "0" to keep baudRate
     int nRetransmissions;
     int timeout;
+    int windowSize; // Frames in flight, 1 for stop-and-wait, up to MAX_WINDOW_SIZE
+    int fastConnect; // TRUE to retry SET with exponential backoff from FAST_CONNECT_TIMEOUT_MS
+    int connectTimeout; // Deadline for llopen on both sides, in milliseconds ("0" for none)
+    FlowControl flowControl;
+    int lowLatency; // TRUE to request low latency mode from the driver
+    FcsType fcs; // Frame check sequence offered for I-frames, BCC2 unless both ends agree
+    char traceFile[100]; // Binary event trace written here (see tools/tracedump), "" for none
+    char captureFile[100]; // Bytes crossing the port recorded here (see tools/replay), "" for none
+    char keyFile[100]; // Shared key (see aead.h) to encrypt and authenticate I-frames, "" for none
+    int fer; // Simulated frame error rate of the receiver in percentage, "0" for none
+    unsigned int randomSeed; // Of the simulated frame errors (FER) and timeout jitter, "0" for a random one
+    int quiet; // TRUE to print errors only
+    int keepalive; // Idle time before the transmitter probes the link, in milliseconds ("0" for none)
+    int frameThreads; // Cores building I-frames of 2 * FRAME_POOL_MIN_SEGMENT bytes or more, in a pool shared by the process ("0" or "1" for none)
 } LinkLayer;
 
 typedef struct {
+    // Measured by the application
     double open_time;
     double data_time;
     double debit;
+
+    // Filled in by llclose
+    int frames_sent;
+    int frames_resent;
+    int frames_received;
+    int frames_damaged;
+    int frames_duplicate;
+    int timeouts;
+    unsigned long long payload_bytes; // Sent or received, including duplicates
+    double close_time; // Seconds spent disconnecting
+    int clean_close; // TRUE if DISC / DISC / UA completed, FALSE if it timed out
 } Statistics;
 
+// Live estimate of the link, from keepalive probes, the SET / UA exchange and
+// the acknowledgements of I-frames.
+typedef struct {
+    int rttMs; // Smoothed round trip time, "-1" until measured
+    int rttVarMs; // Round trip time deviation
+    int timeoutMs; // Retransmission timeout for a frame of MAX_PAYLOAD_SIZE
+    double errorRate; // Estimated probability that a byte is lost or damaged
+    int payloadSize; // Packet size with the best expected throughput at errorRate
+    int probesSent;
+    int probesLost;
+} LinkQuality;
+
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
 #define MAX_PAYLOAD_SIZE 1000
@@ -67,6 +148,24 @@ typedef struct {
 // Frame Trailer Size
 #define FT_SIZE 2
 
+// Link parameters optionally carried by SET / UA frames, after BCC1.
+// Encoded as TLV triplets (type, length, value) protected by a BCC2.
+#define LP_MAX_PARAMS_SIZE 48
+#define LP_T_BAUD_RATE 0x00
+#define LP_T_WINDOW_SIZE 0x01
+#define LP_T_TIMEOUT 0x02
+#define LP_T_FCS 0x03
+#define LP_T_KEEPALIVE 0x04
+#define LP_T_SALT 0x05 // Random per connection, with FCS_AEAD
+
+// First SET retransmission interval in fast connect mode, in milliseconds.
+// Doubles (with jitter) on each retry, up to the frame timeout.
+#define FAST_CONNECT_TIMEOUT_MS 20
+
+// Lower bound of the retransmission timeout adapted to the measured round
+// trip time, in milliseconds. Only used when keepalive is negotiated.
+#define MIN_ADAPTIVE_TIMEOUT_MS 100
+
 #define TX_FRAME 0
 #define RX_FRAME 1
 
@@ -82,21 +181,140 @@ int llopen(LinkLayer connectionParameters);
 // Return number of chars written, or "-1" on error.
 int llwrite(int fd, LinkLayer connectionParameters, const unsigned char *buf, int bufSize);
 
+// Build the frame for buf without sending it, so that framing can run ahead of
+// transmission (possibly in another thread).
+// Return the frame and its size in frameSize, or NULL on error.
+unsigned char* llframe(int fd, const unsigned char *buf, int bufSize, int *frameSize);
+
+// Send a frame built by llframe, taking ownership of it.
+// Return number of chars written, or "-1" on error.
+int llwriteFrame(int fd, LinkLayer connectionParameters, unsigned char *frame, int frameSize);
+
 // Receive data in packet.
 // Return number of chars read, or "-1" on error.
 int llread(int fd, LinkLayer connectionParameters, unsigned char *packet);
 
-// Close previously opened connection.
-// if showStatistics == TRUE, link layer should print statistics in the console on close.
+// Close previously opened connection, within (nRetransmissions + 1) * timeout.
+// The link counters are added to stats (if not NULL), which is printed in the
+// console if showStatistics == TRUE.
+// Return "1" on success or "-1" on error.
+int llclose(int fd, LinkLayer connectionParameters, int showStatistics, Statistics *stats);
+
+// Fill quality with the current estimate of the link.
+// Return "0" on success or "-1" on error.
+int llquality(int fd, LinkQuality *quality);
+
+// Queue a message as linkQueue. Safe to call from another thread while
+// llwrite runs, which sends it at the next frame boundary.
+// Return "0" on success or "-1" on error.
+int llqueue(int fd, const unsigned char *buf, int bufSize, LinkPriority priority);
+
+////////////////////////////////////////////////
+// CONNECTION HANDLES
+////////////////////////////////////////////////
+// The functions above are wrappers over connection handles, kept for
+// compatibility. Handles hold all the state of a link, so any number of them
+// can be used at once (one per thread, or many from an event loop).
+// Timeouts are deadlines checked by linkPoll: no signals are used.
+
+typedef struct LinkConnection LinkConnection;
+
+typedef struct
+{
+    // A packet was received in order. It is only valid during the call.
+    void (*onPacket)(LinkConnection *conn, const unsigned char *packet, int size, void *user);
+    // Frames were acknowledged, making room in the window.
+    void (*onSent)(LinkConnection *conn, int acknowledged, void *user);
+    // The retransmissions ran out or the port failed. The connection can only be closed.
+    void (*onError)(LinkConnection *conn, void *user);
+    void *user;
+} LinkCallbacks;
+
+// Open a connection and run SET / UA, blocking until it is established.
+// Return the connection or NULL on error.
+LinkConnection* linkOpen(LinkLayer connectionParameters);
+
+// Return the file descriptor of the port, to wait on it for input (POLLIN).
+int linkFd(const LinkConnection *conn);
+
+// Set the callbacks (NULL for none). Without onPacket, packets are taken with linkReceive.
+void linkSetCallbacks(LinkConnection *conn, const LinkCallbacks *callbacks);
+
+// Build the frame for buf without sending it. Safe to call from another thread.
+// Return the frame and its size in frameSize, or NULL on error.
+unsigned char* linkFrame(const LinkConnection *conn, const unsigned char *buf, int bufSize, int *frameSize);
+
+// Send a frame built by linkFrame without waiting for its acknowledgement.
+// Takes ownership of the frame unless the window is full.
+// Return the payload size, "0" if the window is full or "-1" on error.
+int linkSendFrame(LinkConnection *conn, unsigned char *frame, int frameSize);
+
+// Frame and send buf, as linkSendFrame.
+int linkSend(LinkConnection *conn, const unsigned char *buf, int bufSize);
+
+// Frame buf and queue it with the given priority, without waiting. Queued
+// messages are moved into the window by linkPoll (and the blocking writes) as
+// soon as it has room, most urgent first, so an urgent message waits at most
+// for the frames already in flight. Safe to call from another thread.
+// Return "0" on success or "-1" on error.
+int linkQueue(LinkConnection *conn, const unsigned char *buf, int bufSize, LinkPriority priority);
+
+// Return the number of messages queued and not yet in the window.
+int linkQueued(const LinkConnection *conn);
+
+// Take the next packet received in order (up to MAX_PAYLOAD_SIZE bytes) without waiting.
+// Return its size, "0" if there is none or "-1" on error.
+int linkReceive(LinkConnection *conn, unsigned char *packet);
+
+// Process the input available on the port, the retransmission timer and the
+// keepalive probes of the transmitter, never blocking.
+// Call it when linkFd is readable or linkTimeout has passed.
+// Return "0" on success or "-1" on error.
+int linkPoll(LinkConnection *conn);
+
+// Return the number of frames sent and not yet acknowledged.
+int linkPending(const LinkConnection *conn);
+
+// Return the milliseconds until linkPoll must be called for the timer or the
+// keepalive, or "-1" if neither is pending.
+int linkTimeout(const LinkConnection *conn);
+
+// Fill quality with the current estimate of the link.
+void linkGetQuality(const LinkConnection *conn, LinkQuality *quality);
+
+// Blocking counterparts of linkSendFrame and linkReceive, used by llwrite and llread.
+int linkWriteFrame(LinkConnection *conn, unsigned char *frame, int frameSize);
+int linkRead(LinkConnection *conn, unsigned char *packet);
+
+// Start disconnecting without waiting: the transmitter sends DISC once its
+// frames are acknowledged, the receiver answers the DISC of the transmitter
+// while still acknowledging repeated I-frames. linkPoll drives the exchange,
+// which ends (successfully or not) within timeoutMs ("0" for
+// (nRetransmissions + 1) * timeout). Packets are no longer delivered.
+void linkShutdown(LinkConnection *conn, int timeoutMs);
+
+// Return TRUE once the disconnection started by linkShutdown has ended.
+int linkClosed(const LinkConnection *conn);
+
+// Disconnect (DISC / DISC / UA) if linkShutdown was not called, waiting for
+// it to end, then restore the port and free the connection. The link counters
+// are added to stats (if not NULL), which is printed if showStatistics == TRUE.
 // Return "1" on success or "-1" on error.
-int llclose(int fd, LinkLayer connectionParameters, int showStatistics, Statistics stats);
+int linkClose(LinkConnection *conn, int showStatistics, Statistics *stats);
+
+// Checks if a byte must be escaped inside a SET / UA parameters field (FLAG,
+// ESC and the flow control characters). I-frames use the codecs in frame_codec.h.
+int needsEscape(unsigned char byte);
 
 // Handles byte stuffing on the data
 // Returns the stuffed data and the size of the stuffed data
 unsigned char* byteStuffing(const unsigned char* buf, int bufSize, int* stuffedBufSize);
 
 // Handles byte destuffing on the data
-// Returns the destuffed data and the size of the destuffed data
+// Returns the destuffed data and the size of the destuffed data, or NULL if
+// the data ends with an unpaired ESC
 unsigned char* byteDestuffing(const unsigned char* stuffedBuf, int stuffedBufSize, int* destuffedBufSize);
 
+#pragma GCC visibility pop
+
 #endif // _LINK_LAYER_H_
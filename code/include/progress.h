@@ -0,0 +1,33 @@
+// Transfer progress header.
+
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+// Default interval between progress reports, in milliseconds.
+#define PROGRESS_INTERVAL_MS 500
+
+typedef struct
+{
+    int fd; // Where reports are written, "-1" for none
+    int isTerminal; // Reports overwrite each other on a terminal, one line each otherwise
+    int intervalMs;
+    const char *label;
+    unsigned long long total; // Bytes expected, "0" if unknown
+    unsigned long long done;
+    long long startMs;
+    long long lastReportMs;
+    unsigned long long lastReportBytes;
+} Progress;
+
+// Start tracking a transfer of total bytes, reporting to fd (e.g. STDERR_FILENO,
+// or "-1" to stay silent) at most once every intervalMs.
+void progressStart(Progress *progress, int fd, int intervalMs, const char *label, unsigned long long total);
+
+// Account for bytes transferred, reporting if the interval has passed.
+// Cheap enough to call for every packet.
+void progressAdd(Progress *progress, unsigned long long bytes);
+
+// Print the final report.
+void progressFinish(Progress *progress);
+
+#endif // _PROGRESS_H_
@@ -0,0 +1,32 @@
+// Serial port helpers header.
+
+#ifndef _SERIAL_PORT_H_
+#define _SERIAL_PORT_H_
+
+// Highest baud rate accepted for non-standard speeds.
+#define MAX_BAUD_RATE 4000000
+
+// Checks if the baud rate (in bits per second, e.g. 115200) can be set on this platform.
+// Returns TRUE (1) if supported or FALSE (0) otherwise.
+int serialIsValidBaudRate(int baudRate);
+
+// Sets the input and output speed of an already configured serial port.
+// Standard rates use the termios speed table; on Linux any other rate up to
+// MAX_BAUD_RATE is set through termios2 / BOTHER.
+// Returns "0" on success or "-1" on error.
+int serialSetBaudRate(int fd, int baudRate);
+
+// Output queue size (in bytes) that serialWrite keeps the kernel below.
+#define SERIAL_OUTQ_LIMIT 4096
+
+// Enables the driver low latency mode (ASYNC_LOW_LATENCY) where available.
+// Returns "0" on success or "-1" if the port does not support it.
+int serialSetLowLatency(int fd);
+
+// Writes the whole buffer, waiting while the kernel output queue (TIOCOUTQ)
+// holds more than SERIAL_OUTQ_LIMIT bytes so that the line is paced at
+// baudRate instead of overflowing the driver.
+// Returns the number of bytes written or "-1" on error.
+int serialWrite(int fd, const unsigned char* buf, int bufSize, int baudRate);
+
+#endif // _SERIAL_PORT_H_
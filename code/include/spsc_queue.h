@@ -0,0 +1,42 @@
+// Single-producer single-consumer queue header.
+
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <stdatomic.h>
+
+// Bounded lock-free ring of pointers, safe for exactly one thread pushing and
+// one thread popping at the same time.
+typedef struct {
+    void **items;
+    unsigned int mask;
+    atomic_uint head; // Next slot to pop, written by the consumer only
+    atomic_uint tail; // Next slot to push, written by the producer only
+} SpscQueue;
+
+// Initialize the queue with room for capacity items (rounded up to a power of two).
+// Return "0" on success or "-1" on error.
+int spscInit(SpscQueue *queue, unsigned int capacity);
+
+// Free the queue storage. Items still queued are not freed.
+void spscDestroy(SpscQueue *queue);
+
+// Push an item (not NULL) without blocking.
+// Return "1" on success or "0" if the queue is full.
+int spscPush(SpscQueue *queue, void *item);
+
+// Pop an item without blocking.
+// Return the item, or NULL if the queue is empty.
+void *spscPop(SpscQueue *queue);
+
+// Push an item, waiting while the queue is full. The wait gives up once
+// *cancel becomes non-zero (cancel may be NULL).
+// Return "1" on success or "0" if cancelled.
+int spscPushWait(SpscQueue *queue, void *item, atomic_int *cancel);
+
+// Pop an item, waiting while the queue is empty. The wait gives up once
+// *cancel becomes non-zero (cancel may be NULL).
+// Return the item, or NULL if cancelled.
+void *spscPopWait(SpscQueue *queue, atomic_int *cancel);
+
+#endif // _SPSC_QUEUE_H_
@@ -0,0 +1,86 @@
+// Protocol event trace header.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Trace file layout: a TraceHeader followed by a ring of capacity TraceEvents.
+// The file is memory mapped while tracing, so events survive a crash and
+// recording one costs a clock read and a few stores.
+#define TRACE_MAGIC 0x52544C4C // "LLTR" in little-endian
+#define TRACE_VERSION 2
+#define TRACE_DEFAULT_EVENTS 65536
+
+typedef enum
+{
+    TRACE_LINK_OPEN,     // seq: window size, value: baud rate
+    TRACE_LINK_CLOSE,
+    TRACE_SET_SENT,
+    TRACE_SET_RECEIVED,
+    TRACE_UA_SENT,
+    TRACE_UA_RECEIVED,
+    TRACE_DISC_SENT,
+    TRACE_DISC_RECEIVED,
+    TRACE_I_SENT,        // seq: Ns, value: frame bytes
+    TRACE_I_RESENT,      // seq: Ns, value: frame bytes
+    TRACE_I_RECEIVED,    // seq: Ns, value: payload bytes
+    TRACE_I_DAMAGED,     // seq: Ns
+    TRACE_I_DUPLICATE,   // seq: Ns
+    TRACE_RR_SENT,       // seq: Nr
+    TRACE_RR_RECEIVED,   // seq: Nr
+    TRACE_REJ_SENT,      // seq: Nr
+    TRACE_REJ_RECEIVED,  // seq: Nr
+    TRACE_SREJ_SENT,     // seq: Nr
+    TRACE_SREJ_RECEIVED, // seq: Nr
+    TRACE_TIMEOUT,       // value: consecutive timeouts
+    TRACE_PROBE_SENT,
+    TRACE_PROBE_ANSWERED, // value: round trip time in milliseconds
+    TRACE_PROBE_LOST,    // value: probes lost in a row
+    TRACE_EVENT_TYPES
+} TraceEventType;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t role; // LinkLayerRole of the first link traced
+    uint32_t capacity; // Events in the ring, a power of two
+    uint32_t reserved;
+    uint64_t startNs; // CLOCK_MONOTONIC when the trace was opened
+    atomic_ullong next; // Events recorded so far, the last capacity of them are kept
+} TraceHeader;
+
+typedef struct
+{
+    uint64_t timeNs; // Since startNs
+    uint8_t type;
+    uint8_t seq;
+    uint16_t link; // Connection the event belongs to, numbered from 1 in the order opened
+    uint32_t value;
+} TraceEvent;
+
+// Header of the open trace, NULL while tracing is disabled.
+extern TraceHeader *traceHeader;
+
+// Records an event if tracing is enabled. Safe from any thread and from
+// signal handlers.
+#define TRACE(link, type, seq, value) \
+    do { if (traceHeader != NULL) traceRecord((link), (type), (seq), (value)); } while (0)
+
+// Create (or truncate) filename and start tracing to it, keeping the last
+// capacity events (rounded up to a power of two).
+// Return "0" on success or "-1" on error.
+int traceOpen(const char *filename, int role, unsigned int capacity);
+
+// Record an event. Use TRACE instead, which skips the call when disabled.
+void traceRecord(int link, TraceEventType type, int seq, unsigned int value);
+
+// Stop tracing and close the trace file.
+void traceClose();
+
+// Return the name of an event type, for decoding.
+const char *traceEventName(int type);
+
+#endif // _TRACE_H_
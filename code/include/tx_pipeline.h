@@ -0,0 +1,64 @@
+// Transmit pipeline header.
+
+#ifndef _TX_PIPELINE_H_
+#define _TX_PIPELINE_H_
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "file_hash.h"
+#include "spsc_queue.h"
+
+// Frames (and packets) queued between stages
+#define TX_PIPELINE_DEPTH 16
+
+// Bytes of the file read at a time
+#define TX_READ_SIZE 65536
+
+// Shortest run of zeros sent as DP_ZERO in sparse mode. Shorter ones cost
+// less as data than the packet that would split the data around them.
+#define ZERO_RUN_MIN_SIZE 64
+
+// Item passed between stages: a data packet from the packetizer, then the
+// frame built from it by the framer.
+typedef struct {
+    unsigned char *data; // NULL marks the end of the file
+    int size;
+    unsigned int dataSize; // File bytes carried
+    int error; // TRUE if the stream ended because of an error
+} TxFrame;
+
+// Three stage transmit pipeline: a packetizer thread reads the file into data
+// packets, a framer thread stuffs them into frames (llframe), and the caller
+// transmits them (llwriteFrame) as the only user of the serial port.
+typedef struct {
+    int fd; // Link layer connection the frames are built for
+    FILE *file;
+    unsigned long long fileSize;
+    unsigned int chunkSize;
+    int sparse; // TRUE to send holes and runs of zeros as DP_ZERO
+    unsigned long long zeroBytes; // Sent as DP_ZERO so far
+    FileHash hash; // Of the data packetized so far, complete once the end of the file is taken
+    TxFrame *end; // End marker, allocated up front so it cannot fail to reach the transmitter
+    SpscQueue packets;
+    SpscQueue frames;
+    atomic_int stopping;
+    pthread_t packetizer;
+    pthread_t framer;
+} TxPipeline;
+
+// Start the stages for fileSize bytes of file, split in chunks of chunkSize bytes,
+// framed for the connection open on fd. With sparse, holes and runs of zeros
+// are sent as DP_ZERO packets.
+// Return "0" on success or "-1" on error.
+int txPipelineStart(TxPipeline *pipeline, int fd, FILE *file, unsigned long long fileSize, unsigned int chunkSize, int sparse);
+
+// Return the next frame to transmit (to be freed by the caller, its data
+// belongs to llwriteFrame), waiting for it if needed.
+TxFrame *txPipelineNext(TxPipeline *pipeline);
+
+// Stop the stages and free the pipeline, discarding frames not yet transmitted.
+// hash and zeroBytes stay valid, and are only final once the stages are stopped.
+void txPipelineStop(TxPipeline *pipeline);
+
+#endif // _TX_PIPELINE_H_
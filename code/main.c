@@ -10,38 +10,47 @@
 #define TIMEOUT 4
 
 // Arguments:
+//   [options]: Settings overriding the defaults below (see config.h)
 //   $1: /dev/ttySxx
 //   $2: tx | rx
 //   $3: filename
 int main(int argc, char *argv[])
 {
-    if (argc < 4)
+    Config config;
+    int N_TRIES = 3;
+
+    configDefaults(&config, BAUDRATE, N_TRIES, TIMEOUT);
+    config.link.fer = FER;
+
+    int first = configParseArgs(&config, argc, argv);
+    if (first == -1 || argc - first < 3)
     {
-        printf("Usage: %s /dev/ttySxx tx|rx filename\n", argv[0]);
+        configUsage(argv[0], "/dev/ttySxx tx|rx filename");
         exit(1);
     }
 
-    const char *serialPort = argv[1];
-    const char *role = argv[2];
-    const char *filename = argv[3];
-    int N_TRIES = 3;
-    
-
-    printf("Starting link-layer protocol application\n"
-           "  - Serial port: %s\n"
-           "  - Role: %s\n"
-           "  - Baudrate: %d\n"
-           "  - Number of tries: %d\n"
-           "  - Timeout: %d\n"
-           "  - Filename: %s\n",
-           serialPort,
-           role,
-           BAUDRATE,
-           N_TRIES,
-           TIMEOUT,
-           filename);
-
-    applicationLayer(serialPort, role, BAUDRATE, N_TRIES, TIMEOUT, filename);
+    const char *serialPort = argv[first];
+    const char *role = argv[first + 1];
+    const char *filename = argv[first + 2];
+
+    if (!config.link.quiet)
+    {
+        printf("Starting link-layer protocol application\n"
+               "  - Serial port: %s\n"
+               "  - Role: %s\n"
+               "  - Baudrate: %d\n"
+               "  - Number of tries: %d\n"
+               "  - Timeout: %d\n"
+               "  - Filename: %s\n",
+               serialPort,
+               role,
+               config.link.baudRate,
+               config.link.nRetransmissions,
+               config.link.timeout,
+               filename);
+    }
+
+    applicationLayerWithConfig(serialPort, role, filename, &config);
 
     return 0;
 }
@@ -0,0 +1,317 @@
+// AEAD implementation
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "aead.h"
+
+#define ROTL32(v, n) ((v) << (n) | (v) >> (32 - (n)))
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+#define POLY_MASK 0x3FFFFFF
+
+typedef struct {
+    uint32_t r[5]; // 26 bit limbs
+    uint32_t h[5];
+    uint32_t pad[4];
+} Poly1305;
+
+static uint32_t load32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void store32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+////////////////////////////////////////////////
+// CHACHA20
+////////////////////////////////////////////////
+
+static void chachaInit(uint32_t *state, const unsigned char *key, uint32_t counter, const unsigned char *nonce)
+{
+    state[0] = 0x61707865;
+    state[1] = 0x3320646E;
+    state[2] = 0x79622D32;
+    state[3] = 0x6B206574;
+    for (int i = 0; i < 8; i++) state[4 + i] = load32(key + 4 * i);
+    state[12] = counter;
+    for (int i = 0; i < 3; i++) state[13 + i] = load32(nonce + 4 * i);
+}
+
+static void chachaBlock(const uint32_t *state, unsigned char *out)
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12])
+        QUARTER_ROUND(x[1], x[5], x[9], x[13])
+        QUARTER_ROUND(x[2], x[6], x[10], x[14])
+        QUARTER_ROUND(x[3], x[7], x[11], x[15])
+        QUARTER_ROUND(x[0], x[5], x[10], x[15])
+        QUARTER_ROUND(x[1], x[6], x[11], x[12])
+        QUARTER_ROUND(x[2], x[7], x[8], x[13])
+        QUARTER_ROUND(x[3], x[4], x[9], x[14])
+    }
+    for (int i = 0; i < 16; i++) store32(out + 4 * i, x[i] + state[i]);
+}
+
+// XORs data with the key stream from the block in state on.
+static void chachaXor(uint32_t *state, unsigned char *data, int size)
+{
+    unsigned char block[64];
+
+    for (int offset = 0; offset < size; offset += 64) {
+        int blockSize = size - offset < 64 ? size - offset : 64;
+
+        chachaBlock(state, block);
+        state[12]++;
+        for (int i = 0; i < blockSize; i++) data[offset + i] ^= block[i];
+    }
+}
+
+////////////////////////////////////////////////
+// POLY1305
+////////////////////////////////////////////////
+
+static void polyInit(Poly1305 *poly, const unsigned char *key)
+{
+    // r is clamped as it is split in limbs
+    poly->r[0] = load32(key) & 0x3FFFFFF;
+    poly->r[1] = (load32(key + 3) >> 2) & 0x3FFFF03;
+    poly->r[2] = (load32(key + 6) >> 4) & 0x3FFC0FF;
+    poly->r[3] = (load32(key + 9) >> 6) & 0x3F03FFF;
+    poly->r[4] = (load32(key + 12) >> 8) & 0x00FFFFF;
+    memset(poly->h, 0, sizeof(poly->h));
+    for (int i = 0; i < 4; i++) poly->pad[i] = load32(key + 16 + 4 * i);
+}
+
+// Adds 16 byte blocks, the last one zero padded, to the accumulator:
+// h = (h + block + 2^128) * r mod 2^130 - 5.
+static void polyUpdate(Poly1305 *poly, const unsigned char *data, int size)
+{
+    const uint32_t *r = poly->r;
+    uint32_t s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+    uint32_t h0 = poly->h[0], h1 = poly->h[1], h2 = poly->h[2], h3 = poly->h[3], h4 = poly->h[4];
+    unsigned char last[16];
+
+    for (int offset = 0; offset < size; offset += 16) {
+        const unsigned char *m = data + offset;
+
+        if (size - offset < 16) {
+            memset(last, 0, sizeof(last));
+            memcpy(last, m, size - offset);
+            m = last;
+        }
+
+        h0 += load32(m) & POLY_MASK;
+        h1 += (load32(m + 3) >> 2) & POLY_MASK;
+        h2 += (load32(m + 6) >> 4) & POLY_MASK;
+        h3 += (load32(m + 9) >> 6) & POLY_MASK;
+        h4 += (load32(m + 12) >> 8) | 1 << 24;
+
+        uint64_t d0 = (uint64_t) h0 * r[0] + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r[1] + (uint64_t) h1 * r[0] + (uint64_t) h2 * s4 + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r[2] + (uint64_t) h1 * r[1] + (uint64_t) h2 * r[0] + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r[3] + (uint64_t) h1 * r[2] + (uint64_t) h2 * r[1] + (uint64_t) h3 * r[0] + (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r[4] + (uint64_t) h1 * r[3] + (uint64_t) h2 * r[2] + (uint64_t) h3 * r[1] + (uint64_t) h4 * r[0];
+
+        d1 += d0 >> 26;
+        h0 = d0 & POLY_MASK;
+        d2 += d1 >> 26;
+        h1 = d1 & POLY_MASK;
+        d3 += d2 >> 26;
+        h2 = d2 & POLY_MASK;
+        d4 += d3 >> 26;
+        h3 = d3 & POLY_MASK;
+        h4 = d4 & POLY_MASK;
+        h0 += (uint32_t) (d4 >> 26) * 5;
+        h1 += h0 >> 26;
+        h0 &= POLY_MASK;
+    }
+
+    poly->h[0] = h0;
+    poly->h[1] = h1;
+    poly->h[2] = h2;
+    poly->h[3] = h3;
+    poly->h[4] = h4;
+}
+
+// Reduces the accumulator fully and adds pad to get the tag.
+static void polyFinish(Poly1305 *poly, unsigned char *tag)
+{
+    uint32_t h0 = poly->h[0], h1 = poly->h[1], h2 = poly->h[2], h3 = poly->h[3], h4 = poly->h[4];
+
+    h2 += h1 >> 26;
+    h1 &= POLY_MASK;
+    h3 += h2 >> 26;
+    h2 &= POLY_MASK;
+    h4 += h3 >> 26;
+    h3 &= POLY_MASK;
+    h0 += (h4 >> 26) * 5;
+    h4 &= POLY_MASK;
+    h1 += h0 >> 26;
+    h0 &= POLY_MASK;
+
+    // g = h - (2^130 - 5), kept if it does not underflow, without branching
+    uint32_t g0 = h0 + 5;
+    uint32_t g1 = h1 + (g0 >> 26);
+    g0 &= POLY_MASK;
+    uint32_t g2 = h2 + (g1 >> 26);
+    g1 &= POLY_MASK;
+    uint32_t g3 = h3 + (g2 >> 26);
+    g2 &= POLY_MASK;
+    uint32_t g4 = h4 + (g3 >> 26) - (1 << 26);
+    g3 &= POLY_MASK;
+
+    uint32_t keepG = (g4 >> 31) - 1;
+    h0 = (h0 & ~keepG) | (g0 & keepG);
+    h1 = (h1 & ~keepG) | (g1 & keepG);
+    h2 = (h2 & ~keepG) | (g2 & keepG);
+    h3 = (h3 & ~keepG) | (g3 & keepG);
+    h4 = (h4 & ~keepG) | (g4 & keepG);
+
+    uint32_t words[4] = {
+        h0 | h1 << 26,
+        h1 >> 6 | h2 << 20,
+        h2 >> 12 | h3 << 14,
+        h3 >> 18 | h4 << 8,
+    };
+
+    uint64_t sum = 0;
+    for (int i = 0; i < 4; i++) {
+        sum = (uint64_t) words[i] + poly->pad[i] + (sum >> 32);
+        store32(tag + 4 * i, sum);
+    }
+}
+
+////////////////////////////////////////////////
+// AEAD
+////////////////////////////////////////////////
+
+// Computes the tag over the associated data and ciphertext, each zero padded
+// to 16 bytes, followed by their lengths. The one-time Poly1305 key is the
+// first ChaCha20 block, which leaves state at the block that encrypts.
+static void computeTag(uint32_t *state, const unsigned char *aad, int aadSize,
+                       const unsigned char *data, int size, unsigned char *tag)
+{
+    unsigned char block[64];
+    unsigned char lengths[16];
+    Poly1305 poly;
+
+    chachaBlock(state, block);
+    polyInit(&poly, block);
+
+    if (aadSize > 0) polyUpdate(&poly, aad, aadSize);
+    polyUpdate(&poly, data, size);
+
+    store32(lengths, aadSize);
+    store32(lengths + 4, 0);
+    store32(lengths + 8, size);
+    store32(lengths + 12, 0);
+    polyUpdate(&poly, lengths, 16);
+
+    polyFinish(&poly, tag);
+}
+
+void aeadSeal(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, int aadSize,
+              unsigned char *data, int size, unsigned char *tag)
+{
+    uint32_t state[16];
+    chachaInit(state, key, 1, nonce);
+    chachaXor(state, data, size);
+
+    chachaInit(state, key, 0, nonce);
+    computeTag(state, aad, aadSize, data, size, tag);
+}
+
+int aeadOpen(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, int aadSize,
+             unsigned char *data, int size, const unsigned char *tag)
+{
+    uint32_t state[16];
+    unsigned char expected[AEAD_TAG_SIZE];
+
+    chachaInit(state, key, 0, nonce);
+    computeTag(state, aad, aadSize, data, size, expected);
+
+    // Constant time, so a forger learns nothing from how long it takes
+    unsigned char diff = 0;
+    for (int i = 0; i < AEAD_TAG_SIZE; i++) diff |= expected[i] ^ tag[i];
+    if (diff != 0) return -1;
+
+    chachaInit(state, key, 1, nonce);
+    chachaXor(state, data, size);
+    return 0;
+}
+
+void aeadDeriveKey(const unsigned char *key, const unsigned char *context, unsigned char *derived)
+{
+    uint32_t state[16];
+    unsigned char block[64];
+
+    chachaInit(state, key, 0, context);
+    chachaBlock(state, block);
+    memcpy(derived, block, AEAD_KEY_SIZE);
+}
+
+static int hexValue(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+int aeadLoadKey(const char *path, unsigned char *key)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(fileno(file), &info) == 0 && (info.st_mode & (S_IRWXG | S_IRWXO))) {
+        printf("Warning: key file %s is accessible by other users\n", path);
+    }
+
+    unsigned char buf[2 * AEAD_KEY_SIZE + 2];
+    int size = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+
+    if (size == AEAD_KEY_SIZE) {
+        memcpy(key, buf, AEAD_KEY_SIZE);
+        return 0;
+    }
+
+    // Hex digits, optionally followed by a line break
+    while (size > 2 * AEAD_KEY_SIZE && (buf[size - 1] == '\n' || buf[size - 1] == '\r')) size--;
+
+    if (size == 2 * AEAD_KEY_SIZE) {
+        int i;
+        for (i = 0; i < AEAD_KEY_SIZE; i++) {
+            int high = hexValue(buf[2 * i]);
+            int low = hexValue(buf[2 * i + 1]);
+            if (high == -1 || low == -1) break;
+            key[i] = high << 4 | low;
+        }
+        if (i == AEAD_KEY_SIZE) return 0;
+    }
+
+    printf("Invalid key file %s: expected %d bytes or %d hex digits\n", path, AEAD_KEY_SIZE, 2 * AEAD_KEY_SIZE);
+    return -1;
+}
@@ -1,17 +1,227 @@
 // Application layer protocol implementation
 
 #include "application_layer.h"
+#include "command_input.h"
 #include "link_layer.h"
+#include "file_hash.h"
+#include "file_output.h"
+#include "progress.h"
+#include "tx_pipeline.h"
+
+#include <limits.h>
+#include <sys/mman.h>
+
+// In delta mode the receiver waits this long for the transmitter to start,
+// as it opens the link first (in milliseconds)
+#define SIGNATURES_CONNECT_TIMEOUT_MS (5 * 60 * 1000)
+
+// Bound on the blocks of the receiver's copy, to keep signatures in memory
+#define MAX_BASIS_BLOCKS (1 << 24)
+
+// The copy of the file the receiver already has, for delta transfers
+typedef struct {
+    unsigned char* map; // NULL if there is none
+    unsigned long long size;
+    unsigned int blockSize;
+} Basis;
+
+// Closes the received file, waiting for it to reach the disk.
+static void* finalizeOutput(void* arg)
+{
+    if (fileOutputClose((FileOutput*)arg) == -1) printf("Error writing file.\n");
+    return NULL;
+}
+
+static void closeBasis(Basis* basis)
+{
+    if (basis->map != NULL) munmap(basis->map, basis->size);
+    basis->map = NULL;
+    basis->size = 0;
+}
+
+// Maps the existing copy of filename, if any, as the basis of a delta transfer.
+static void openBasis(const char* filename, Basis* basis)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    basis->map = NULL;
+    basis->size = 0;
+    basis->blockSize = DELTA_MIN_BLOCK_SIZE;
+
+    if (fd < 0) return;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            basis->map = map;
+            basis->size = st.st_size;
+        }
+    }
+    close(fd);
+
+    basis->blockSize = deltaBlockSize(basis->size);
+    if (basis->size / basis->blockSize > MAX_BASIS_BLOCKS) closeBasis(basis);
+}
+
+// First stage of a delta transfer, run by the receiver with the link the
+// other way round: sends the signatures of the blocks of its copy of the file
+// (none if it has no copy).
+// Returns "0" on success or "-1" on error.
+static int sendSignatures(LinkLayer linkLayer, const Basis* basis)
+{
+    linkLayer.role = LLTX;
+    linkLayer.fastConnect = TRUE;
+    linkLayer.connectTimeout = SIGNATURES_CONNECT_TIMEOUT_MS;
+
+    int fd = llopen(linkLayer);
+    if (fd == -1) return -1;
+
+    unsigned long long count = basis->size / basis->blockSize;
+    unsigned long long packetSize = 0;
+    unsigned char* packet = createBasisPacket(basis->size, basis->blockSize, &packetSize);
+    int res = packet == NULL ? -1 : llwrite(fd, linkLayer, packet, packetSize);
+
+    free(packet);
+
+    for (unsigned long long i = 0; res != -1 && i < count; ) {
+        BlockSignature blocks[SIGNATURES_PER_PACKET];
+        unsigned int n = 0;
+
+        for (; n < SIGNATURES_PER_PACKET && i < count; n++, i++) {
+            const unsigned char* block = basis->map + i * basis->blockSize;
+            blocks[n].weak = deltaWeakChecksum(block, basis->blockSize);
+            blocks[n].strong = deltaStrongChecksum(block, basis->blockSize);
+        }
+
+        unsigned int signaturePacketSize = 0;
+        packet = createSignaturePacket(blocks, n, &signaturePacketSize);
+        res = packet == NULL ? -1 : llwrite(fd, linkLayer, packet, signaturePacketSize);
+        free(packet);
+    }
+
+    if (res != -1) {
+        packet = createControlPacket(CP_END, &packetSize);
+        res = packet == NULL ? -1 : llwrite(fd, linkLayer, packet, packetSize);
+        free(packet);
+    }
+
+    // Every packet was acknowledged, so a lost DISC / UA does not matter
+    llclose(fd, linkLayer, FALSE, NULL);
+    return res == -1 ? -1 : 0;
+}
+
+// First stage of a delta transfer on the transmitter: receives the block
+// signatures of the receiver's copy of the file and indexes them.
+// Returns "0" on success or "-1" on error.
+static int receiveSignatures(LinkLayer linkLayer, DeltaSignatures* signatures)
+{
+    linkLayer.role = LLRX;
+
+    int fd = llopen(linkLayer);
+    if (fd == -1) return -1;
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    unsigned long long basisSize = 0;
+    unsigned int blockSize = 0;
+    int packetSize;
+
+    while ((packetSize = llread(fd, linkLayer, packet)) != -1) {
+        if (packetSize > 0 && packet[0] == CP_START && parseControlPacket(packet, packetSize, &basisSize) == 0 &&
+            parseBlockSize(packet, packetSize, &blockSize) == 0) break;
+    }
+
+    int res = -1;
+
+    if (packetSize != -1 && blockSize >= DELTA_MIN_BLOCK_SIZE && blockSize <= DELTA_MAX_BLOCK_SIZE &&
+        basisSize / blockSize <= MAX_BASIS_BLOCKS) {
+        res = deltaSignaturesInit(signatures, blockSize, basisSize / blockSize);
+    }
+
+    unsigned int received = 0;
+
+    while (res != -1) {
+        packetSize = llread(fd, linkLayer, packet);
+
+        if (packetSize == -1) res = -1;
+        else if (packetSize > 0 && packet[0] == CP_END) break;
+        else {
+            int count = parseSignaturePacket(packet, packetSize, signatures->blocks + received, signatures->count - received);
+            if (count > 0) received += count;
+        }
+    }
+
+    llclose(fd, linkLayer, FALSE, NULL);
+
+    if (res == -1) {
+        deltaSignaturesFree(signatures);
+        return -1;
+    }
+
+    // Signatures are in block order, so a short list still matches its blocks
+    signatures->count = received;
+    deltaSignaturesIndex(signatures);
+    return 0;
+}
+
+// Finds the blocks of the basis asked for by a DP_COPY packet.
+// Returns their size, with the data in data, or "-1" if the packet is
+// malformed or the blocks are not in the basis.
+static long long copyFromBasis(const Basis* basis, const unsigned char* packet, unsigned int packetSize,
+                               const unsigned char** data)
+{
+    unsigned int block, count;
+    unsigned long long blocks = basis->size / basis->blockSize;
+
+    if (basis->map == NULL || parseCopyPacket(packet, packetSize, &block, &count) == -1) return -1;
+
+    // Bounded as by the encoder, so the size fits the unsigned int of the write and the hash
+    if (count > DELTA_MAX_COPY || block >= blocks || count > blocks - block) return -1;
+
+    *data = basis->map + (unsigned long long) block * basis->blockSize;
+    return (long long) count * basis->blockSize;
+}
 
 void applicationLayer(const char* serialPort, const char* role, int baudRate,
                       int nTries, int timeout, const char* filename)
 {
-    LinkLayer linkLayer;
+    Config config;
 
+    configDefaults(&config, baudRate, nTries, timeout);
+    config.link.fer = FER;
+    applicationLayerWithConfig(serialPort, role, filename, &config);
+}
+
+void applicationLayerWithConfig(const char* serialPort, const char* role, const char* filename, const Config* config)
+{
+    LinkLayer linkLayer = config->link;
+
+    // Quiet mode prints errors only, for batch jobs. Otherwise progress goes
+    // to progressFd (e.g. a status pipe), so it never mixes with stdout.
+    int quiet = linkLayer.quiet;
+    int progressFd = config->progressFd;
+
+    // Delta mode sends only what changed from the copy of the file the
+    // receiver already has. Both ends must enable it.
+    int delta = config->delta;
+
+    // Lines read from commandFd (e.g. a control pipe) while the file is sent
+    // go to the receiver as urgent messages, ahead of the file data. "-1" for none.
+    int commandFd = config->commandFd;
+
+    // Holes and runs of zeros in the file are sent as DP_ZERO packets, and
+    // left as holes by the receiver. Off for receivers that predate DP_ZERO.
+    int sparse = config->sparse;
+
+    // File data carried by each packet
+    unsigned int chunkSize = config->payloadSize - DP_HEADER_SIZE;
+
+    if (strlen(serialPort) >= sizeof(linkLayer.serialPort)) {
+        printf("Serial port name too long.\n");
+        return;
+    }
     strcpy(linkLayer.serialPort, serialPort);
-    linkLayer.baudRate = baudRate;
-    linkLayer.nRetransmissions = nTries;
-    linkLayer.timeout = timeout;
 
     if (!strcmp(role,"tx")) linkLayer.role = LLTX;
     else if (!strcmp(role, "rx")) linkLayer.role = LLRX;
@@ -19,9 +229,33 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
         printf("Invalid role.\n");
         return;
     }
+
+    // The link first runs the other way, for the receiver to send the block
+    // signatures of its copy of the file
+    DeltaSignatures signatures = {0};
+    Basis basis = {NULL, 0, 0};
+
+    if (delta) {
+        if (!quiet) printf("Exchanging block signatures...\n");
+
+        int res;
+        if (linkLayer.role == LLTX) res = receiveSignatures(linkLayer, &signatures);
+        else {
+            openBasis(filename, &basis);
+            res = sendSignatures(linkLayer, &basis);
+        }
+
+        if (res == -1) {
+            printf("Block signature exchange failed.\n");
+            closeBasis(&basis);
+            return;
+        }
+        if (!quiet && linkLayer.role == LLTX) {
+            printf("Matching against %u blocks of %u bytes.\n", signatures.count, signatures.blockSize);
+        }
+    }
     
-    system("clear");
-    printf("Establishing connection...\n");
+    if (!quiet) printf("Establishing connection...\n");
     
     clock_t t, total;
     
@@ -38,10 +272,20 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
         printf("Connection failed.\n");
         return;
     }
-    else printf("Connection established.\n");
+    else if (!quiet) printf("Connection established.\n");
     
     int n = 0;
     double sum = 0, sum_debit = 0;
+    // Outlives the switch: the finalizer thread is only joined after llclose
+    FileOutput output;
+    pthread_t finalizer;
+    int finalizing = FALSE;
+
+    // With a basis the file is rebuilt next to it, and only replaces it once verified
+    char outputName[PATH_MAX];
+    int verified = FALSE;
+
+    snprintf(outputName, sizeof(outputName), basis.map != NULL ? "%s.part" : "%s", filename);
 
     switch (linkLayer.role) {
         case LLTX: {
@@ -59,7 +303,7 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
             unsigned long long controlPacketSize = fileSize;
             unsigned char* controlPacket = createControlPacket(CP_START, &controlPacketSize);
 
-            printf("Sending data...\n");
+            if (!quiet) printf("Sending data...\n");
             
             t = clock();
             
@@ -71,58 +315,138 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
             sum += ((((double)t)) / CLOCKS_PER_SEC);
             sum_debit += check / ((((double)t)) / CLOCKS_PER_SEC);
                         
+            free(controlPacket);
+
             if (check == -1) {
                 printf("Error occurred!\n");
+                fclose(file);
                 break;
             }
 
-            free(controlPacket);
-
-            unsigned char* data = (unsigned char*)malloc(fileSize * sizeof(unsigned char));
-            fread(data, sizeof(unsigned char), fileSize, file);
+            Progress progress;
+            progressStart(&progress, quiet ? -1 : progressFd, PROGRESS_INTERVAL_MS, "Sent", fileSize);
 
-            unsigned long long remainingBytes = fileSize;
             int errorOccurred = FALSE;
+            unsigned long long fileHash = 0;
+            unsigned char* map = MAP_FAILED;
+
+            CommandInput commands;
+            int commandsRunning = commandFd >= 0 && commandInputStart(&commands, fd, commandFd) == 0;
+
+            if (signatures.count > 0 && fileSize > 0) {
+                map = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            }
+
+            if (map != MAP_FAILED) {
+                // Blocks the receiver has are sent as DP_COPY, the rest as usual
+                DeltaEncoder encoder;
+                DeltaOp op;
+                FileHash hash;
 
-            while (remainingBytes > 0) {
-                unsigned int packetSize = remainingBytes > (MAX_PAYLOAD_SIZE - 3) ? (MAX_PAYLOAD_SIZE - 3) : remainingBytes;
-                unsigned int dataSize = packetSize;
-                unsigned char* packet = createDataPacket(data, &packetSize);
+                deltaEncoderInit(&encoder, &signatures, map, fileSize, chunkSize);
+                fileHashInit(&hash);
+
+                while (deltaEncoderNext(&encoder, &op)) {
+                    unsigned int packetSize = op.size;
+                    unsigned char* packet = op.type == DELTA_COPY ? createCopyPacket(op.block, op.count, &packetSize)
+                                                                  : createDataPacket(map + op.offset, &packetSize);
+
+                    t = clock();
+
+                    long long bytesWritten = packet == NULL ? -1 : llwrite(fd, linkLayer, packet, packetSize);
+                    free(packet);
+
+                    t = clock() - t;
+
+                    n++;
+                    sum += ((((double)t)) / CLOCKS_PER_SEC);
+                    sum_debit += bytesWritten / ((((double)t)) / CLOCKS_PER_SEC);
+
+                    if (bytesWritten == -1) {
+                        printf("Error occurred!\n");
+                        errorOccurred = TRUE;
+                        break;
+                    }
+
+                    fileHashUpdate(&hash, map + op.offset, op.size);
+                    progressAdd(&progress, op.size);
+                }
+
+                fileHash = fileHashDigest(&hash);
+                munmap(map, fileSize);
+            }
+            else {
+                // Packets are read and framed by the pipeline threads while this one transmits
+                TxPipeline pipeline;
+
+                if (txPipelineStart(&pipeline, fd, file, fileSize, chunkSize, sparse) == -1) {
+                    printf("Error occurred!\n");
+                    if (commandsRunning) commandInputStop(&commands);
+                    progressFinish(&progress);
+                    fclose(file);
+                    break;
+                }
+
+                while (TRUE) {
+                    TxFrame* frame = txPipelineNext(&pipeline);
+
+                    if (frame->data == NULL) {
+                        if (frame->error) {
+                            printf("Error occurred!\n");
+                            errorOccurred = TRUE;
+                        }
+                        free(frame);
+                        break;
+                    }
+
+                    unsigned int dataSize = frame->dataSize;
                 
-                t = clock();
+                    t = clock();
                 
-                long long bytesWritten = llwrite(fd, linkLayer, packet, packetSize);
+                    long long bytesWritten = llwriteFrame(fd, linkLayer, frame->data, frame->size);
+                    free(frame);
             
-                t = clock() - t;
+                    t = clock() - t;
             
-                n++;
-                sum += ((((double)t)) / CLOCKS_PER_SEC);
-                sum_debit += bytesWritten / ((((double)t)) / CLOCKS_PER_SEC);
+                    n++;
+                    sum += ((((double)t)) / CLOCKS_PER_SEC);
+                    sum_debit += bytesWritten / ((((double)t)) / CLOCKS_PER_SEC);
                 
-                if (bytesWritten == -1) {
-                    printf("Error occurred!\n");
-                    errorOccurred = TRUE;
-                    break;
+                    if (bytesWritten == -1) {
+                        printf("Error occurred!\n");
+                        errorOccurred = TRUE;
+                        break;
+                    }
+
+                    progressAdd(&progress, dataSize);
                 }
 
-                printf("Bytes written: %d\n", dataSize);
-                printf("Bytes left: %lld\n", remainingBytes);
+                // The packetizer may still run after an error, so it is stopped before its totals are read
+                txPipelineStop(&pipeline);
 
-                remainingBytes -= (long long) dataSize;
-                data += dataSize;
-                free(packet);
+                fileHash = fileHashDigest(&pipeline.hash);
+                if (!quiet && pipeline.zeroBytes > 0) printf("%llu bytes sent as runs of zeros.\n", pipeline.zeroBytes);
             }
+            progressFinish(&progress);
+
+            // Commands still queued go out before CP_END
+            if (commandsRunning) commandInputStop(&commands);
 
-            if (errorOccurred) break;
+            if (errorOccurred) {
+                fclose(file);
+                break;
+            }
             
-            controlPacketSize = 0;
-            unsigned char* endPacket = createControlPacket(CP_END, &controlPacketSize);
+            unsigned char* endPacket = createEndPacket(fileHash, &controlPacketSize);
             
             t = clock();
             
-            check = llwrite(fd, linkLayer, endPacket, controlPacketSize);
+            check = endPacket == NULL ? -1 : llwrite(fd, linkLayer, endPacket, controlPacketSize);
             
             t = clock() - t;
+
+            free(endPacket);
+            fclose(file);
             
             if (check == -1) {
                 printf("Error occurred!\n");
@@ -132,19 +456,16 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
             n++;
             sum += ((((double)t)) / CLOCKS_PER_SEC);
             sum_debit += check / ((((double)t)) / CLOCKS_PER_SEC);
-             
-            free(endPacket);
-            fclose(file);
             break;
         }
         case LLRX: {
             unsigned char* controlPacket = (unsigned char*)malloc(MAX_PAYLOAD_SIZE * sizeof(unsigned char));
             
-            printf("Receiving data...\n");
+            if (!quiet) printf("Receiving data...\n");
             
             t = clock();
             
-            unsigned int controlPacketSize = llread(fd, linkLayer, controlPacket);
+            int controlPacketSize = llread(fd, linkLayer, controlPacket);
             
             t = clock() - t;
             
@@ -152,17 +473,35 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
             sum += ((((double)t)) / CLOCKS_PER_SEC);
             
             unsigned long long fileSize = 0;
-            while (parseControlPacket(controlPacket, controlPacketSize, &fileSize) < 0) {
+            while (controlPacketSize != -1 && parseControlPacket(controlPacket, controlPacketSize, &fileSize) < 0) {
                 controlPacketSize = llread(fd, linkLayer, controlPacket);
             }
 
-            FILE* newFile = fopen(filename, "wb");
-            while (TRUE) {
-                unsigned char* dataPacket = (unsigned char*)malloc(MAX_PAYLOAD_SIZE * sizeof(unsigned char));
-                
+            if (controlPacketSize == -1) {
+                free(controlPacket);
+                break;
+            }
+
+            if (fileOutputOpen(&output, outputName, fileSize, OUTPUT_MMAP) == -1) {
+                free(controlPacket);
+                break;
+            }
+
+            unsigned char* dataPacket = (unsigned char*)malloc(MAX_PAYLOAD_SIZE * sizeof(unsigned char));
+            unsigned char* receivedData = (unsigned char*)malloc(MAX_PAYLOAD_SIZE * sizeof(unsigned char));
+            unsigned long long offset = 0;
+
+            // Hashed as it arrives, to check against the hash in CP_END
+            FileHash hash;
+            fileHashInit(&hash);
+
+            Progress progress;
+            progressStart(&progress, quiet ? -1 : progressFd, PROGRESS_INTERVAL_MS, "Received", fileSize);
+
+            while (dataPacket != NULL && receivedData != NULL) {
                 t = clock();
                 
-                unsigned int dataPacketSize = llread(fd, linkLayer, dataPacket);
+                int dataPacketSize = llread(fd, linkLayer, dataPacket);
                 
                 t = clock() - t;
                 
@@ -173,19 +512,76 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
                     break;
                 }
 
-                if (dataPacket[0] == CP_END) break;
+                if (dataPacketSize < 1) continue;
+
+                if (dataPacket[0] == CP_END) {
+                    unsigned long long fileHash = 0;
+
+                    if (parseFileHash(dataPacket, dataPacketSize, &fileHash) == -1) {
+                        if (!quiet) printf("No file hash to check.\n");
+                    }
+                    else if (fileHash != fileHashDigest(&hash)) {
+                        printf("File hash mismatch: received file is corrupt.\n");
+                    }
+                    else {
+                        verified = TRUE;
+                        if (!quiet) printf("File hash verified (XXH64 %016llx).\n", fileHash);
+                    }
+                    break;
+                }
+
+                if (dataPacket[0] == DP_MESSAGE) {
+                    int messageSize = parseMessagePacket(dataPacket, dataPacketSize, receivedData);
+                    if (messageSize >= 0) printf("Message: %.*s\n", messageSize, receivedData);
+                    continue;
+                }
 
-                unsigned char *receivedData = (unsigned char*)malloc(MAX_PAYLOAD_SIZE * sizeof(unsigned char));
-                int dataSize = parseDataPacket(dataPacket, dataPacketSize, receivedData);
+                if (dataPacket[0] == DP_ZERO) {
+                    unsigned int runSize;
+
+                    if (parseZeroPacket(dataPacket, dataPacketSize, &runSize) == -1) {
+                        printf("Malformed data packet.\n");
+                        break;
+                    }
+                    if (fileOutputZeroAt(&output, offset, runSize) == -1) {
+                        printf("Error writing file.\n");
+                        break;
+                    }
+                    fileHashUpdateZeros(&hash, runSize);
+                    offset += runSize;
+                    progressAdd(&progress, runSize);
+                    continue;
+                }
 
-                if (receivedData == NULL) break;
+                const unsigned char* data = receivedData;
+                long long dataSize;
+
+                if (dataPacket[0] == DP_COPY) dataSize = copyFromBasis(&basis, dataPacket, dataPacketSize, &data);
+                else dataSize = parseDataPacket(dataPacket, dataPacketSize, receivedData);
+
+                // Skipping it would write the rest of the file at the wrong offsets
+                if (dataSize < 0) {
+                    printf("Malformed data packet.\n");
+                    break;
+                }
 
-                fwrite(receivedData, sizeof(unsigned char), dataSize, newFile);
-                free(dataPacket);
+                if (fileOutputWriteAt(&output, offset, data, dataSize) == -1) {
+                    printf("Error writing file.\n");
+                    break;
+                }
+                fileHashUpdate(&hash, data, dataSize);
+                offset += dataSize;
+                progressAdd(&progress, dataSize);
             }
+            progressFinish(&progress);
 
+            free(dataPacket);
+            free(receivedData);
             free(controlPacket);
-            fclose(newFile);
+
+            // Half close: the file is synced to disk while the link disconnects
+            finalizing = pthread_create(&finalizer, NULL, finalizeOutput, &output) == 0;
+            if (!finalizing) finalizeOutput(&output);
             break;
         }
         default:
@@ -193,12 +589,27 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
             return;
     }
     
-    printf("Disconnecting...\n");
+    if (!quiet) printf("Disconnecting...\n");
     
     stats.data_time = sum / n;
     stats.debit = sum_debit / n;
     
-    if (llclose(fd, linkLayer, TRUE, stats) == -1) {
+    int closed = llclose(fd, linkLayer, !quiet, &stats);
+
+    if (finalizing) pthread_join(finalizer, NULL);
+
+    if (basis.map != NULL) {
+        closeBasis(&basis);
+
+        if (!verified) {
+            printf("Keeping the previous copy of %s.\n", filename);
+            unlink(outputName);
+        }
+        else if (rename(outputName, filename) == -1) perror("rename");
+    }
+    deltaSignaturesFree(&signatures);
+
+    if (closed == -1) {
         printf("Error occurred while disconnecting!\n");
         return;
     }
@@ -207,8 +618,10 @@ void applicationLayer(const char* serialPort, const char* role, int baudRate,
 
     double total_time = ((double)total) / CLOCKS_PER_SEC;
 
-    printf("Total time taken: %.5f seconds\n", total_time);
-    printf("Connection finished.\n");
+    if (!quiet) {
+        printf("Total time taken: %.5f seconds\n", total_time);
+        printf("Connection finished.\n");
+    }
 
 }
 
@@ -264,26 +677,106 @@ unsigned char* createDataPacket(unsigned char* data, unsigned int* packetSize) {
     return packet;
 }
 
+unsigned char* createEndPacket(unsigned long long fileHash, unsigned long long* packetSize) {
+    unsigned char* packet = (unsigned char*)malloc(CP_HEADER_SIZE + 8);
+
+    if (packet == NULL) return NULL;
+
+    packet[0] = CP_END;
+    packet[1] = CP_T_FILE_HASH;
+    packet[2] = 8;
+
+    for (int i = 0; i < 8; i++) {
+        packet[CP_HEADER_SIZE + i] = (fileHash >> (8 * (7 - i))) & 0xFF;
+    }
+
+    *packetSize = CP_HEADER_SIZE + 8;
+    return packet;
+}
+
+unsigned char* createBasisPacket(unsigned long long basisSize, unsigned int blockSize, unsigned long long* packetSize) {
+    unsigned long long size = basisSize;
+    unsigned char* startPacket = createControlPacket(CP_START, &size);
+
+    if (startPacket == NULL) return NULL;
+
+    unsigned char* packet = (unsigned char*)realloc(startPacket, size + 2 + 4);
+
+    if (packet == NULL) {
+        free(startPacket);
+        return NULL;
+    }
+
+    packet[size] = CP_T_BLOCK_SIZE;
+    packet[size + 1] = 4;
+    for (int i = 0; i < 4; i++) {
+        packet[size + 2 + i] = (blockSize >> (8 * (3 - i))) & 0xFF;
+    }
+
+    *packetSize = size + 2 + 4;
+    return packet;
+}
+
+// Looks for the value of a TLV of the given type and length in a control packet.
+// Returns it, or NULL if there is none.
+static const unsigned char* findControlParam(const unsigned char* packet, unsigned int packetSize,
+                                             unsigned char type, unsigned char length) {
+    unsigned int i = 1;
+
+    while (i + 2 <= packetSize && i + 2 + packet[i + 1] <= packetSize) {
+        if (packet[i] == type && packet[i + 1] == length) return packet + i + 2;
+        i += 2 + packet[i + 1];
+    }
+    return NULL;
+}
+
+int parseFileHash(const unsigned char* packet, unsigned int packetSize, unsigned long long* fileHash) {
+    const unsigned char* value = findControlParam(packet, packetSize, CP_T_FILE_HASH, 8);
+
+    if (value == NULL) return -1;
+
+    *fileHash = 0;
+    for (int i = 0; i < 8; i++) *fileHash = (*fileHash << 8) | value[i];
+    return 0;
+}
+
+int parseBlockSize(const unsigned char* packet, unsigned int packetSize, unsigned int* blockSize) {
+    const unsigned char* value = findControlParam(packet, packetSize, CP_T_BLOCK_SIZE, 4);
+
+    if (value == NULL) return -1;
+
+    *blockSize = 0;
+    for (int i = 0; i < 4; i++) *blockSize = (*blockSize << 8) | value[i];
+    return 0;
+}
+
 int parseControlPacket(unsigned char* packet, unsigned int packetSize, unsigned long long* fileSize) {
-    if (packet[0] != CP_START && packet[0] != CP_END) return -1;
+    if (packetSize < 1 || (packet[0] != CP_START && packet[0] != CP_END)) return -1;
 
     if (packet[0] == CP_START) {
-        if (packet[1] != CP_T_FILE_SIZE) return -1;
+        if (packetSize < CP_HEADER_SIZE || packet[1] != CP_T_FILE_SIZE) return -1;
 
+        // The size must fit in the packet and in 64 bits
         unsigned int fileSizeBytes = packet[2];
+        if (fileSizeBytes > sizeof(*fileSize) || CP_HEADER_SIZE + fileSizeBytes > packetSize) return -1;
+
         *fileSize = 0;
 
         for (unsigned int i = 0; i < fileSizeBytes; i++) {
-            *fileSize |= packet[CP_HEADER_SIZE + i] << (8 * (fileSizeBytes - i - 1));
+            *fileSize = (*fileSize << 8) | packet[CP_HEADER_SIZE + i];
         }
     }
     return 0;
 }
 
-int parseDataPacket(unsigned char* packet, unsigned int packetSize, unsigned char* data) {
-    if (packet[0] != DP_DATA) return -1;
+// Copies the data of a packet with the DP_DATA layout and the given type.
+// Returns the data size, or "-1" if the packet is malformed.
+static int parsePacketData(const unsigned char* packet, unsigned int packetSize, unsigned char type, unsigned char* data) {
+    if (packetSize < DP_HEADER_SIZE || packet[0] != type) return -1;
 
+    // Never trust the length field beyond the bytes actually received
     unsigned int dataSize = (packet[1] << 8) | packet[2];
+    if (dataSize > packetSize - DP_HEADER_SIZE) return -1;
 
     for (unsigned int i = 0; i < dataSize; i++) {
         data[i] = packet[DP_HEADER_SIZE + i];
@@ -291,3 +784,106 @@ int parseDataPacket(unsigned char* packet, unsigned int packetSize, unsigned cha
 
     return dataSize;
 }
+
+int parseDataPacket(unsigned char* packet, unsigned int packetSize, unsigned char* data) {
+    return parsePacketData(packet, packetSize, DP_DATA, data);
+}
+
+unsigned char* createMessagePacket(const unsigned char* message, unsigned int* packetSize) {
+    if (*packetSize > MAX_MESSAGE_SIZE) return NULL;
+
+    unsigned char* packet = createDataPacket((unsigned char*)message, packetSize);
+    if (packet != NULL) packet[0] = DP_MESSAGE;
+    return packet;
+}
+
+int parseMessagePacket(const unsigned char* packet, unsigned int packetSize, unsigned char* message) {
+    return parsePacketData(packet, packetSize, DP_MESSAGE, message);
+}
+
+unsigned char* createSignaturePacket(const BlockSignature* blocks, unsigned int count, unsigned int* packetSize) {
+    unsigned int dataSize = count * DELTA_SIGNATURE_SIZE;
+    unsigned char* packet = (unsigned char*)malloc(DP_HEADER_SIZE + dataSize);
+
+    if (packet == NULL) return NULL;
+
+    packet[0] = DP_SIGNATURES;
+    packet[1] = (dataSize >> 8) & 0xFF;
+    packet[2] = dataSize & 0xFF;
+
+    unsigned char* p = packet + DP_HEADER_SIZE;
+    for (unsigned int i = 0; i < count; i++) {
+        for (int j = 0; j < 4; j++) *p++ = (blocks[i].weak >> (8 * (3 - j))) & 0xFF;
+        for (int j = 0; j < 8; j++) *p++ = (blocks[i].strong >> (8 * (7 - j))) & 0xFF;
+    }
+
+    *packetSize = DP_HEADER_SIZE + dataSize;
+    return packet;
+}
+
+int parseSignaturePacket(const unsigned char* packet, unsigned int packetSize, BlockSignature* blocks, unsigned int maxCount) {
+    if (packetSize < DP_HEADER_SIZE || packet[0] != DP_SIGNATURES) return -1;
+
+    unsigned int dataSize = (packet[1] << 8) | packet[2];
+    if (dataSize > packetSize - DP_HEADER_SIZE || dataSize % DELTA_SIGNATURE_SIZE != 0) return -1;
+
+    unsigned int count = dataSize / DELTA_SIGNATURE_SIZE;
+    if (count > maxCount) return -1;
+
+    const unsigned char* p = packet + DP_HEADER_SIZE;
+    for (unsigned int i = 0; i < count; i++) {
+        blocks[i].weak = 0;
+        blocks[i].strong = 0;
+        for (int j = 0; j < 4; j++) blocks[i].weak = (blocks[i].weak << 8) | *p++;
+        for (int j = 0; j < 8; j++) blocks[i].strong = (blocks[i].strong << 8) | *p++;
+    }
+
+    return count;
+}
+
+unsigned char* createCopyPacket(unsigned int block, unsigned int count, unsigned int* packetSize) {
+    unsigned char* packet = (unsigned char*)malloc(7);
+
+    if (packet == NULL) return NULL;
+
+    packet[0] = DP_COPY;
+    for (int i = 0; i < 4; i++) packet[1 + i] = (block >> (8 * (3 - i))) & 0xFF;
+    packet[5] = (count >> 8) & 0xFF;
+    packet[6] = count & 0xFF;
+
+    *packetSize = 7;
+    return packet;
+}
+
+int parseCopyPacket(const unsigned char* packet, unsigned int packetSize, unsigned int* block, unsigned int* count) {
+    if (packetSize < 7 || packet[0] != DP_COPY) return -1;
+
+    *block = 0;
+    for (int i = 0; i < 4; i++) *block = (*block << 8) | packet[1 + i];
+    *count = (packet[5] << 8) | packet[6];
+
+    return *count == 0 ? -1 : 0;
+}
+
+unsigned char* createZeroPacket(unsigned int size, unsigned int* packetSize) {
+    if (size == 0 || size > MAX_ZERO_RUN_SIZE) return NULL;
+
+    unsigned char* packet = (unsigned char*)malloc(5);
+
+    if (packet == NULL) return NULL;
+
+    packet[0] = DP_ZERO;
+    for (int i = 0; i < 4; i++) packet[1 + i] = (size >> (8 * (3 - i))) & 0xFF;
+
+    *packetSize = 5;
+    return packet;
+}
+
+int parseZeroPacket(const unsigned char* packet, unsigned int packetSize, unsigned int* size) {
+    if (packetSize < 5 || packet[0] != DP_ZERO) return -1;
+
+    *size = 0;
+    for (int i = 0; i < 4; i++) *size = (*size << 8) | packet[1 + i];
+
+    return *size == 0 || *size > MAX_ZERO_RUN_SIZE ? -1 : 0;
+}
@@ -0,0 +1,190 @@
+// Capture implementation
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+static long long clockUs(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Writes a varint into out.
+// Returns the bytes written.
+static int putVarint(unsigned char *out, unsigned long long value)
+{
+    int size = 0;
+
+    while (value >= 0x80) {
+        out[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[size++] = value;
+    return size;
+}
+
+// Returns "0" on success or "-1" if the file ends first.
+static int getVarint(FILE *file, unsigned long long *value)
+{
+    *value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) return -1;
+
+        *value |= (unsigned long long) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+Capture *captureOpen(const char *path, const LinkLayer *params, unsigned int randomSeed)
+{
+    Capture *capture = (Capture *)malloc(sizeof(Capture));
+    if (capture == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    capture->file = fopen(path, "wb");
+    if (capture->file == NULL) {
+        perror(path);
+        free(capture);
+        return NULL;
+    }
+
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.role = params->role;
+    header.fcs = params->fcs;
+    header.baudRate = params->baudRate;
+    header.maxBaudRate = params->maxBaudRate;
+    header.nRetransmissions = params->nRetransmissions;
+    header.timeout = params->timeout;
+    header.windowSize = params->windowSize;
+    header.flowControl = params->flowControl;
+    header.keepalive = params->keepalive;
+    header.fastConnect = params->fastConnect;
+    header.randomSeed = randomSeed;
+    header.fer = params->fer;
+    header.startTime = clockUs(CLOCK_REALTIME);
+
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1 || fflush(capture->file) != 0) {
+        perror(path);
+        fclose(capture->file);
+        free(capture);
+        return NULL;
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    capture->lastUs = clockUs(CLOCK_MONOTONIC);
+    return capture;
+}
+
+void captureRecord(Capture *capture, CaptureRecordType type, const unsigned char *data, int size)
+{
+    unsigned char prefix[24];
+
+    pthread_mutex_lock(&capture->lock);
+
+    long long now = clockUs(CLOCK_MONOTONIC);
+
+    for (int offset = 0; offset < size; offset += CAPTURE_MAX_RECORD) {
+        int recordSize = size - offset > CAPTURE_MAX_RECORD ? CAPTURE_MAX_RECORD : size - offset;
+        int prefixSize = putVarint(prefix, now - capture->lastUs);
+
+        prefix[prefixSize++] = type;
+        prefixSize += putVarint(prefix + prefixSize, recordSize);
+
+        fwrite(prefix, 1, prefixSize, capture->file);
+        fwrite(data + offset, 1, recordSize, capture->file);
+        capture->lastUs = now;
+    }
+    fflush(capture->file);
+
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void captureClose(Capture *capture)
+{
+    if (capture == NULL) return;
+
+    fclose(capture->file);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
+
+int captureReaderOpen(CaptureReader *reader, const char *path)
+{
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 || reader->header.magic != CAPTURE_MAGIC) {
+        printf("%s is not a capture file\n", path);
+        fclose(reader->file);
+        return -1;
+    }
+    if (reader->header.version != CAPTURE_VERSION) {
+        printf("Unsupported capture version %d\n", reader->header.version);
+        fclose(reader->file);
+        return -1;
+    }
+    reader->timeUs = 0;
+    return 0;
+}
+
+int captureReaderNext(CaptureReader *reader, CaptureRecord *record)
+{
+    unsigned long long delta;
+    unsigned long long size;
+
+    int first = fgetc(reader->file);
+    if (first == EOF) return 0;
+    ungetc(first, reader->file);
+
+    if (getVarint(reader->file, &delta) == -1) return -1;
+
+    int type = fgetc(reader->file);
+
+    if (type == EOF || getVarint(reader->file, &size) == -1 || size > CAPTURE_MAX_RECORD) return -1;
+    if (fread(record->data, 1, size, reader->file) != size) return -1;
+
+    reader->timeUs += delta;
+    record->type = type;
+    record->timeUs = reader->timeUs;
+    record->size = size;
+    return 1;
+}
+
+void captureReaderClose(CaptureReader *reader)
+{
+    fclose(reader->file);
+}
+
+void captureLinkLayer(const CaptureHeader *header, const char *serialPort, LinkLayer *params)
+{
+    memset(params, 0, sizeof(LinkLayer));
+    strncpy(params->serialPort, serialPort, sizeof(params->serialPort) - 1);
+    params->role = header->role;
+    params->baudRate = header->baudRate;
+    params->maxBaudRate = header->maxBaudRate;
+    params->nRetransmissions = header->nRetransmissions;
+    params->timeout = header->timeout;
+    params->windowSize = header->windowSize;
+    params->fastConnect = header->fastConnect;
+    params->flowControl = header->flowControl;
+    params->fcs = header->fcs;
+    params->keepalive = header->keepalive;
+    params->randomSeed = header->randomSeed;
+    params->fer = header->fer;
+    params->quiet = TRUE;
+}
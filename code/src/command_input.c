@@ -0,0 +1,76 @@
+// Operator command input implementation
+
+#include <poll.h>
+#include <stdlib.h>
+
+#include "application_layer.h"
+#include "command_input.h"
+#include "link_layer.h"
+
+// How often the reader checks whether it must stop, in milliseconds
+#define STOP_CHECK_INTERVAL_MS 100
+
+// Queues a command as an urgent message.
+static void queueCommand(CommandInput *input, const char *command, unsigned int size)
+{
+    unsigned int packetSize = size;
+    unsigned char *packet = createMessagePacket((const unsigned char *)command, &packetSize);
+
+    if (packet == NULL || llqueue(input->fd, packet, packetSize, LINK_PRIORITY_URGENT) == -1) {
+        printf("Error queueing command.\n");
+    }
+    free(packet);
+}
+
+static void *readCommands(void *arg)
+{
+    CommandInput *input = (CommandInput *)arg;
+    char line[MAX_MESSAGE_SIZE];
+    unsigned int lineSize = 0;
+    int overlong = FALSE;
+
+    while (!atomic_load(&input->stopping)) {
+        struct pollfd pollFd = {input->inputFd, POLLIN, 0};
+        if (poll(&pollFd, 1, STOP_CHECK_INTERVAL_MS) <= 0) continue;
+
+        char buffer[256];
+        int res = read(input->inputFd, buffer, sizeof(buffer));
+        if (res <= 0) break;
+
+        for (int i = 0; i < res; i++) {
+            if (buffer[i] == '\n') {
+                if (lineSize > 0) queueCommand(input, line, lineSize);
+                lineSize = 0;
+                overlong = FALSE;
+            }
+            else if (lineSize < sizeof(line)) line[lineSize++] = buffer[i];
+            else if (!overlong) {
+                printf("Command too long, truncated to %d bytes.\n", MAX_MESSAGE_SIZE);
+                overlong = TRUE;
+            }
+        }
+    }
+
+    // A last command without a newline
+    if (lineSize > 0) queueCommand(input, line, lineSize);
+    return NULL;
+}
+
+int commandInputStart(CommandInput *input, int fd, int inputFd)
+{
+    input->fd = fd;
+    input->inputFd = inputFd;
+    atomic_init(&input->stopping, FALSE);
+
+    if (pthread_create(&input->thread, NULL, readCommands, input) != 0) {
+        printf("Error creating thread.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void commandInputStop(CommandInput *input)
+{
+    atomic_store(&input->stopping, TRUE);
+    pthread_join(input->thread, NULL);
+}
@@ -0,0 +1,336 @@
+// Configuration implementation
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "frame_pool.h"
+
+// Smallest payload, to fit the control packets
+#define MIN_PAYLOAD_SIZE 16
+
+typedef enum
+{
+    SETTING_INT,
+    SETTING_BOOL,
+    SETTING_PATH, // Into a char[100] of LinkLayer
+} SettingType;
+
+typedef struct
+{
+    const char *name;
+    SettingType type;
+    size_t offset; // In Config
+    long min;
+    long max;
+} Setting;
+
+#define LINK_FIELD(field) (offsetof(Config, link) + offsetof(LinkLayer, field))
+
+static const Setting settings[] = {
+    {"baud", SETTING_INT, LINK_FIELD(baudRate), 1, INT_MAX},
+    {"max-baud", SETTING_INT, LINK_FIELD(maxBaudRate), 0, INT_MAX},
+    {"timeout", SETTING_INT, LINK_FIELD(timeout), 1, INT_MAX / 1000},
+    {"retries", SETTING_INT, LINK_FIELD(nRetransmissions), 1, INT_MAX},
+    {"connect-timeout", SETTING_INT, LINK_FIELD(connectTimeout), 0, INT_MAX},
+    {"fast-connect", SETTING_BOOL, LINK_FIELD(fastConnect), 0, 0},
+    {"payload", SETTING_INT, offsetof(Config, payloadSize), MIN_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE},
+    {"window", SETTING_INT, LINK_FIELD(windowSize), 1, MAX_WINDOW_SIZE},
+    {"fer", SETTING_INT, LINK_FIELD(fer), 0, 100},
+    {"low-latency", SETTING_BOOL, LINK_FIELD(lowLatency), 0, 0},
+    {"keepalive", SETTING_INT, LINK_FIELD(keepalive), 0, INT_MAX},
+    {"key", SETTING_PATH, LINK_FIELD(keyFile), 0, 0},
+    {"trace", SETTING_PATH, LINK_FIELD(traceFile), 0, 0},
+    {"capture", SETTING_PATH, LINK_FIELD(captureFile), 0, 0},
+    {"frame-threads", SETTING_INT, LINK_FIELD(frameThreads), 0, FRAME_POOL_MAX_THREADS},
+    {"seed", SETTING_INT, LINK_FIELD(randomSeed), 0, INT_MAX},
+    {"quiet", SETTING_BOOL, LINK_FIELD(quiet), 0, 0},
+    {"progress-fd", SETTING_INT, offsetof(Config, progressFd), -1, INT_MAX},
+    {"delta", SETTING_BOOL, offsetof(Config, delta), 0, 0},
+    {"sparse", SETTING_BOOL, offsetof(Config, sparse), 0, 0},
+    {"command-fd", SETTING_INT, offsetof(Config, commandFd), -1, INT_MAX},
+};
+
+#define N_SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+static const char *fcsNames[] = {"bcc2", "crc16", "aead"};
+static const char *flowNames[] = {"none", "rts-cts", "xon-xoff"};
+
+void configDefaults(Config *config, int baudRate, int nTries, int timeout)
+{
+    memset(config, 0, sizeof(Config));
+
+    config->link.baudRate = baudRate;
+    config->link.maxBaudRate = 0;
+    config->link.nRetransmissions = nTries;
+    config->link.timeout = timeout;
+    config->link.windowSize = 1;
+    config->link.fastConnect = FALSE;
+    config->link.connectTimeout = 0;
+    config->link.flowControl = FLOW_NONE;
+    config->link.lowLatency = FALSE;
+    config->link.fcs = FCS_BCC2;
+    config->link.fer = 0;
+    config->link.traceFile[0] = '\0';
+    config->link.captureFile[0] = '\0';
+    config->link.keyFile[0] = '\0';
+    config->link.randomSeed = 0;
+    config->link.quiet = FALSE;
+    config->link.keepalive = 0;
+    config->link.frameThreads = 0;
+
+    config->payloadSize = MAX_PAYLOAD_SIZE;
+    config->progressFd = STDERR_FILENO;
+    config->delta = FALSE;
+    config->sparse = TRUE;
+    config->commandFd = -1;
+}
+
+static const Setting *findSetting(const char *name)
+{
+    for (unsigned int i = 0; i < N_SETTINGS; i++) {
+        if (!strcmp(settings[i].name, name)) return &settings[i];
+    }
+    return NULL;
+}
+
+// Looks a value up in a list of names.
+// Returns its index, or "-1" if it is none of them.
+static int findName(const char *value, const char **names, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(names[i], value)) return i;
+    }
+    return -1;
+}
+
+// Returns "0" on success or "-1" if value is not a boolean.
+static int parseBool(const char *value, int *result)
+{
+    static const char *yes[] = {"yes", "1", "true", "on"};
+    static const char *no[] = {"no", "0", "false", "off"};
+
+    if (findName(value, yes, 4) != -1) *result = TRUE;
+    else if (findName(value, no, 4) != -1) *result = FALSE;
+    else return -1;
+    return 0;
+}
+
+// Returns "0" on success or "-1" if value is not a number within [min, max].
+static int parseInt(const char *value, long min, long max, int *result)
+{
+    char *end;
+
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < min || number > max) return -1;
+
+    *result = number;
+    return 0;
+}
+
+int configSet(Config *config, const char *name, const char *value)
+{
+    if (!strcmp(name, "fcs")) {
+        int fcs = findName(value, fcsNames, 3);
+        if (fcs == -1) {
+            printf("Invalid fcs: %s (expected bcc2, crc16 or aead)\n", value);
+            return -1;
+        }
+        config->link.fcs = fcs;
+        return 0;
+    }
+    if (!strcmp(name, "flow")) {
+        int flow = findName(value, flowNames, 3);
+        if (flow == -1) {
+            printf("Invalid flow: %s (expected none, rts-cts or xon-xoff)\n", value);
+            return -1;
+        }
+        config->link.flowControl = flow;
+        return 0;
+    }
+
+    const Setting *setting = findSetting(name);
+    if (setting == NULL) {
+        printf("Unknown setting: %s\n", name);
+        return -1;
+    }
+
+    void *field = (char *)config + setting->offset;
+
+    switch (setting->type) {
+        case SETTING_INT:
+            if (parseInt(value, setting->min, setting->max, (int *)field) == -1) {
+                printf("Invalid %s: %s (expected %ld to %ld)\n", name, value, setting->min, setting->max);
+                return -1;
+            }
+            return 0;
+        case SETTING_BOOL:
+            if (parseBool(value, (int *)field) == -1) {
+                printf("Invalid %s: %s (expected yes or no)\n", name, value);
+                return -1;
+            }
+            return 0;
+        case SETTING_PATH:
+            if (strlen(value) >= sizeof(config->link.traceFile)) {
+                printf("Invalid %s: path longer than %d characters\n", name, (int) sizeof(config->link.traceFile) - 1);
+                return -1;
+            }
+            strcpy((char *)field, value);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Strips the blanks around a string in place.
+// Returns the start of the stripped string.
+static char *strip(char *text)
+{
+    while (isspace((unsigned char) *text)) text++;
+
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char) end[-1])) end--;
+    *end = '\0';
+
+    return text;
+}
+
+int configLoadFile(Config *config, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[CONFIG_MAX_LINE];
+    int lineNumber = 0;
+    int res = 0;
+
+    while (res == 0 && fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char *text = strip(line);
+        if (*text == '\0') continue;
+
+        char *equals = strchr(text, '=');
+        if (equals == NULL) {
+            printf("%s:%d: expected name = value\n", path, lineNumber);
+            res = -1;
+            break;
+        }
+        *equals = '\0';
+
+        if (configSet(config, strip(text), strip(equals + 1)) == -1) {
+            printf("%s:%d: invalid setting\n", path, lineNumber);
+            res = -1;
+        }
+    }
+
+    fclose(file);
+    return res;
+}
+
+// Splits "--name=value" or "--name value" (which takes the next argument).
+// Returns the number of arguments used, or "-1" if the value is missing.
+static int splitOption(int argc, char *argv[], int i, char *name, int nameSize, const char **value)
+{
+    const char *option = argv[i] + 2;
+    const char *equals = strchr(option, '=');
+    int length = equals != NULL ? equals - option : (int) strlen(option);
+
+    if (length >= nameSize) length = nameSize - 1;
+    memcpy(name, option, length);
+    name[length] = '\0';
+
+    if (equals != NULL) {
+        *value = equals + 1;
+        return 1;
+    }
+
+    // Booleans may go without a value
+    const Setting *setting = findSetting(name);
+    int ignored;
+
+    if (setting != NULL && setting->type == SETTING_BOOL &&
+        (i + 1 >= argc || parseBool(argv[i + 1], &ignored) == -1)) {
+        *value = "yes";
+        return 1;
+    }
+
+    if (i + 1 >= argc) {
+        printf("Missing value for --%s\n", name);
+        return -1;
+    }
+    *value = argv[i + 1];
+    return 2;
+}
+
+int configParseArgs(Config *config, int argc, char *argv[])
+{
+    char name[CONFIG_MAX_LINE];
+    const char *value;
+    int first = 1;
+
+    // The config file first, whatever its place among the options
+    for (int i = 1; i < argc && strncmp(argv[i], "--", 2) == 0 && argv[i][2] != '\0'; ) {
+        if (!strcmp(argv[i], "--help")) return -1;
+
+        int used = splitOption(argc, argv, i, name, sizeof(name), &value);
+        if (used == -1) return -1;
+
+        if (!strcmp(name, "config") && configLoadFile(config, value) == -1) return -1;
+        i += used;
+    }
+
+    while (first < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (argv[first][2] == '\0') return first + 1;
+
+        int used = splitOption(argc, argv, first, name, sizeof(name), &value);
+        if (used == -1) return -1;
+
+        if (strcmp(name, "config") != 0 && configSet(config, name, value) == -1) return -1;
+        first += used;
+    }
+    return first;
+}
+
+void configUsage(const char *program, const char *arguments)
+{
+    printf("Usage: %s [options] %s\n"
+           "Options (also accepted as \"name = value\" lines in a config file):\n"
+           "  --config FILE           read settings from FILE, overridden by the other options\n"
+           "  --baud N                baud rate\n"
+           "  --max-baud N            highest baud rate to negotiate (0 to keep --baud)\n"
+           "  --timeout S             frame timeout in seconds\n"
+           "  --retries N             transmissions of a frame before giving up\n"
+           "  --connect-timeout MS    deadline for the connection (0 for none)\n"
+           "  --fast-connect [yes|no] retry SET with exponential backoff\n"
+           "  --payload N             largest packet, up to %d bytes\n"
+           "  --window N              frames in flight, up to %d\n"
+           "  --fcs bcc2|crc16|aead   frame check sequence (aead needs --key)\n"
+           "  --fer N                 simulated frame error rate, in percentage\n"
+           "  --flow none|rts-cts|xon-xoff\n"
+           "  --low-latency [yes|no]  low latency mode of the serial driver\n"
+           "  --keepalive MS          idle time before probing the link (0 for none)\n"
+           "  --key FILE              shared key, to encrypt and authenticate the link\n"
+           "  --trace FILE            binary event trace (see tools/tracedump)\n"
+           "  --capture FILE          traffic capture (see tools/replay)\n"
+           "  --frame-threads N       cores building large I-frames (0 for the calling thread alone)\n"
+           "  --seed N                seed of the simulated errors (0 for a random one)\n"
+           "  --quiet [yes|no]        print errors only\n"
+           "  --progress-fd FD        where progress goes (-1 for nowhere)\n"
+           "  --delta [yes|no]        send only what changed from the receiver's copy\n"
+           "  --sparse [yes|no]       send holes and runs of zeros as such\n"
+           "  --command-fd FD         send lines read from FD as operator messages (-1 for none)\n",
+           program, arguments, MAX_PAYLOAD_SIZE, MAX_WINDOW_SIZE);
+}
@@ -0,0 +1,193 @@
+// Delta transfer implementation
+
+#include <stdlib.h>
+
+#include "delta.h"
+#include "file_hash.h"
+
+#define WEAK_A(weak) ((weak) & 0xFFFF)
+#define WEAK_B(weak) ((weak) >> 16)
+
+unsigned int deltaBlockSize(unsigned long long basisSize)
+{
+    unsigned int blockSize = DELTA_MIN_BLOCK_SIZE;
+
+    while (blockSize < DELTA_MAX_BLOCK_SIZE && (unsigned long long) blockSize * blockSize < basisSize) blockSize *= 2;
+    return blockSize;
+}
+
+// The rsync checksum: a is the sum of the bytes and b the sum of the prefix
+// sums, both modulo 2^16.
+uint32_t deltaWeakChecksum(const unsigned char *data, unsigned int size)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    for (unsigned int i = 0; i < size; i++) {
+        a += data[i];
+        b += a;
+    }
+    return (a & 0xFFFF) | (b & 0xFFFF) << 16;
+}
+
+// Slides the window of a weak checksum one byte: out leaves it, in enters it.
+static uint32_t rollWeakChecksum(uint32_t weak, unsigned int size, unsigned char out, unsigned char in)
+{
+    uint32_t a = WEAK_A(weak) - out + in;
+    uint32_t b = WEAK_B(weak) - size * out + a;
+    return (a & 0xFFFF) | (b & 0xFFFF) << 16;
+}
+
+uint64_t deltaStrongChecksum(const unsigned char *data, unsigned int size)
+{
+    FileHash hash;
+    fileHashInit(&hash);
+    fileHashUpdate(&hash, data, size);
+    return fileHashDigest(&hash);
+}
+
+static unsigned int bucketOf(const DeltaSignatures *signatures, uint32_t weak)
+{
+    return (weak * 0x9E3779B1u) >> 8 & signatures->bucketMask;
+}
+
+int deltaSignaturesInit(DeltaSignatures *signatures, unsigned int blockSize, unsigned int count)
+{
+    unsigned int buckets = 1;
+    while (buckets < 2 * count) buckets *= 2;
+
+    signatures->blockSize = blockSize;
+    signatures->count = count;
+    signatures->bucketMask = buckets - 1;
+    signatures->blocks = malloc((count > 0 ? count : 1) * sizeof(BlockSignature));
+    signatures->buckets = malloc(buckets * sizeof(int));
+    signatures->chain = malloc((count > 0 ? count : 1) * sizeof(int));
+
+    if (signatures->blocks == NULL || signatures->buckets == NULL || signatures->chain == NULL) {
+        deltaSignaturesFree(signatures);
+        return -1;
+    }
+    return 0;
+}
+
+void deltaSignaturesIndex(DeltaSignatures *signatures)
+{
+    for (unsigned int i = 0; i <= signatures->bucketMask; i++) signatures->buckets[i] = -1;
+
+    // Chained backwards, so the first of identical blocks is found first
+    for (int i = signatures->count - 1; i >= 0; i--) {
+        unsigned int bucket = bucketOf(signatures, signatures->blocks[i].weak);
+        signatures->chain[i] = signatures->buckets[bucket];
+        signatures->buckets[bucket] = i;
+    }
+}
+
+void deltaSignaturesFree(DeltaSignatures *signatures)
+{
+    free(signatures->blocks);
+    free(signatures->buckets);
+    free(signatures->chain);
+    signatures->blocks = NULL;
+    signatures->buckets = NULL;
+    signatures->chain = NULL;
+    signatures->count = 0;
+}
+
+// Looks for a block of the basis equal to the one at data. The strong
+// checksum is only computed if some weak checksum matches, and blocks
+// following the pending copy are preferred so that it keeps growing.
+// Returns the index of the block, or "-1" if there is none.
+static int findBlock(const DeltaEncoder *encoder, const unsigned char *data)
+{
+    const DeltaSignatures *signatures = encoder->signatures;
+    uint64_t strong = 0;
+    int strongKnown = 0;
+    int found = -1;
+
+    for (int i = signatures->buckets[bucketOf(signatures, encoder->weak)]; i != -1; i = signatures->chain[i]) {
+        if (signatures->blocks[i].weak != encoder->weak) continue;
+
+        if (!strongKnown) {
+            strong = deltaStrongChecksum(data, signatures->blockSize);
+            strongKnown = 1;
+        }
+        if (signatures->blocks[i].strong != strong) continue;
+
+        if (encoder->copyCount > 0 && (unsigned int) i == encoder->copyBlock + encoder->copyCount) return i;
+        if (found == -1) found = i;
+    }
+    return found;
+}
+
+void deltaEncoderInit(DeltaEncoder *encoder, const DeltaSignatures *signatures,
+                      const unsigned char *data, unsigned long long size, unsigned int maxLiteral)
+{
+    encoder->signatures = signatures;
+    encoder->data = data;
+    encoder->size = size;
+    encoder->maxLiteral = maxLiteral;
+    encoder->pos = 0;
+    encoder->literalStart = 0;
+    encoder->weak = 0;
+    encoder->rolling = 0;
+    encoder->copyBlock = 0;
+    encoder->copyCount = 0;
+}
+
+int deltaEncoderNext(DeltaEncoder *encoder, DeltaOp *op)
+{
+    unsigned int blockSize = encoder->signatures->blockSize;
+
+    while (1) {
+        int block = -1;
+
+        if (encoder->signatures->count > 0 && encoder->pos + blockSize <= encoder->size) {
+            if (!encoder->rolling) {
+                encoder->weak = deltaWeakChecksum(encoder->data + encoder->pos, blockSize);
+                encoder->rolling = 1;
+            }
+            block = findBlock(encoder, encoder->data + encoder->pos);
+        }
+
+        // A pending copy ends at anything but the block after it
+        if (encoder->copyCount > 0 &&
+            ((unsigned int) block != encoder->copyBlock + encoder->copyCount || encoder->copyCount == DELTA_MAX_COPY)) {
+            op->type = DELTA_COPY;
+            op->block = encoder->copyBlock;
+            op->count = encoder->copyCount;
+            op->size = encoder->copyCount * blockSize;
+            op->offset = encoder->pos - op->size;
+            encoder->copyCount = 0;
+            return 1;
+        }
+
+        unsigned long long literal = encoder->pos - encoder->literalStart;
+
+        if (literal > 0 && (block != -1 || literal == encoder->maxLiteral || encoder->pos == encoder->size)) {
+            op->type = DELTA_LITERAL;
+            op->offset = encoder->literalStart;
+            op->size = literal;
+            encoder->literalStart = encoder->pos;
+            return 1;
+        }
+
+        if (block != -1) {
+            if (encoder->copyCount == 0) encoder->copyBlock = block;
+            encoder->copyCount++;
+            encoder->pos += blockSize;
+            encoder->literalStart = encoder->pos;
+            encoder->rolling = 0;
+            continue;
+        }
+
+        if (encoder->pos == encoder->size) return 0;
+
+        // No match here: slide the window one byte
+        if (encoder->rolling && encoder->pos + blockSize < encoder->size) {
+            encoder->weak = rollWeakChecksum(encoder->weak, blockSize, encoder->data[encoder->pos],
+                                             encoder->data[encoder->pos + blockSize]);
+        }
+        else encoder->rolling = 0;
+        encoder->pos++;
+    }
+}
@@ -0,0 +1,139 @@
+// File hash implementation
+
+#include <string.h>
+
+#include "file_hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// Reads a little-endian value whatever the host byte order.
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = ROTL(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t hash, uint64_t acc)
+{
+    hash ^= round64(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+// Consumes whole 32 byte stripes.
+// Returns the bytes consumed.
+static unsigned int consumeStripes(FileHash *hash, const unsigned char *data, unsigned int size)
+{
+    unsigned int consumed = 0;
+
+    while (size - consumed >= 32) {
+        const unsigned char *p = data + consumed;
+        hash->acc[0] = round64(hash->acc[0], read64(p));
+        hash->acc[1] = round64(hash->acc[1], read64(p + 8));
+        hash->acc[2] = round64(hash->acc[2], read64(p + 16));
+        hash->acc[3] = round64(hash->acc[3], read64(p + 24));
+        consumed += 32;
+    }
+    return consumed;
+}
+
+void fileHashInit(FileHash *hash)
+{
+    hash->acc[0] = PRIME1 + PRIME2;
+    hash->acc[1] = PRIME2;
+    hash->acc[2] = 0;
+    hash->acc[3] = -PRIME1;
+    hash->totalSize = 0;
+    hash->bufferSize = 0;
+}
+
+void fileHashUpdate(FileHash *hash, const unsigned char *data, unsigned int size)
+{
+    hash->totalSize += size;
+
+    if (hash->bufferSize > 0) {
+        unsigned int fill = 32 - hash->bufferSize;
+        if (fill > size) fill = size;
+
+        memcpy(hash->buffer + hash->bufferSize, data, fill);
+        hash->bufferSize += fill;
+        data += fill;
+        size -= fill;
+
+        if (hash->bufferSize < 32) return;
+        consumeStripes(hash, hash->buffer, 32);
+        hash->bufferSize = 0;
+    }
+
+    unsigned int consumed = consumeStripes(hash, data, size);
+
+    memcpy(hash->buffer, data + consumed, size - consumed);
+    hash->bufferSize = size - consumed;
+}
+
+void fileHashUpdateZeros(FileHash *hash, unsigned long long size)
+{
+    static const unsigned char zeros[65536];
+
+    while (size > 0) {
+        unsigned int chunk = size > sizeof(zeros) ? sizeof(zeros) : size;
+
+        fileHashUpdate(hash, zeros, chunk);
+        size -= chunk;
+    }
+}
+
+uint64_t fileHashDigest(const FileHash *hash)
+{
+    uint64_t digest;
+
+    if (hash->totalSize >= 32) {
+        digest = ROTL(hash->acc[0], 1) + ROTL(hash->acc[1], 7) + ROTL(hash->acc[2], 12) + ROTL(hash->acc[3], 18);
+        for (int i = 0; i < 4; i++) digest = mergeRound(digest, hash->acc[i]);
+    }
+    else digest = hash->acc[2] + PRIME5;
+
+    digest += hash->totalSize;
+
+    const unsigned char *p = hash->buffer;
+    const unsigned char *end = hash->buffer + hash->bufferSize;
+
+    for (; p + 8 <= end; p += 8) {
+        digest ^= round64(0, read64(p));
+        digest = ROTL(digest, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        digest ^= (uint64_t) read32(p) * PRIME1;
+        digest = ROTL(digest, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        digest ^= *p * PRIME5;
+        digest = ROTL(digest, 11) * PRIME1;
+    }
+
+    digest ^= digest >> 33;
+    digest *= PRIME2;
+    digest ^= digest >> 29;
+    digest *= PRIME3;
+    digest ^= digest >> 32;
+    return digest;
+}
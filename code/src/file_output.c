@@ -0,0 +1,151 @@
+// Received file output implementation
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_output.h"
+
+static int openStdio(FileOutput *output, const char *filename)
+{
+    output->mode = OUTPUT_STDIO;
+    output->stream = fopen(filename, "wb");
+
+    if (output->stream == NULL) {
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+int fileOutputOpen(FileOutput *output, const char *filename, unsigned long long size, FileOutputMode mode)
+{
+    output->fd = -1;
+    output->stream = NULL;
+    output->map = NULL;
+    output->size = size;
+    output->end = 0;
+
+    if (mode == OUTPUT_STDIO || size == 0) return openStdio(output, filename);
+
+    output->mode = OUTPUT_MMAP;
+    output->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (output->fd < 0) {
+        perror(filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(output->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(output->fd);
+        return openStdio(output, filename);
+    }
+
+    // Reserve every block up front so the file is not fragmented as it grows
+    int res = posix_fallocate(output->fd, 0, size);
+    if (res != 0 && ftruncate(output->fd, size) == -1) {
+        perror("ftruncate");
+        close(output->fd);
+        return -1;
+    }
+
+    output->map = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, output->fd, 0);
+
+    if (output->map == MAP_FAILED) {
+        perror("mmap");
+        output->map = NULL;
+        close(output->fd);
+        return openStdio(output, filename);
+    }
+
+    madvise(output->map, size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int fileOutputWriteAt(FileOutput *output, unsigned long long offset, const unsigned char *data, unsigned int dataSize)
+{
+    if (output->mode == OUTPUT_STDIO) {
+        if (offset != output->end) return -1;
+        if (fwrite(data, sizeof(unsigned char), dataSize, output->stream) != dataSize) return -1;
+    }
+    else {
+        if (offset > output->size || dataSize > output->size - offset) return -1;
+        memcpy(output->map + offset, data, dataSize);
+    }
+
+    if (offset + dataSize > output->end) output->end = offset + dataSize;
+    return 0;
+}
+
+int fileOutputZeroAt(FileOutput *output, unsigned long long offset, unsigned long long size)
+{
+    if (output->mode == OUTPUT_STDIO) {
+        if (offset != output->end) return -1;
+
+        // Seeking past the end leaves a hole, but pipes need the zeros
+        if (fseeko(output->stream, size, SEEK_CUR) == -1) {
+            static const unsigned char zeros[4096];
+
+            for (unsigned long long left = size; left > 0;) {
+                unsigned int chunk = left > sizeof(zeros) ? sizeof(zeros) : left;
+
+                if (fwrite(zeros, sizeof(unsigned char), chunk, output->stream) != chunk) return -1;
+                left -= chunk;
+            }
+        }
+    }
+    else {
+        if (offset > output->size || size > output->size - offset) return -1;
+
+        // The new file already reads as zeros there. Give back the blocks
+        // fileOutputOpen reserved, for the whole pages in the run: the pages
+        // at its edges may share blocks with data written through the map.
+        long pageSize = sysconf(_SC_PAGESIZE);
+        unsigned long long start = (offset + pageSize - 1) / pageSize * pageSize;
+        unsigned long long end = (offset + size) / pageSize * pageSize;
+
+        if (end > start) fallocate(output->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+    }
+
+    if (offset + size > output->end) output->end = offset + size;
+    return 0;
+}
+
+int fileOutputClose(FileOutput *output)
+{
+    if (output->mode == OUTPUT_STDIO) {
+        int res = fflush(output->stream) == 0 ? 0 : -1;
+
+        // A run of zeros at the end was only seeked over
+        if (ftello(output->stream) != -1 && ftruncate(fileno(output->stream), output->end) == -1) res = -1;
+
+        // Pipes cannot be synced
+        if (fsync(fileno(output->stream)) == -1 && errno != EINVAL) res = -1;
+        if (fclose(output->stream) != 0) res = -1;
+        return res;
+    }
+
+    int res = 0;
+
+    if (munmap(output->map, output->size) == -1) {
+        perror("munmap");
+        res = -1;
+    }
+    if (output->end < output->size && ftruncate(output->fd, output->end) == -1) {
+        perror("ftruncate");
+        res = -1;
+    }
+    if (fsync(output->fd) == -1) {
+        perror("fsync");
+        res = -1;
+    }
+    if (close(output->fd) == -1) res = -1;
+
+    return res;
+}
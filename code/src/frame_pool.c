@@ -0,0 +1,288 @@
+// Frame pool implementation
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frame_pool.h"
+
+#define CRC16_POLYNOMIAL 0x1021
+
+typedef struct FrameJob FrameJob;
+
+typedef struct Segment {
+    FrameJob *job;
+    const unsigned char *data;
+    int size;
+    unsigned int fcs; // Of this segment alone, started from 0
+    int escapes; // Bytes that get escaped
+    unsigned char *out; // Its place in the frame, for the second pass
+    struct Segment *next; // In the pool queue
+} Segment;
+
+struct FrameJob {
+    FcsType fcs;
+    int escapeMask;
+    int stuffing; // Second pass
+    int pending; // Segments of the current pass not done yet, under the pool lock
+    int count;
+    Segment segments[FRAME_POOL_MAX_THREADS];
+};
+
+struct FramePool {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Segments queued, or stopping
+    pthread_cond_t done; // Some job finished a pass
+    Segment *queueHead;
+    Segment *queueTail;
+    int stopping;
+    int workers;
+    pthread_t threads[FRAME_POOL_MAX_THREADS];
+};
+
+// Multiplies two polynomials modulo the CRC-16 polynomial.
+static unsigned int crc16MulMod(unsigned int a, unsigned int b)
+{
+    unsigned int product = 0;
+
+    for (int i = 15; i >= 0; i--) {
+        product = ((product << 1) & 0xFFFF) ^ (product & 0x8000 ? CRC16_POLYNOMIAL : 0);
+        if (b >> i & 1) product ^= a;
+    }
+    return product;
+}
+
+// The CRC is linear: started from crcFirst instead of 0, it changes by
+// crcFirst * x^(8 * secondSize), what feeding zero bytes alone would do.
+unsigned int crc16Combine(unsigned int crcFirst, unsigned int crcSecond, unsigned long long secondSize)
+{
+    unsigned int shift = 1;
+    unsigned int power = 0x0100; // x^8, a byte
+
+    for (; secondSize > 0; secondSize >>= 1) {
+        if (secondSize & 1) shift = crc16MulMod(shift, power);
+        power = crc16MulMod(power, power);
+    }
+    return crc16MulMod(crcFirst, shift) ^ crcSecond;
+}
+
+static void scanSegment(Segment *segment)
+{
+    const unsigned char *data = segment->data;
+    int mask = segment->job->escapeMask;
+    unsigned int fcs = 0;
+    int escapes = 0;
+
+    if (segment->job->fcs == FCS_CRC16) {
+        for (int i = 0; i < segment->size; i++) {
+            fcs = FCS_UPDATE_CRC16(fcs, data[i]);
+            escapes += (frameByteClass[data[i]] & mask) != 0;
+        }
+    }
+    else {
+        for (int i = 0; i < segment->size; i++) {
+            fcs = FCS_UPDATE_BCC2(fcs, data[i]);
+            escapes += (frameByteClass[data[i]] & mask) != 0;
+        }
+    }
+    segment->fcs = fcs;
+    segment->escapes = escapes;
+}
+
+// Stuffs a byte into out.
+// Returns the bytes written.
+static int stuffByte(unsigned char *out, unsigned char byte, int mask)
+{
+    if (frameByteClass[byte] & mask) {
+        out[0] = ESC;
+        out[1] = byte ^ 0x20;
+        return 2;
+    }
+    out[0] = byte;
+    return 1;
+}
+
+static void stuffSegment(Segment *segment)
+{
+    unsigned char *out = segment->out;
+    int mask = segment->job->escapeMask;
+
+    for (int i = 0; i < segment->size; i++) out += stuffByte(out, segment->data[i], mask);
+}
+
+// Runs a segment of the current pass of its job. Called with the pool lock
+// held (pool may be NULL), which is released while working.
+static void runSegment(FramePool *pool, Segment *segment)
+{
+    if (pool != NULL) pthread_mutex_unlock(&pool->lock);
+
+    if (segment->job->stuffing) stuffSegment(segment);
+    else scanSegment(segment);
+
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    if (--segment->job->pending == 0) pthread_cond_broadcast(&pool->done);
+}
+
+static Segment *takeSegment(FramePool *pool)
+{
+    Segment *segment = pool->queueHead;
+
+    if (segment != NULL) {
+        pool->queueHead = segment->next;
+        if (pool->queueHead == NULL) pool->queueTail = NULL;
+    }
+    return segment;
+}
+
+// Runs a pass over every segment of the job: the first segment on the calling
+// thread, the others wherever a thread is free, the caller included.
+static void runPass(FramePool *pool, FrameJob *job)
+{
+    if (pool == NULL || job->count == 1) {
+        for (int i = 0; i < job->count; i++) runSegment(NULL, &job->segments[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    job->pending = job->count;
+
+    for (int i = 1; i < job->count; i++) {
+        Segment *segment = &job->segments[i];
+        segment->next = NULL;
+        if (pool->queueTail != NULL) pool->queueTail->next = segment;
+        else pool->queueHead = segment;
+        pool->queueTail = segment;
+    }
+    pthread_cond_broadcast(&pool->work);
+
+    runSegment(pool, &job->segments[0]);
+
+    while (job->pending > 0) {
+        Segment *segment = takeSegment(pool);
+        if (segment != NULL) runSegment(pool, segment);
+        else pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *workerThread(void *arg)
+{
+    FramePool *pool = (FramePool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (TRUE) {
+        Segment *segment = takeSegment(pool);
+
+        if (segment != NULL) runSegment(pool, segment);
+        else if (pool->stopping) break;
+        else pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Stops and joins the first count workers.
+static void stopWorkers(FramePool *pool, int count)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = TRUE;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < count; i++) pthread_join(pool->threads[i], NULL);
+}
+
+FramePool *framePoolCreate(int workers)
+{
+    if (workers < 0) workers = 0;
+    if (workers > FRAME_POOL_MAX_THREADS - 1) workers = FRAME_POOL_MAX_THREADS - 1;
+
+    FramePool *pool = (FramePool *)malloc(sizeof(FramePool));
+    if (pool == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->queueHead = pool->queueTail = NULL;
+    pool->stopping = FALSE;
+    pool->workers = workers;
+
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, workerThread, pool) != 0) {
+            printf("Error creating frame pool threads.\n");
+            stopWorkers(pool, i);
+            pool->workers = 0;
+            framePoolDestroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void framePoolDestroy(FramePool *pool)
+{
+    if (pool == NULL) return;
+
+    stopWorkers(pool, pool->workers);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+int framePoolEncode(FramePool *pool, unsigned char address, FcsType fcs, int escapeFlowControl,
+                    const unsigned char *buf, int bufSize, unsigned char control, unsigned char *frame)
+{
+    if (bufSize < 1) return -1;
+
+    FrameJob job;
+    job.fcs = fcs;
+    job.escapeMask = escapeFlowControl ? ESCAPE_FLOW : ESCAPE_BASIC;
+    job.stuffing = FALSE;
+    job.count = bufSize / FRAME_POOL_MIN_SEGMENT;
+    if (pool == NULL || job.count < 1) job.count = 1;
+    if (pool != NULL && job.count > pool->workers + 1) job.count = pool->workers + 1;
+
+    for (int i = 0; i < job.count; i++) {
+        int start = (long long) bufSize * i / job.count;
+        int end = (long long) bufSize * (i + 1) / job.count;
+
+        job.segments[i].job = &job;
+        job.segments[i].data = buf + start;
+        job.segments[i].size = end - start;
+    }
+
+    runPass(pool, &job);
+
+    // Combine the partial FCS and place each segment after the escapes before it
+    unsigned int frameFcs = fcs == FCS_CRC16 ? FCS_INIT_CRC16 : FCS_INIT_BCC2;
+    int j = FH_SIZE;
+
+    for (int i = 0; i < job.count; i++) {
+        Segment *segment = &job.segments[i];
+
+        if (fcs == FCS_CRC16) frameFcs = crc16Combine(frameFcs, segment->fcs, segment->size);
+        else frameFcs ^= segment->fcs;
+
+        segment->out = frame + j;
+        j += segment->size + segment->escapes;
+    }
+
+    job.stuffing = TRUE;
+    runPass(pool, &job);
+
+    frame[0] = FLAG;
+    frame[1] = address;
+    frame[2] = control;
+    frame[3] = address ^ control;
+
+    for (int i = 0; i < fcsSize(fcs); i++) {
+        unsigned char byte = fcs == FCS_CRC16 ? FCS_BYTE_CRC16(frameFcs, i) : FCS_BYTE_BCC2(frameFcs, i);
+        j += stuffByte(frame + j, byte, job.escapeMask);
+    }
+    frame[j++] = FLAG;
+    return j;
+}
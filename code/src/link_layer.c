@@ -1,650 +1,2365 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "aead.h"
+#include "capture.h"
+#include "frame_codec.h"
+#include "frame_pool.h"
+#include "serial_port.h"
+#include "trace.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/random.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-struct termios oldtio;
-int alarmEnabled = FALSE;
-int alarmCounter = 0;
-int Ns = 0;
-int Nr = 1;
+// Bytes read from the port but not parsed yet. Every read in the link layer
+// goes through it, so the receiver can take whole runs of payload at once.
+#define RX_BUFFER_SIZE 4096
+
+// Connections opened through llopen, looked up by file descriptor
+#define MAX_CONNECTIONS 64
+
+// Supervision frame types, the control field without its sequence number.
+// The same in both encodings.
+#define S_RR 0x05
+#define S_REJ 0x01
+#define S_SREJ 0x0D
+
+// Bytes on the line for a probe and its answer, counted by the error rate estimate
+#define PROBE_ROUND_TRIP_SIZE 10
+
+// Weight kept by the error rate estimate on each transmission, so it follows
+// the last few hundred frames
+#define ERROR_DECAY 0.99
+
+// Overhead of a frame and its RR, for the payload size recommended by linkGetQuality
+#define FRAME_OVERHEAD (FH_SIZE + FT_SIZE + 5)
+
+// Silence after which a frame whose closing FLAG never came is given up as
+// damaged. The transmitter writes a frame without pauses, so this is far
+// longer than any gap inside one.
+#define FRAME_GAP_MS 200
+
+typedef struct {
+    unsigned char* data; // Frame (transmitter) or packet (receiver)
+    int size;
+    int present;
+} WindowSlot;
+
+// A message framed by linkQueue, waiting for room in the window
+typedef struct QueuedFrame {
+    unsigned char* data;
+    int size;
+    struct QueuedFrame* next;
+} QueuedFrame;
+
+typedef struct {
+    State state;
+    unsigned char control;
+} SupervisionParser;
+
+typedef struct {
+    State state;
+    unsigned char control;
+    FieldDecoder field;
+} InfoFrameParser;
+
+typedef struct {
+    State state;
+    unsigned char address;
+    unsigned char control;
+    unsigned char params[2 * (LP_MAX_PARAMS_SIZE + 1)];
+    int paramsSize;
+} ParamFrameParser;
+
+// Stages of a disconnection. The transmitter drains its window, then
+// exchanges DISC / DISC / UA; the receiver waits for DISC, answers it and
+// waits for the final UA.
+typedef enum {
+    CLOSE_NONE,
+    CLOSE_DRAINING,
+    CLOSE_DISC_SENT,
+    CLOSE_WAIT_DISC,
+    CLOSE_WAIT_UA,
+    CLOSE_DONE,
+    CLOSE_FAILED,
+} CloseState;
+
+// Link parameters negotiated on SET / UA.
+typedef struct {
+    int baudRate;
+    int windowSize;
+    int timeout; // Retransmission timeout in milliseconds
+    FcsType fcs;
+    int keepalive; // Probe interval in milliseconds, "0" for none
+    unsigned int salt; // With FCS_AEAD: of the transmitter in the offer, of the peer once agreed
+} LinkParams;
+
+struct LinkConnection {
+    int fd;
+    LinkLayer params;
+    struct termios oldtio;
+    unsigned int randSeed;
+    int usesTrace; // Holds a reference to the trace of the process
+    int traceId; // Link of its trace events
+    Capture* capture; // NULL unless params.captureFile is set
+    int failed; // The retransmissions ran out
+
+    // Negotiated by linkOpen
+    int lineBaudRate;
+    int windowSize;
+    int seqModulus; // 2 for stop-and-wait, SEQ_MODULUS_EXT with a larger window
+    int timeoutMs;
+    int escapeFlowControl;
+    FrameEncoder frameEncoder;
+    FrameChecker frameChecker;
+    FcsType fcs;
+    int fcsSize;
+    FramePool* framePool; // Shared pool building large I-frames, NULL for none
+    unsigned char uaParams[LP_MAX_PARAMS_SIZE];
+    int uaParamsSize;
+
+    // Encryption (FCS_AEAD). The I-frame with index i in the connection is
+    // sealed with nonce i, so retransmissions repeat it and a frame replayed
+    // from elsewhere in the connection fails its tag.
+    int hasKey; // params.keyFile was loaded into key
+    unsigned char key[AEAD_KEY_SIZE];
+    unsigned char sessionKey[AEAD_KEY_SIZE]; // Derived from key and the salts of both ends
+    unsigned int salt; // Own salt, exchanged on SET / UA
+    int aead;
+    unsigned long long sendNextIndex; // Index of the frame sent as sendNext
+    unsigned long long recvBaseIndex; // Index of the frame expected as recvBase
+
+    // Retransmission timer, replacing SIGALRM so each connection has its own
+    long long timerDeadline; // In monotonicMs() time, "0" when stopped
+    int timeouts; // Expirations since the last progress
+
+    // Link quality. The transmitter probes the link with C_PROBE after
+    // keepalive milliseconds without traffic, and the round trip times
+    // measured adapt the retransmission timeout.
+    int keepalive; // Negotiated probe interval, "0" when off
+    long long lastActivityMs; // Last frame sent or acknowledgement received
+    long long probeSentMs; // "0" when no probe is outstanding
+    int probesSent;
+    int probesLost;
+    int probesLostInRow;
+    double srttMs; // Smoothed round trip time, "-1" until measured
+    double rttVarMs;
+    int backoff; // Doublings of the adaptive timeout since the last progress
+    double exposedBytes; // Decayed bytes transmitted
+    double lostFrames; // Decayed transmissions lost or damaged
+
+    unsigned char rxBuffer[RX_BUFFER_SIZE];
+    int rxBufferStart;
+    int rxBufferEnd;
+
+    // Transmitter window. RR(n) acknowledges every frame before n, SREJ(n)
+    // asks for frame n alone and REJ(n) for every frame from n.
+    WindowSlot sendSlots[SEQ_MODULUS_EXT];
+    int sendBase;
+    int sendNext;
+    SupervisionParser sendParser;
+
+    // Messages waiting for the window, a FIFO per priority. Filled by
+    // linkQueue from any thread, drained by the transmitter.
+    QueuedFrame* queueHead[LINK_PRIORITIES];
+    QueuedFrame* queueTail[LINK_PRIORITIES];
+    atomic_int queued;
+    pthread_mutex_t queueLock;
+
+    // Receiver window. Frames are buffered out of order and delivered in
+    // sequence, so a damaged frame costs a single retransmission.
+    WindowSlot recvSlots[SEQ_MODULUS_EXT];
+    int srejSent[SEQ_MODULUS_EXT];
+    int recvBase; // Next frame expected
+    int deliverNext; // Next packet to hand to the application
+    InfoFrameParser recvParser;
+    long long lastRxMs; // Last input, to end frames cut short
+
+    // Disconnection, driven by linkPoll once linkShutdown is called
+    CloseState closeState;
+    long long closeDeadline; // In monotonicMs() time
+    long long closeStartMs;
+    ParamFrameParser closeParser; // DISC from the receiver
+    int peerDisconnected; // DISC received before linkShutdown
+    int cleanClose;
+
+    Statistics counters;
+    LinkCallbacks callbacks;
+};
+
+static LinkConnection* connections[MAX_CONNECTIONS];
+static pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// One frame pool per process, sized by the first transmitter that asks for
+// one and freed with the last. Guarded by connectionsLock.
+static FramePool* framePool = NULL;
+static int framePoolUsers = 0;
+
+// Links opened so far, numbering the events of each in the trace
+static atomic_int linksOpened = 0;
+
+// One trace per process, opened by the first connection that asks for one
+// and closed with the last. Guarded by connectionsLock.
+static int traceUsers = 0;
+
+// Records a trace event of a connection that asked for the trace. Others
+// hold no reference to it, so it may be closed under them.
+#define LINK_TRACE(conn, type, seq, value) \
+    do { if ((conn)->usesTrace) TRACE((conn)->traceId, (type), (seq), (value)); } while (0)
+
+// Prints an informational message, unless in quiet mode. Errors always use printf / perror.
+static void logInfo(const LinkConnection* conn, const char* format, ...)
+{
+    if (conn->params.quiet == TRUE) return;
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Arms the retransmission timer to expire after the given milliseconds.
+static void startTimer(LinkConnection* conn, int milliseconds)
+{
+    if (milliseconds < 1) milliseconds = 1;
+    conn->timerDeadline = monotonicMs() + milliseconds;
+}
+
+static void stopTimer(LinkConnection* conn)
+{
+    conn->timerDeadline = 0;
+}
+
+// Checks the retransmission timer, counting the timeout when it expires.
+// Returns TRUE while it is armed and has not expired.
+static int timerRunning(LinkConnection* conn)
+{
+    if (conn->timerDeadline == 0) return FALSE;
+    if (monotonicMs() < conn->timerDeadline) return TRUE;
+
+    conn->timerDeadline = 0;
+    conn->timeouts++;
+    conn->counters.timeouts++;
+    LINK_TRACE(conn, TRACE_TIMEOUT, 0, conn->timeouts);
+    logInfo(conn, "Timeout #%d\n", conn->timeouts);
+    return FALSE;
+}
+
+// Adds a round trip time measurement to the smoothed estimate, as TCP does (RFC 6298).
+static void addRttSample(LinkConnection* conn, long long rttMs)
+{
+    if (conn->srttMs < 0) {
+        conn->srttMs = rttMs;
+        conn->rttVarMs = rttMs / 2.0;
+        return;
+    }
+    double deviation = conn->srttMs > rttMs ? conn->srttMs - rttMs : rttMs - conn->srttMs;
+    conn->rttVarMs = 0.75 * conn->rttVarMs + 0.25 * deviation;
+    conn->srttMs = 0.875 * conn->srttMs + 0.125 * rttMs;
+}
+
+// Counts a transmission of size bytes for the error rate estimate, lost or
+// damaged if lost == TRUE.
+static void addTransmission(LinkConnection* conn, int size, int lost)
+{
+    conn->exposedBytes = conn->exposedBytes * ERROR_DECAY + size;
+    conn->lostFrames = conn->lostFrames * ERROR_DECAY + (lost ? 1 : 0);
+}
+
+// Returns the retransmission timeout of a frame of frameSize bytes, in
+// milliseconds: the configured timeout, or once keepalive is negotiated and
+// the round trip time measured, the smoothed round trip time with four
+// deviations of margin plus the time the frame takes on the line, doubled on
+// each timeout since the last progress and never above the configured timeout.
+static int retransmissionTimeout(const LinkConnection* conn, int frameSize)
+{
+    if (conn->keepalive == 0 || conn->srttMs < 0) return conn->timeoutMs;
+
+    double lineMs = frameSize * 10000.0 / conn->lineBaudRate;
+    double timeout = conn->srttMs + 4 * conn->rttVarMs + lineMs;
+
+    if (timeout < MIN_ADAPTIVE_TIMEOUT_MS) timeout = MIN_ADAPTIVE_TIMEOUT_MS;
+    for (int i = 0; i < conn->backoff && timeout < conn->timeoutMs; i++) timeout *= 2;
+    return timeout < conn->timeoutMs ? (int) timeout : conn->timeoutMs;
+}
+
+// Starts the retransmission timer for the oldest frame outstanding.
+static void startFrameTimer(LinkConnection* conn)
+{
+    startTimer(conn, retransmissionTimeout(conn, conn->sendSlots[conn->sendBase].size));
+}
+
+// Refills the receive buffer from the port once it is empty, without blocking.
+// Returns the number of bytes buffered.
+static int fillRxBuffer(LinkConnection* conn)
+{
+    if (conn->rxBufferStart == conn->rxBufferEnd) {
+        int res = read(conn->fd, conn->rxBuffer, RX_BUFFER_SIZE);
+        conn->rxBufferStart = 0;
+        conn->rxBufferEnd = res > 0 ? res : 0;
+
+        if (res > 0 && conn->capture != NULL) captureRecord(conn->capture, CAPTURE_RECEIVED, conn->rxBuffer, res);
+    }
+    return conn->rxBufferEnd - conn->rxBufferStart;
+}
+
+// Writes a short frame to the port at once, recording it in the capture.
+// Returns "0" on success or "-1" on error.
+static int portWrite(const LinkConnection* conn, const unsigned char* frame, int frameSize)
+{
+    if (write(conn->fd, frame, frameSize) != frameSize) {
+        perror("write");
+        return -1;
+    }
+    if (conn->capture != NULL) captureRecord(conn->capture, CAPTURE_SENT, frame, frameSize);
+    return 0;
+}
+
+// Writes an I-frame to the port, paced by serialWrite, recording it in the capture.
+// Returns "0" on success or "-1" on error.
+static int portWritePaced(const LinkConnection* conn, const unsigned char* frame, int frameSize)
+{
+    if (serialWrite(conn->fd, frame, frameSize, conn->lineBaudRate) != frameSize) return -1;
+    if (conn->capture != NULL) captureRecord(conn->capture, CAPTURE_SENT, frame, frameSize);
+    return 0;
+}
+
+// Reads a byte through the receive buffer.
+// Returns "1" if a byte was read or "0" if none is available.
+static int readByte(LinkConnection* conn, unsigned char* byte)
+{
+    if (fillRxBuffer(conn) == 0) return 0;
+    *byte = conn->rxBuffer[conn->rxBufferStart++];
+    return 1;
+}
+
+// Discards pending input and output, including the receive buffer.
+static void flushSerial(LinkConnection* conn)
+{
+    tcflush(conn->fd, TCIOFLUSH);
+    conn->rxBufferStart = conn->rxBufferEnd = 0;
+}
+
+// Returns when the next keepalive probe is due or the outstanding one is
+// lost, in monotonicMs() time, or "0" if there is nothing to probe for.
+static long long keepaliveDeadline(const LinkConnection* conn)
+{
+    if (conn->keepalive == 0 || conn->closeState != CLOSE_NONE || conn->failed) return 0;
+    if (conn->sendBase != conn->sendNext) return 0;
+    if (conn->probeSentMs != 0) return conn->probeSentMs + conn->timeoutMs;
+    return conn->lastActivityMs + conn->keepalive;
+}
+
+// Returns "now" in monotonicMs() time if queued messages can be moved into
+// the window, or "0" if not.
+static long long queueDeadline(const LinkConnection* conn)
+{
+    if (conn->queued == 0 || conn->failed) return 0;
+    if (conn->closeState != CLOSE_NONE && conn->closeState != CLOSE_DRAINING) return 0;
+    if ((conn->sendNext - conn->sendBase + conn->seqModulus) % conn->seqModulus >= conn->windowSize) return 0;
+    return monotonicMs();
+}
+
+// Returns when the frame being received is given up if no more input arrives,
+// in monotonicMs() time, or "0" if no data field is in progress.
+static long long frameGapDeadline(const LinkConnection* conn)
+{
+    if (conn->params.role != LLRX || conn->recvParser.state != BCC_OK) return 0;
+    return conn->lastRxMs + FRAME_GAP_MS;
+}
+
+// Returns the earliest of the retransmission timer, the close deadline, the
+// keepalive, the send queue and the frame gap, in monotonicMs() time, or "0"
+// if none is pending.
+static long long nextDeadline(const LinkConnection* conn)
+{
+    long long deadlines[5] = {conn->timerDeadline, conn->closeDeadline, keepaliveDeadline(conn), queueDeadline(conn),
+                              frameGapDeadline(conn)};
+    long long next = 0;
+
+    for (int i = 0; i < 5; i++) {
+        if (deadlines[i] != 0 && (next == 0 || deadlines[i] < next)) next = deadlines[i];
+    }
+    return next;
+}
+
+// Sleeps until input arrives, the retransmission timer, the close deadline or
+// the keepalive expires, or the deadline (absolute, in monotonicMs() time,
+// "0" for none) passes.
+static void waitInput(LinkConnection* conn, long long deadline)
+{
+    if (conn->rxBufferStart != conn->rxBufferEnd) return;
+
+    long long next = nextDeadline(conn);
+    if (next != 0 && (deadline == 0 || next < deadline)) deadline = next;
+
+    int timeout = -1;
+    if (deadline != 0) {
+        long long remaining = deadline - monotonicMs();
+        timeout = remaining > 0 ? remaining : 0;
+    }
+
+    struct pollfd pollFd = {conn->fd, POLLIN, 0};
+    poll(&pollFd, 1, timeout);
+}
+
+static void initParamFrameParser(ParamFrameParser* parser, unsigned char address, unsigned char control)
+{
+    parser->state = START;
+    parser->address = address;
+    parser->control = control;
+    parser->paramsSize = 0;
+}
+
+// Feeds a byte to a SET / UA parser. Parameters (if any) are left destuffed in parser->params.
+// Returns TRUE once a complete and valid frame was received.
+static int parseParamFrameByte(ParamFrameParser* parser, unsigned char byte)
+{
+    switch (parser->state) {
+        case START:
+            if (byte == FLAG) parser->state = FLAG_RCV;
+            break;
+        case FLAG_RCV:
+            if (byte == parser->address) parser->state = A_RCV;
+            else if (byte != FLAG) parser->state = START;
+            break;
+        case A_RCV:
+            if (byte == parser->control) parser->state = C_RCV;
+            else if (byte == FLAG) parser->state = FLAG_RCV;
+            else parser->state = START;
+            break;
+        case C_RCV:
+            if (byte == (parser->control ^ parser->address)) {
+                parser->state = BCC_OK;
+                parser->paramsSize = 0;
+            }
+            else if (byte == FLAG) parser->state = FLAG_RCV;
+            else parser->state = START;
+            break;
+        case BCC_OK:
+            if (byte != FLAG) {
+                if (parser->paramsSize == sizeof(parser->params)) parser->state = START;
+                else parser->params[parser->paramsSize++] = byte;
+                break;
+            }
+            if (parser->paramsSize > 0) {
+                int size = 0;
+                unsigned char* params = byteDestuffing(parser->params, parser->paramsSize, &size);
+
+                if (params == NULL) {
+                    parser->state = START;
+                    return FALSE;
+                }
+
+                unsigned char bcc2 = 0;
+                for (int i = 0; i < size; i++) bcc2 ^= params[i];
+
+                if (size < 2 || bcc2 != 0) {
+                    free(params);
+                    parser->state = FLAG_RCV;
+                    return FALSE;
+                }
+
+                // Drop BCC2, which makes the XOR of the whole field zero
+                parser->paramsSize = size - 1;
+                memcpy(parser->params, params, parser->paramsSize);
+                free(params);
+            }
+            parser->state = STOP;
+            return TRUE;
+        default:
+            break;
+    }
+    return FALSE;
+}
+
+// Writes a SET / UA frame, appending the parameters field when paramsSize > 0.
+// Also used for the other unnumbered frames (DISC), which never carry parameters.
+// Returns "0" on success or "-1" on error.
+static int writeParamFrame(const LinkConnection* conn, unsigned char address, unsigned char control, const unsigned char* params, int paramsSize)
+{
+    unsigned char frame[FH_SIZE + 2 * (LP_MAX_PARAMS_SIZE + 1) + 1];
+    int frameSize = 0;
+
+    frame[frameSize++] = FLAG;
+    frame[frameSize++] = address;
+    frame[frameSize++] = control;
+    frame[frameSize++] = address ^ control;
+
+    if (paramsSize > 0) {
+        unsigned char field[LP_MAX_PARAMS_SIZE + 1];
+        unsigned char bcc2 = 0;
+
+        for (int i = 0; i < paramsSize; i++) {
+            field[i] = params[i];
+            bcc2 ^= params[i];
+        }
+        field[paramsSize] = bcc2;
+
+        int stuffedSize = 0;
+        unsigned char* stuffed = byteStuffing(field, paramsSize + 1, &stuffedSize);
+
+        if (stuffed == NULL) return -1;
+
+        memcpy(frame + frameSize, stuffed, stuffedSize);
+        frameSize += stuffedSize;
+        free(stuffed);
+    }
+
+    frame[frameSize++] = FLAG;
+
+    return portWrite(conn, frame, frameSize);
+}
+
+// Appends a TLV with a 4 byte big-endian value to the parameters.
+// Returns the new size of the parameters.
+static int putParam(unsigned char* params, int paramsSize, unsigned char type, int value)
+{
+    params[paramsSize++] = type;
+    params[paramsSize++] = 4;
+    for (int i = 3; i >= 0; i--) {
+        params[paramsSize++] = (value >> (8 * i)) & 0xFF;
+    }
+    return paramsSize;
+}
+
+// Looks for a TLV of the given type in the parameters.
+// Returns its value, or defaultValue if there is none.
+static int getParam(const unsigned char* params, int paramsSize, unsigned char type, int defaultValue)
+{
+    int i = 0;
+    while (i + 2 <= paramsSize && i + 2 + params[i + 1] <= paramsSize) {
+        if (params[i] == type && params[i + 1] >= 1 && params[i + 1] <= 4) {
+            int value = 0;
+            for (int j = 0; j < params[i + 1]; j++) value = (value << 8) | params[i + 2 + j];
+            return value;
+        }
+        i += 2 + params[i + 1];
+    }
+    return defaultValue;
+}
+
+// Encodes the parameters the transmitter offers in SET.
+// Returns the size of the parameters.
+static int encodeLinkParams(const LinkParams* linkParams, unsigned char* params)
+{
+    int paramsSize = 0;
+    if (linkParams->baudRate > 0) paramsSize = putParam(params, paramsSize, LP_T_BAUD_RATE, linkParams->baudRate);
+    if (linkParams->windowSize > 1) paramsSize = putParam(params, paramsSize, LP_T_WINDOW_SIZE, linkParams->windowSize);
+    if (linkParams->timeout > 0) paramsSize = putParam(params, paramsSize, LP_T_TIMEOUT, linkParams->timeout);
+    if (linkParams->fcs != FCS_BCC2) paramsSize = putParam(params, paramsSize, LP_T_FCS, linkParams->fcs);
+    if (linkParams->keepalive > 0) paramsSize = putParam(params, paramsSize, LP_T_KEEPALIVE, linkParams->keepalive);
+    if (linkParams->fcs == FCS_AEAD) paramsSize = putParam(params, paramsSize, LP_T_SALT, linkParams->salt);
+    return paramsSize;
+}
+
+// Returns the first retransmission interval of a connection attempt, in milliseconds.
+static int connectInterval(const LinkConnection* conn)
+{
+    if (conn->params.fastConnect == TRUE && FAST_CONNECT_TIMEOUT_MS < conn->timeoutMs) return FAST_CONNECT_TIMEOUT_MS;
+    return conn->timeoutMs;
+}
+
+// Randomizes an interval by +/- 25% so that both ends do not retry in lockstep.
+static int jitter(LinkConnection* conn, int milliseconds)
+{
+    return milliseconds * 3 / 4 + rand_r(&conn->randSeed) % (milliseconds / 2 + 1);
+}
+
+// Sends SET until UA is received, the retransmissions run out or the deadline
+// (absolute, in monotonicMs() time, "0" for none) passes.
+// In fast connect mode SET is retried after FAST_CONNECT_TIMEOUT_MS, doubling
+// the interval up to the frame timeout, and only the deadline ends the attempt.
+// If offer != NULL its parameters are sent with the SET and the values accepted
+// in the UA are stored in agreed. Parameters missing from the UA fall back to
+// the initial baud rate, a window of 1 (stop-and-wait), the local timeout, BCC2
+// and no keepalive. With FCS_AEAD, agreed->salt is the salt of the receiver.
+// Returns "0" on success or "-1" on error.
+static int connectTransmitter(LinkConnection* conn, const LinkParams* offer, LinkParams* agreed, long long deadline)
+{
+    unsigned char params[LP_MAX_PARAMS_SIZE];
+    int paramsSize = 0;
+
+    if (offer != NULL) paramsSize = encodeLinkParams(offer, params);
+
+    ParamFrameParser parser;
+    initParamFrameParser(&parser, A_RECEIVER, C_UA);
+
+    unsigned char byte;
+    int interval = connectInterval(conn);
+    long long sentMs = 0;
+
+    conn->timeouts = 0;
+    stopTimer(conn);
+
+    while (TRUE) {
+        if (!timerRunning(conn)) {
+            long long remaining = deadline > 0 ? deadline - monotonicMs() : interval;
+
+            if (remaining <= 0) return -1;
+            if (conn->params.fastConnect == FALSE && conn->params.nRetransmissions <= conn->timeouts) return -1;
+
+            if (writeParamFrame(conn, A_TRANSMITTER, C_SET, params, paramsSize) == -1) return -1;
+            LINK_TRACE(conn, TRACE_SET_SENT, 0, paramsSize);
+            sentMs = monotonicMs();
+
+            int wait = jitter(conn, interval);
+            startTimer(conn, wait < remaining ? wait : remaining);
+
+            if (interval < conn->timeoutMs) interval = interval * 2 < conn->timeoutMs ? interval * 2 : conn->timeoutMs;
+        }
+        if (readByte(conn, &byte) == 0) {
+            waitInput(conn, 0);
+            continue;
+        }
+        if (parseParamFrameByte(&parser, byte)) {
+            stopTimer(conn);
+            LINK_TRACE(conn, TRACE_UA_RECEIVED, 0, parser.paramsSize);
+
+            // The first round trip time, unless the UA may answer an earlier SET
+            if (conn->timeouts == 0) addRttSample(conn, monotonicMs() - sentMs);
+            conn->lastActivityMs = monotonicMs();
+
+            if (agreed != NULL) {
+                agreed->baudRate = getParam(parser.params, parser.paramsSize, LP_T_BAUD_RATE, conn->params.baudRate);
+                agreed->windowSize = getParam(parser.params, parser.paramsSize, LP_T_WINDOW_SIZE, 1);
+                agreed->timeout = getParam(parser.params, parser.paramsSize, LP_T_TIMEOUT, conn->timeoutMs);
+                int fcs = getParam(parser.params, parser.paramsSize, LP_T_FCS, FCS_BCC2);
+                agreed->fcs = fcs == FCS_CRC16 || fcs == FCS_AEAD ? fcs : FCS_BCC2;
+                agreed->salt = getParam(parser.params, parser.paramsSize, LP_T_SALT, 0);
+                agreed->keepalive = getParam(parser.params, parser.paramsSize, LP_T_KEEPALIVE, 0);
+            }
+            return 0;
+        }
+    }
+}
+
+// Waits for SET and answers with UA, until the deadline (absolute, in
+// monotonicMs() time, "0" to wait forever) passes.
+// For each parameter offered in the SET, the receiver accepts the minimum of
+// the offer and its own limit (the timeout, a known FCS and the keepalive are
+// taken as offered), echoes it in the UA and stores it in agreed. FCS_AEAD is
+// only accepted with a key, answering with the salt of the receiver and
+// storing the one of the transmitter in agreed->salt. The UA is kept so the
+// receiver can answer a repeated SET if this one is lost.
+// Returns "0" on success or "-1" on error / deadline.
+static int connectReceiver(LinkConnection* conn, LinkParams* agreed, long long deadline)
+{
+    ParamFrameParser parser;
+    initParamFrameParser(&parser, A_TRANSMITTER, C_SET);
+
+    unsigned char byte;
+
+    while (parser.state != STOP) {
+        if (deadline > 0 && monotonicMs() >= deadline) return -1;
+        if (readByte(conn, &byte) == 0) waitInput(conn, deadline);
+        else parseParamFrameByte(&parser, byte);
+    }
+    LINK_TRACE(conn, TRACE_SET_RECEIVED, 0, parser.paramsSize);
+
+    unsigned char params[LP_MAX_PARAMS_SIZE];
+    int paramsSize = 0;
+    LinkParams accepted = {conn->params.baudRate, 1, conn->timeoutMs, FCS_BCC2, 0};
+
+    int offeredBaudRate = getParam(parser.params, parser.paramsSize, LP_T_BAUD_RATE, 0);
+    if (offeredBaudRate > 0) {
+        if (conn->params.maxBaudRate > accepted.baudRate) {
+            accepted.baudRate = offeredBaudRate < conn->params.maxBaudRate ? offeredBaudRate : conn->params.maxBaudRate;
+            if (!serialIsValidBaudRate(accepted.baudRate)) accepted.baudRate = conn->params.baudRate;
+        }
+        paramsSize = putParam(params, paramsSize, LP_T_BAUD_RATE, accepted.baudRate);
+    }
+
+    int offeredWindowSize = getParam(parser.params, parser.paramsSize, LP_T_WINDOW_SIZE, 1);
+    if (offeredWindowSize > 1) {
+        accepted.windowSize = offeredWindowSize < conn->params.windowSize ? offeredWindowSize : conn->params.windowSize;
+        if (accepted.windowSize < 1) accepted.windowSize = 1;
+        paramsSize = putParam(params, paramsSize, LP_T_WINDOW_SIZE, accepted.windowSize);
+    }
+
+    int offeredTimeout = getParam(parser.params, parser.paramsSize, LP_T_TIMEOUT, 0);
+    if (offeredTimeout > 0) {
+        accepted.timeout = offeredTimeout;
+        paramsSize = putParam(params, paramsSize, LP_T_TIMEOUT, accepted.timeout);
+    }
+
+    int offeredFcs = getParam(parser.params, parser.paramsSize, LP_T_FCS, FCS_BCC2);
+    if (offeredFcs == FCS_CRC16 || (offeredFcs == FCS_AEAD && conn->hasKey)) {
+        accepted.fcs = offeredFcs;
+        paramsSize = putParam(params, paramsSize, LP_T_FCS, accepted.fcs);
+    }
+    if (accepted.fcs == FCS_AEAD) {
+        accepted.salt = getParam(parser.params, parser.paramsSize, LP_T_SALT, 0);
+        paramsSize = putParam(params, paramsSize, LP_T_SALT, conn->salt);
+    }
+
+    // The receiver only answers probes, so any interval is fine
+    int offeredKeepalive = getParam(parser.params, parser.paramsSize, LP_T_KEEPALIVE, 0);
+    if (offeredKeepalive > 0) {
+        accepted.keepalive = offeredKeepalive;
+        paramsSize = putParam(params, paramsSize, LP_T_KEEPALIVE, accepted.keepalive);
+    }
+
+    if (writeParamFrame(conn, A_RECEIVER, C_UA, params, paramsSize) == -1) return -1;
+    LINK_TRACE(conn, TRACE_UA_SENT, 0, paramsSize);
+
+    memcpy(conn->uaParams, params, paramsSize);
+    conn->uaParamsSize = paramsSize;
+
+    if (agreed != NULL) *agreed = accepted;
+    return 0;
+}
+
+// Builds an I-frame to be sealed by sendInfoFrame in AEAD mode: the header
+// followed by the plain payload, as the nonce is only known once the frame
+// takes its place in the window.
+// Returns the frame size, or "-1" if buf is empty or over MAX_PAYLOAD_SIZE.
+static int encodeUnsealedFrame(const unsigned char* buf, int bufSize, unsigned char control, unsigned char* frame)
+{
+    if (bufSize < 1 || bufSize > MAX_PAYLOAD_SIZE) return -1;
+
+    frame[0] = FLAG;
+    frame[1] = A_TRANSMITTER;
+    frame[2] = control;
+    frame[3] = A_TRANSMITTER ^ control;
+    memcpy(frame + FH_SIZE, buf, bufSize);
+    return FH_SIZE + bufSize;
+}
+
+// Sets the frame check sequence of I-frames, picking the codecs specialized for it.
+static void setFcs(LinkConnection* conn, FcsType fcs)
+{
+    conn->fcs = fcs;
+    conn->aead = fcs == FCS_AEAD;
+
+    if (conn->aead) {
+        conn->frameEncoder = encodeUnsealedFrame;
+        conn->frameChecker = NULL;
+        conn->fcsSize = AEAD_TAG_SIZE;
+        logInfo(conn, "I-frames encrypted with ChaCha20-Poly1305\n");
+        return;
+    }
+
+    conn->frameEncoder = frameEncoderFor(fcs, conn->escapeFlowControl);
+    conn->frameChecker = frameCheckerFor(fcs);
+    conn->fcsSize = fcsSize(fcs);
+
+    if (fcs == FCS_CRC16) logInfo(conn, "Frame check sequence set to CRC-16\n");
+}
+
+// Sets the frame check sequence agreed on SET / UA. With FCS_AEAD the session
+// key is derived from the key and the salts of both ends, so that no two
+// connections encrypt with the same key and nonces.
+// Returns "0" on success or "-1" if the connection has a key but the peer did
+// not agree to encrypt.
+static int startSession(LinkConnection* conn, FcsType fcs, unsigned int txSalt, unsigned int rxSalt)
+{
+    if (conn->hasKey && fcs != FCS_AEAD) {
+        printf("The peer does not encrypt the link\n");
+        return -1;
+    }
+
+    if (fcs == FCS_AEAD) {
+        unsigned char context[AEAD_NONCE_SIZE] = {'L', 'L', 'S', 'K'};
+
+        for (int i = 0; i < 4; i++) {
+            context[4 + i] = (txSalt >> (8 * (3 - i))) & 0xFF;
+            context[8 + i] = (rxSalt >> (8 * (3 - i))) & 0xFF;
+        }
+        aeadDeriveKey(conn->key, context, conn->sessionKey);
+    }
+    setFcs(conn, fcs);
+    return 0;
+}
+
+// Fills the nonce of the I-frame with the given index in the connection.
+static void frameNonce(unsigned long long index, unsigned char* nonce)
+{
+    memset(nonce, 0, AEAD_NONCE_SIZE);
+    for (int i = 0; i < 8; i++) nonce[4 + i] = (index >> (8 * i)) & 0xFF;
+}
+
+// Builds an I-frame with the given control field: header, stuffed data and FCS, and trailer.
+// Returns the frame (to be freed by the caller) and its size in frameSize, or NULL on error.
+static unsigned char* buildInfoFrame(const LinkConnection* conn, const unsigned char* buf, int bufSize, unsigned char control, int* frameSize)
+{
+    unsigned char* frame = (unsigned char *)malloc(FRAME_MAX_SIZE(MAX_PAYLOAD_SIZE, FCS_MAX_SIZE) * sizeof(unsigned char));
+
+    if (frame == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    // Payloads large enough to split are checksummed and stuffed by the pool
+    if (conn->framePool != NULL && !conn->aead && bufSize >= 2 * FRAME_POOL_MIN_SEGMENT && bufSize <= MAX_PAYLOAD_SIZE) {
+        *frameSize = framePoolEncode(conn->framePool, A_TRANSMITTER, conn->fcs, conn->escapeFlowControl, buf, bufSize, control, frame);
+    }
+    else *frameSize = conn->frameEncoder(buf, bufSize, control, frame);
+
+    if (*frameSize == -1) {
+        printf("Invalid payload size: %d\n", bufSize);
+        free(frame);
+        return NULL;
+    }
+    return frame;
+}
+
+// Returns the size of the payload carried by a frame built by buildInfoFrame.
+static int framePayloadSize(const LinkConnection* conn, const unsigned char* frame, int frameSize)
+{
+    if (conn->aead) return frameSize - FH_SIZE;
+
+    // Everything between the header and the closing FLAG, less escapes and FCS
+    int size = frameSize - FH_SIZE - 1;
+    const unsigned char* end = frame + frameSize - 1;
+
+    for (const unsigned char* p = frame + FH_SIZE; (p = memchr(p, ESC, end - p)) != NULL; p += 2) size--;
+    return size - conn->fcsSize;
+}
+
+// Sets the control field of a frame built by buildInfoFrame, and its BCC1.
+static void setFrameControl(unsigned char* frame, unsigned char control)
+{
+    frame[2] = control;
+    frame[3] = frame[1] ^ control;
+}
+
+////////////////////////////////////////////////
+// SEQUENCE NUMBERS
+////////////////////////////////////////////////
+// Stop-and-wait uses the classic encodings (modulo 2), a window larger than 1
+// the extended ones (modulo 8). Both run through the same window logic: with a
+// window of 1 it is exactly stop-and-wait, and REJ stands in for SREJ.
+
+static int seqDistance(const LinkConnection* conn, int from, int to)
+{
+    return (to - from + conn->seqModulus) % conn->seqModulus;
+}
+
+static unsigned char infoControl(const LinkConnection* conn, int seq)
+{
+    return conn->windowSize > 1 ? C_INFO_FRAME_EXT(seq) : C_INFO_FRAME(seq);
+}
+
+static unsigned char supervisionControl(const LinkConnection* conn, unsigned char type, int seq)
+{
+    if (conn->windowSize > 1) return (seq << 5) | type;
+    return (seq << 7) | (type == S_SREJ ? S_REJ : type);
+}
+
+// Checks if a control field is one of an I-frame in the current mode.
+static int isInfoControl(const LinkConnection* conn, unsigned char control)
+{
+    if (conn->windowSize > 1) return C_TYPE_EXT(control) == 0;
+    return control == C_INFO_FRAME(0) || control == C_INFO_FRAME(1);
+}
+
+static int infoSeq(const LinkConnection* conn, unsigned char control)
+{
+    return conn->windowSize > 1 ? C_SEQ_EXT(control) : control >> 6;
+}
+
+// Decodes an RR / REJ / SREJ control field in the current mode.
+// Returns its type (S_RR, S_REJ or S_SREJ) with the sequence number in seq, or "-1" if it is none.
+static int parseSupervisionControl(const LinkConnection* conn, unsigned char control, int* seq)
+{
+    int type;
+
+    if (conn->windowSize > 1) {
+        type = C_TYPE_EXT(control);
+        *seq = C_SEQ_EXT(control);
+        if (type == S_RR || type == S_REJ || type == S_SREJ) return type;
+        return -1;
+    }
+
+    type = control & 0x7F;
+    *seq = control >> 7;
+    if (type == S_RR || type == S_REJ) return type;
+    return -1;
+}
+
+// Records an RR / REJ / SREJ in the trace.
+static void traceSupervision(const LinkConnection* conn, int sent, unsigned char control)
+{
+    int seq;
+
+    switch (parseSupervisionControl(conn, control, &seq)) {
+        case S_RR:
+            LINK_TRACE(conn, sent ? TRACE_RR_SENT : TRACE_RR_RECEIVED, seq, 0);
+            break;
+        case S_REJ:
+            LINK_TRACE(conn, sent ? TRACE_REJ_SENT : TRACE_REJ_RECEIVED, seq, 0);
+            break;
+        case S_SREJ:
+            LINK_TRACE(conn, sent ? TRACE_SREJ_SENT : TRACE_SREJ_RECEIVED, seq, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+// Writes a 5 byte supervision frame from the receiver.
+// Returns "0" on success or "-1" on error.
+static int writeSupervisionFrame(const LinkConnection* conn, unsigned char control)
+{
+    unsigned char frame[5] = {FLAG, A_RECEIVER, control, A_RECEIVER ^ control, FLAG};
+
+    traceSupervision(conn, TRUE, control);
+
+    if (portWrite(conn, frame, 5) == -1) return -1;
+    return 0;
+}
+
+// Answers a SET received after the connection was established: the first UA
+// was lost, so the transmitter is still waiting for it.
+// Returns "0" on success or "-1" on error.
+static int answerRepeatedSet(LinkConnection* conn)
+{
+    logInfo(conn, "Repeated SET, sending UA again\n");
+    LINK_TRACE(conn, TRACE_SET_RECEIVED, 0, 0);
+    LINK_TRACE(conn, TRACE_UA_SENT, 0, conn->uaParamsSize);
+    return writeParamFrame(conn, A_RECEIVER, C_UA, conn->uaParams, conn->uaParamsSize);
+}
+
+// Sets the negotiated window size and resets the window state.
+static void setWindowSize(LinkConnection* conn, int size)
+{
+    conn->windowSize = size;
+    conn->seqModulus = size > 1 ? SEQ_MODULUS_EXT : 2;
+
+    for (int i = 0; i < SEQ_MODULUS_EXT; i++) {
+        free(conn->sendSlots[i].data);
+        free(conn->recvSlots[i].data);
+        conn->sendSlots[i].data = conn->recvSlots[i].data = NULL;
+        conn->sendSlots[i].present = conn->recvSlots[i].present = FALSE;
+        conn->srejSent[i] = FALSE;
+    }
+    conn->sendBase = conn->sendNext = 0;
+    conn->recvBase = conn->deliverNext = 0;
+    conn->sendNextIndex = conn->recvBaseIndex = 0;
+    conn->sendParser.state = START;
+    conn->recvParser.state = START;
+
+    if (size > 1) logInfo(conn, "Window size set to %d\n", size);
+}
+
+////////////////////////////////////////////////
+// TRANSMITTER
+////////////////////////////////////////////////
+
+// Feeds a byte to the parser of RR / REJ / SREJ frames.
+// Returns TRUE once a complete frame was received, leaving its control field in parser->control.
+static int parseSupervisionByte(const LinkConnection* conn, SupervisionParser* parser, unsigned char byte)
+{
+    int seq;
+
+    switch (parser->state) {
+        case START:
+            if (byte == FLAG) parser->state = FLAG_RCV;
+            break;
+        case FLAG_RCV:
+            if (byte == A_RECEIVER) parser->state = A_RCV;
+            else if (byte != FLAG) parser->state = START;
+            break;
+        case A_RCV:
+            if (parseSupervisionControl(conn, byte, &seq) != -1) {
+                parser->state = C_RCV;
+                parser->control = byte;
+            }
+            else if (byte == FLAG) parser->state = FLAG_RCV;
+            else parser->state = START;
+            break;
+        case C_RCV:
+            if (byte == (parser->control ^ A_RECEIVER)) parser->state = BCC_OK;
+            else if (byte == FLAG) parser->state = FLAG_RCV;
+            else parser->state = START;
+            break;
+        case BCC_OK:
+            // The closing FLAG may open the next frame too
+            if (byte == FLAG) {
+                parser->state = FLAG_RCV;
+                return TRUE;
+            }
+            parser->state = START;
+            break;
+        default:
+            break;
+    }
+    return FALSE;
+}
+
+// Retransmits an unacknowledged frame.
+// Returns "0" on success or "-1" on error.
+static int resendFrame(LinkConnection* conn, int seq)
+{
+    WindowSlot* slot = &conn->sendSlots[seq];
+
+    if (slot->present == FALSE) return 0;
+    LINK_TRACE(conn, TRACE_I_RESENT, seq, slot->size);
+    conn->counters.frames_resent++;
+    addTransmission(conn, slot->size, TRUE);
+    if (portWritePaced(conn, slot->data, slot->size) == -1) return -1;
+    return 0;
+}
+
+// Retransmits every unacknowledged frame and restarts the timer.
+// Returns "0" on success or "-1" on error.
+static int resendOutstanding(LinkConnection* conn)
+{
+    for (int i = conn->sendBase; i != conn->sendNext; i = (i + 1) % conn->seqModulus) {
+        if (resendFrame(conn, i) == -1) return -1;
+    }
+    startFrameTimer(conn);
+    return 0;
+}
+
+// Handles an RR / REJ / SREJ received by the transmitter.
+// Returns "0" on success or "-1" on error.
+static int handleSupervision(LinkConnection* conn, unsigned char control)
+{
+    int seq;
+    int type = parseSupervisionControl(conn, control, &seq);
+    int outstanding = seqDistance(conn, conn->sendBase, conn->sendNext);
+    int offset = seqDistance(conn, conn->sendBase, seq);
+
+    traceSupervision(conn, FALSE, control);
+    conn->lastActivityMs = monotonicMs();
+
+    // Any answer while a probe is outstanding answers it
+    if (conn->probeSentMs != 0) {
+        long long rttMs = conn->lastActivityMs - conn->probeSentMs;
+
+        LINK_TRACE(conn, TRACE_PROBE_ANSWERED, 0, rttMs);
+        addRttSample(conn, rttMs);
+        addTransmission(conn, PROBE_ROUND_TRIP_SIZE, FALSE);
+        conn->probeSentMs = 0;
+        conn->probesLostInRow = 0;
+    }
+
+    if (type == S_SREJ) {
+        if (offset < outstanding) {
+            logInfo(conn, "Received SREJ. Retransmitting frame %d...\n", seq);
+            return resendFrame(conn, seq);
+        }
+        return 0;
+    }
+
+    // RR(n) and REJ(n) acknowledge every frame before n
+    if (offset > outstanding) return 0;
+
+    if (offset > 0) {
+        while (conn->sendBase != seq) {
+            addTransmission(conn, conn->sendSlots[conn->sendBase].size, FALSE);
+            free(conn->sendSlots[conn->sendBase].data);
+            conn->sendSlots[conn->sendBase].data = NULL;
+            conn->sendSlots[conn->sendBase].present = FALSE;
+            conn->sendBase = (conn->sendBase + 1) % conn->seqModulus;
+        }
+
+        // Progress was made, restart the timer for the oldest frame left
+        conn->timeouts = 0;
+        conn->backoff = 0;
+        if (conn->sendBase == conn->sendNext) stopTimer(conn);
+        else startFrameTimer(conn);
+
+        if (conn->callbacks.onSent != NULL) conn->callbacks.onSent(conn, offset, conn->callbacks.user);
+    }
+
+    if (type == S_REJ && conn->sendBase != conn->sendNext) {
+        logInfo(conn, "Received REJ. Retransmitting...\n");
+        return resendOutstanding(conn);
+    }
+    return 0;
+}
+
+// Encrypts the payload of a frame built by buildInfoFrame in AEAD mode, as the
+// frame with the given index in the connection, authenticating its address
+// and control field. The payload is encrypted in place.
+// Returns the stuffed frame with the tag as its FCS (to be freed by the
+// caller) and its size in sealedSize, or NULL on error.
+static unsigned char* sealInfoFrame(const LinkConnection* conn, unsigned char* frame, int frameSize, unsigned long long index, int* sealedSize)
+{
+    int payloadSize = frameSize - FH_SIZE;
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    unsigned char tag[AEAD_TAG_SIZE];
+
+    frameNonce(index, nonce);
+    aeadSeal(conn->sessionKey, nonce, frame + 1, 2, frame + FH_SIZE, payloadSize, tag);
+
+    unsigned char* sealed = (unsigned char *)malloc(FRAME_MAX_SIZE(payloadSize, AEAD_TAG_SIZE) * sizeof(unsigned char));
+    if (sealed == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    int escapeMask = conn->escapeFlowControl ? ESCAPE_FLOW : ESCAPE_BASIC;
+    int j = FH_SIZE;
+
+    memcpy(sealed, frame, FH_SIZE);
+    for (int i = 0; i < payloadSize + AEAD_TAG_SIZE; i++) {
+        unsigned char byte = i < payloadSize ? frame[FH_SIZE + i] : tag[i - payloadSize];
+
+        if (frameByteClass[byte] & escapeMask) {
+            sealed[j++] = ESC;
+            sealed[j++] = byte ^ 0x20;
+        }
+        else sealed[j++] = byte;
+    }
+    sealed[j++] = FLAG;
+
+    *sealedSize = j;
+    return sealed;
+}
+
+// Sends an I-frame built by buildInfoFrame if the window has room, taking
+// ownership of it (unless the window is full) as described for linkSendFrame.
+// Returns the payload size, "0" if the window is full or "-1" on error.
+static int sendInfoFrame(LinkConnection* conn, unsigned char* frame, int frameSize)
+{
+    if (conn->failed || conn->params.role != LLTX) {
+        free(frame);
+        return -1;
+    }
+    if (seqDistance(conn, conn->sendBase, conn->sendNext) >= conn->windowSize) return 0;
+
+    int seq = conn->sendNext;
+    setFrameControl(frame, infoControl(conn, seq));
+
+    int payloadSize = framePayloadSize(conn, frame, frameSize);
+
+    if (conn->aead) {
+        unsigned char* sealed = sealInfoFrame(conn, frame, frameSize, conn->sendNextIndex, &frameSize);
+
+        free(frame);
+        if (sealed == NULL) return -1;
+        frame = sealed;
+    }
+
+    conn->sendSlots[seq].data = frame;
+    conn->sendSlots[seq].size = frameSize;
+    conn->sendSlots[seq].present = TRUE;
+
+    LINK_TRACE(conn, TRACE_I_SENT, seq, frameSize);
+    conn->counters.frames_sent++;
+    conn->counters.payload_bytes += payloadSize;
+    if (portWritePaced(conn, frame, frameSize) == -1) return -1;
+
+    if (conn->sendBase == conn->sendNext) {
+        conn->timeouts = 0;
+        startFrameTimer(conn);
+    }
+    conn->sendNext = (seq + 1) % conn->seqModulus;
+    conn->sendNextIndex++;
+
+    // Data answers for the link from now on, the probe is not waited for
+    conn->probeSentMs = 0;
+    conn->lastActivityMs = monotonicMs();
+
+    return payloadSize;
+}
+
+// Takes the first message of the most urgent queue that has one.
+// Returns it, or NULL if every queue is empty.
+static QueuedFrame* takeQueued(LinkConnection* conn)
+{
+    QueuedFrame* queued = NULL;
+
+    pthread_mutex_lock(&conn->queueLock);
+    for (int priority = 0; priority < LINK_PRIORITIES && queued == NULL; priority++) {
+        queued = conn->queueHead[priority];
+        if (queued == NULL) continue;
+
+        conn->queueHead[priority] = queued->next;
+        if (queued->next == NULL) conn->queueTail[priority] = NULL;
+        conn->queued--;
+    }
+    pthread_mutex_unlock(&conn->queueLock);
+
+    return queued;
+}
+
+// Moves queued messages into the window while it has room.
+// Returns "0" on success or "-1" on error.
+static int sendQueued(LinkConnection* conn)
+{
+    while (conn->queued > 0 && seqDistance(conn, conn->sendBase, conn->sendNext) < conn->windowSize) {
+        QueuedFrame* queued = takeQueued(conn);
+        if (queued == NULL) return 0;
+
+        int res = sendInfoFrame(conn, queued->data, queued->size);
+        free(queued);
+        if (res == -1) return -1;
+    }
+    return 0;
+}
+
+// Probes the link with C_PROBE once it has been idle for the keepalive
+// interval. A probe without an answer within the configured timeout is lost.
+// Returns "0" on success or "-1" if nRetransmissions probes in a row were lost.
+static int pollKeepalive(LinkConnection* conn)
+{
+    long long deadline = keepaliveDeadline(conn);
+    long long now = monotonicMs();
+
+    if (deadline == 0 || now < deadline) return 0;
+
+    if (conn->probeSentMs != 0) {
+        conn->probeSentMs = 0;
+        conn->probesLost++;
+        conn->probesLostInRow++;
+        addTransmission(conn, PROBE_ROUND_TRIP_SIZE, TRUE);
+        LINK_TRACE(conn, TRACE_PROBE_LOST, 0, conn->probesLostInRow);
+        logInfo(conn, "Keepalive probe lost\n");
+
+        if (conn->params.nRetransmissions <= conn->probesLostInRow) {
+            printf("No answer to keepalive probes\n");
+            return -1;
+        }
+        if (now < keepaliveDeadline(conn)) return 0;
+    }
+
+    unsigned char frame[5] = {FLAG, A_TRANSMITTER, C_PROBE, A_TRANSMITTER ^ C_PROBE, FLAG};
+
+    if (portWrite(conn, frame, 5) == -1) return -1;
+    LINK_TRACE(conn, TRACE_PROBE_SENT, 0, 0);
+    conn->probeSentMs = conn->lastActivityMs = now;
+    conn->probesSent++;
+    return 0;
+}
+
+// Processes acknowledgements, timeouts and keepalive probes of the
+// transmitter without blocking.
+// Returns "0" on success or "-1" if the retransmissions ran out.
+static int pollTransmitter(LinkConnection* conn)
+{
+    unsigned char byte;
+
+    while (readByte(conn, &byte) > 0) {
+        if (parseSupervisionByte(conn, &conn->sendParser, byte)) {
+            if (handleSupervision(conn, conn->sendParser.control) == -1) return -1;
+        }
+    }
+
+    if (sendQueued(conn) == -1) return -1;
+
+    if (conn->sendBase == conn->sendNext) return pollKeepalive(conn);
+    if (timerRunning(conn)) return 0;
+
+    // An adaptive timeout backs off up to the configured one before using up
+    // retransmissions, so a round trip time measured too short costs no more
+    // than a few early retransmissions
+    if (retransmissionTimeout(conn, conn->sendSlots[conn->sendBase].size) < conn->timeoutMs) {
+        conn->timeouts--;
+        conn->backoff++;
+    }
+    else if (conn->params.nRetransmissions <= conn->timeouts) return -1;
+    return resendOutstanding(conn);
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+
+// Consumes buffered input until an I-frame (or SET / DISC / UA / PROBE) from the
+// transmitter is complete. The header goes through the state machine a byte
+// at a time, while the data field is destuffed straight from the receive
+// buffer, a run of plain bytes at a time.
+// Every FLAG is a frame boundary: the one closing a frame may open the next,
+// so a frame whose closing FLAG is lost takes only itself down. A data field
+// longer than any valid frame is given up at once as damaged, and the rest of
+// it skipped up to the next FLAG.
+// Returns TRUE once a frame is complete, leaving it in conn->recvParser.
+static int parseInfoFrame(LinkConnection* conn)
+{
+    InfoFrameParser* parser = &conn->recvParser;
+
+    while (conn->rxBufferStart < conn->rxBufferEnd) {
+        if (parser->state == BCC_OK) {
+            int complete = FALSE;
+            conn->rxBufferStart += fieldDecoderFeed(&parser->field, conn->rxBuffer + conn->rxBufferStart,
+                                                    conn->rxBufferEnd - conn->rxBufferStart, &complete);
+            if (complete) {
+                parser->state = FLAG_RCV;
+                return TRUE;
+            }
+            if (parser->field.overflowed) {
+                logInfo(conn, "Frame too long, closing FLAG lost\n");
+                parser->state = START;
+                if (isInfoControl(conn, parser->control)) return TRUE;
+            }
+            continue;
+        }
+
+        unsigned char byte = conn->rxBuffer[conn->rxBufferStart++];
+
+        switch (parser->state) {
+            case START:
+                if (byte == FLAG) parser->state = FLAG_RCV;
+                break;
+            case FLAG_RCV:
+                if (byte == A_TRANSMITTER) parser->state = A_RCV;
+                else if (byte != FLAG) parser->state = START;
+                break;
+            case A_RCV:
+                if (isInfoControl(conn, byte) || byte == C_SET || byte == C_DISC || byte == C_UA || byte == C_PROBE) {
+                    parser->state = C_RCV;
+                    parser->control = byte;
+                }
+                else if (byte == FLAG) parser->state = FLAG_RCV;
+                else parser->state = START;
+                break;
+            case C_RCV:
+                if (byte == (parser->control ^ A_TRANSMITTER)) {
+                    parser->state = BCC_OK;
+                    fieldDecoderReset(&parser->field);
+                }
+                else if (byte == FLAG) parser->state = FLAG_RCV;
+                else parser->state = START;
+                break;
+            default:
+                break;
+        }
+    }
+    return FALSE;
+}
+
+// Returns the payload size of a received data field, or "-1" if it is damaged.
+// In AEAD mode the payload is decrypted in place, once its tag is checked.
+static int checkField(const LinkConnection* conn, FieldDecoder* field, unsigned char control)
+{
+    if (field->malformed) return -1;
+    if (!conn->aead) return conn->frameChecker(field->data, field->size);
+
+    int payloadSize = field->size - AEAD_TAG_SIZE;
+    if (payloadSize < 1 || payloadSize > MAX_PAYLOAD_SIZE) return -1;
+
+    unsigned char header[2] = {A_TRANSMITTER, control};
+    unsigned char nonce[AEAD_NONCE_SIZE];
+
+    frameNonce(conn->recvBaseIndex + seqDistance(conn, conn->recvBase, infoSeq(conn, control)), nonce);
+    if (aeadOpen(conn->sessionKey, nonce, header, 2, field->data, payloadSize, field->data + payloadSize) == -1) return -1;
+    return payloadSize;
+}
+
+// Moves the receive window past the frames received in order, as far as the
+// packets not yet delivered allow, and acknowledges them.
+// Returns "0" on success or "-1" on error.
+static int advanceReceiveWindow(LinkConnection* conn)
+{
+    int advanced = FALSE;
+
+    while (conn->recvSlots[conn->recvBase].present == TRUE &&
+           seqDistance(conn, conn->deliverNext, conn->recvBase) < conn->windowSize) {
+        conn->recvBase = (conn->recvBase + 1) % conn->seqModulus;
+        conn->recvBaseIndex++;
+        advanced = TRUE;
+    }
+
+    if (advanced == FALSE) return 0;
+    return writeSupervisionFrame(conn, supervisionControl(conn, S_RR, conn->recvBase));
+}
+
+// Copies the next in-order packet to packet, which may be NULL to drop it.
+// Returns its size.
+static int deliverPacket(LinkConnection* conn, unsigned char* packet)
+{
+    WindowSlot* slot = &conn->recvSlots[conn->deliverNext];
+    int size = slot->size;
+
+    if (packet != NULL) memcpy(packet, slot->data, size);
+    free(slot->data);
+    slot->data = NULL;
+    slot->present = FALSE;
+    conn->deliverNext = (conn->deliverNext + 1) % conn->seqModulus;
+
+    return size;
+}
+
+// Hands in-order packets to the onPacket callback, if there is one.
+// Returns "0" on success or "-1" on error.
+static int deliverToCallback(LinkConnection* conn)
+{
+    if (conn->callbacks.onPacket == NULL) return 0;
+
+    while (conn->deliverNext != conn->recvBase) {
+        WindowSlot* slot = &conn->recvSlots[conn->deliverNext];
+
+        conn->callbacks.onPacket(conn, slot->data, slot->size, conn->callbacks.user);
+        deliverPacket(conn, NULL);
+
+        if (advanceReceiveWindow(conn) == -1) return -1;
+    }
+    return 0;
+}
+
+// Sends DISC from the receiver and waits for the final UA.
+// Returns "0" on success or "-1" on error.
+static int answerDisconnection(LinkConnection* conn)
+{
+    if (writeParamFrame(conn, A_RECEIVER, C_DISC, NULL, 0) == -1) return -1;
+    LINK_TRACE(conn, TRACE_DISC_SENT, 0, 0);
+
+    conn->closeState = CLOSE_WAIT_UA;
+    startTimer(conn, conn->timeoutMs);
+    return 0;
+}
+
+// Handles DISC / UA from the transmitter. A DISC before linkShutdown is kept
+// until the application closes, as the transmitter repeats it meanwhile.
+// Returns "0" on success or "-1" on error.
+static int handleDisconnection(LinkConnection* conn, unsigned char control)
+{
+    if (control == C_UA) {
+        if (conn->closeState != CLOSE_WAIT_UA) return 0;
+        LINK_TRACE(conn, TRACE_UA_RECEIVED, 0, 0);
+        stopTimer(conn);
+        conn->cleanClose = TRUE;
+        conn->closeState = CLOSE_DONE;
+        return 0;
+    }
+
+    LINK_TRACE(conn, TRACE_DISC_RECEIVED, 0, 0);
+
+    if (conn->closeState == CLOSE_NONE) {
+        conn->peerDisconnected = TRUE;
+        return 0;
+    }
+    conn->timeouts = 0;
+    return answerDisconnection(conn);
+}
+
+// Handles the frame left in conn->recvParser by parseInfoFrame.
+// Returns "0" on success or "-1" on error.
+static int handleInfoFrame(LinkConnection* conn)
+{
+    InfoFrameParser* parser = &conn->recvParser;
+
+    if (parser->control == C_SET) return answerRepeatedSet(conn);
+    if (parser->control == C_PROBE) return writeSupervisionFrame(conn, supervisionControl(conn, S_RR, conn->recvBase));
+    if (parser->control == C_DISC || parser->control == C_UA) return handleDisconnection(conn, parser->control);
+    if (conn->closeState != CLOSE_NONE && conn->closeState != CLOSE_WAIT_DISC) return 0;
+
+    int seq = infoSeq(conn, parser->control);
+    int offset = seqDistance(conn, conn->recvBase, seq);
+
+    if (offset >= conn->windowSize) {
+        // Already received, so its RR was lost: acknowledge it again
+        logInfo(conn, "Duplicate frame discarded\n");
+        LINK_TRACE(conn, TRACE_I_DUPLICATE, seq, 0);
+        conn->counters.frames_duplicate++;
+        return writeSupervisionFrame(conn, supervisionControl(conn, S_RR, conn->recvBase));
+    }
+
+    int packetSize = checkField(conn, &parser->field, parser->control);
+
+    if (packetSize == -1 || rand_r(&conn->randSeed) % 100 + 1 <= conn->params.fer) {
+        logInfo(conn, "FCS check failed\n");
+        LINK_TRACE(conn, TRACE_I_DAMAGED, seq, parser->field.size);
+        conn->counters.frames_damaged++;
+
+        // Every damaged copy consumed one transmission, so always ask again
+        if (writeSupervisionFrame(conn, supervisionControl(conn, S_SREJ, seq)) == -1) return -1;
+        conn->srejSent[seq] = TRUE;
+        logInfo(conn, conn->windowSize > 1 ? "Sent SREJ frame\n" : "Sent REJ frame\n");
+        return 0;
+    }
+
+    LINK_TRACE(conn, TRACE_I_RECEIVED, seq, packetSize);
+    conn->counters.frames_received++;
+    conn->counters.payload_bytes += packetSize;
+
+    WindowSlot* slot = &conn->recvSlots[seq];
+    if (slot->present == FALSE) {
+        slot->data = (unsigned char*)malloc(packetSize * sizeof(unsigned char));
+
+        if (slot->data == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(slot->data, parser->field.data, packetSize);
+        slot->size = packetSize;
+        slot->present = TRUE;
+    }
+    conn->srejSent[seq] = FALSE;
+
+    // Ask for the frames missing before this one
+    for (int i = conn->recvBase; i != seq; i = (i + 1) % conn->seqModulus) {
+        if (conn->recvSlots[i].present == FALSE && conn->srejSent[i] == FALSE) {
+            if (writeSupervisionFrame(conn, supervisionControl(conn, S_SREJ, i)) == -1) return -1;
+            conn->srejSent[i] = TRUE;
+        }
+    }
+
+    if (advanceReceiveWindow(conn) == -1) return -1;
+    if (conn->closeState != CLOSE_NONE) return 0;
+    return deliverToCallback(conn);
+}
+
+// Gives up the frame being received once the line stays silent for
+// FRAME_GAP_MS: its closing FLAG was lost, so the frame is damaged and asked
+// for again now instead of after the transmitter's timeout.
+// Returns "0" on success or "-1" on error.
+static int endStalledFrame(LinkConnection* conn)
+{
+    InfoFrameParser* parser = &conn->recvParser;
+
+    if (parser->state != BCC_OK || monotonicMs() < frameGapDeadline(conn)) return 0;
+
+    logInfo(conn, "Frame cut short, closing FLAG lost\n");
+    parser->state = START;
+    parser->field.malformed = TRUE;
+
+    // Only an I-frame can be asked for again
+    if (!isInfoControl(conn, parser->control)) return 0;
+    return handleInfoFrame(conn);
+}
+
+// Processes the frames received so far without blocking.
+// Returns "0" on success or "-1" on error.
+static int pollReceiver(LinkConnection* conn)
+{
+    while (fillRxBuffer(conn) > 0) {
+        conn->lastRxMs = monotonicMs();
+        if (parseInfoFrame(conn) && handleInfoFrame(conn) == -1) return -1;
+    }
+    return endStalledFrame(conn);
+}
+
+////////////////////////////////////////////////
+// DISCONNECTION
+////////////////////////////////////////////////
+
+// Sends DISC from the transmitter and restarts the timer.
+// Returns "0" on success or "-1" on error.
+static int sendDisconnection(LinkConnection* conn)
+{
+    if (writeParamFrame(conn, A_TRANSMITTER, C_DISC, NULL, 0) == -1) return -1;
+    LINK_TRACE(conn, TRACE_DISC_SENT, 0, 0);
+
+    startTimer(conn, conn->timeoutMs);
+    return 0;
+}
+
+// Advances the disconnection without blocking.
+// Returns "0" on success or "-1" if it failed.
+static int pollClose(LinkConnection* conn)
+{
+    unsigned char byte;
+
+    if (monotonicMs() >= conn->closeDeadline) {
+        // Only the final UA is missing: the receiver got everything
+        if (conn->closeState == CLOSE_WAIT_UA) {
+            conn->closeState = CLOSE_DONE;
+            return 0;
+        }
+        return -1;
+    }
+
+    switch (conn->closeState) {
+        case CLOSE_DRAINING:
+            // Wait for the I-frames in flight and queued, but disconnect even if they are lost
+            if (!conn->failed && pollTransmitter(conn) == -1) {
+                printf("Frames left unacknowledged\n");
+                conn->failed = TRUE;
+            }
+            if (!conn->failed && (conn->sendBase != conn->sendNext || conn->queued > 0)) return 0;
+
+            conn->timeouts = 0;
+            initParamFrameParser(&conn->closeParser, A_RECEIVER, C_DISC);
+            conn->closeState = CLOSE_DISC_SENT;
+            return sendDisconnection(conn);
+
+        case CLOSE_DISC_SENT:
+            while (readByte(conn, &byte) > 0) {
+                if (!parseParamFrameByte(&conn->closeParser, byte)) continue;
+
+                stopTimer(conn);
+                LINK_TRACE(conn, TRACE_DISC_RECEIVED, 0, 0);
+
+                if (writeParamFrame(conn, A_TRANSMITTER, C_UA, NULL, 0) == -1) return -1;
+                LINK_TRACE(conn, TRACE_UA_SENT, 0, 0);
+
+                conn->cleanClose = TRUE;
+                conn->closeState = CLOSE_DONE;
+                return 0;
+            }
+            if (timerRunning(conn)) return 0;
+            if (conn->params.nRetransmissions <= conn->timeouts) return -1;
+            return sendDisconnection(conn);
+
+        case CLOSE_WAIT_DISC:
+        case CLOSE_WAIT_UA:
+            // Repeated I-frames are still acknowledged, in case the last RR was lost
+            if (pollReceiver(conn) == -1) return -1;
+            if (conn->closeState != CLOSE_WAIT_UA || timerRunning(conn)) return 0;
+
+            if (conn->params.nRetransmissions <= conn->timeouts) {
+                conn->closeState = CLOSE_DONE;
+                return 0;
+            }
+            return answerDisconnection(conn);
+
+        default:
+            return 0;
+    }
+}
+
+////////////////////////////////////////////////
+// CONNECTIONS
+////////////////////////////////////////////////
+
+// Takes a reference to the frame pool of the process, starting it with
+// threads - 1 workers if there is none yet.
+// Returns the pool, or NULL on error.
+static FramePool* acquireFramePool(int threads)
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    if (framePool == NULL) framePool = framePoolCreate(threads - 1);
+    if (framePool != NULL) framePoolUsers++;
+
+    FramePool* pool = framePool;
+    pthread_mutex_unlock(&connectionsLock);
+    return pool;
+}
+
+// Takes a reference to the trace of the process, opening filename for it if
+// there is none yet.
+// Returns "0" on success or "-1" on error.
+static int acquireTrace(const char* filename, LinkLayerRole role)
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    int res = traceUsers > 0 ? 0 : traceOpen(filename, role, TRACE_DEFAULT_EVENTS);
+    if (res == 0) traceUsers++;
+
+    pthread_mutex_unlock(&connectionsLock);
+    return res;
+}
+
+// Drops a reference to the trace, closing it with the last one.
+static void releaseTrace()
+{
+    pthread_mutex_lock(&connectionsLock);
+    if (--traceUsers == 0) traceClose();
+    pthread_mutex_unlock(&connectionsLock);
+}
+
+// Drops a reference to the frame pool, stopping it with the last one.
+static void releaseFramePool()
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    if (--framePoolUsers == 0) {
+        framePoolDestroy(framePool);
+        framePool = NULL;
+    }
+    pthread_mutex_unlock(&connectionsLock);
+}
+
+// Restores the port settings, closes it and frees the connection.
+static void freeConnection(LinkConnection* conn)
+{
+    if (conn->fd >= 0) {
+        if (tcsetattr(conn->fd, TCSADRAIN, &conn->oldtio) == -1) perror("tcsetattr");
+        close(conn->fd);
+    }
+    for (int i = 0; i < SEQ_MODULUS_EXT; i++) {
+        free(conn->sendSlots[i].data);
+        free(conn->recvSlots[i].data);
+    }
+    for (QueuedFrame* queued = takeQueued(conn); queued != NULL; queued = takeQueued(conn)) {
+        free(queued->data);
+        free(queued);
+    }
+    pthread_mutex_destroy(&conn->queueLock);
+    if (conn->usesTrace) releaseTrace();
+    if (conn->framePool != NULL) releaseFramePool();
+    captureClose(conn->capture);
+    explicit_bzero(conn->key, sizeof(conn->key));
+    explicit_bzero(conn->sessionKey, sizeof(conn->sessionKey));
+    free(conn);
+}
+
+// Runs SET / UA with the peer, agreeing on the window, FCS, timeout and baud rate.
+// Returns "0" on success or "-1" on error.
+static int negotiate(LinkConnection* conn, int baudRate)
+{
+    const LinkLayer* params = &conn->params;
+
+    LinkParams offer;
+    offer.baudRate = params->maxBaudRate > baudRate ? params->maxBaudRate : 0;
+    offer.windowSize = params->windowSize;
+    offer.timeout = 0;
+    offer.fcs = conn->hasKey ? FCS_AEAD : params->fcs;
+    offer.salt = conn->salt;
+    offer.keepalive = params->role == LLTX && params->keepalive > 0 ? params->keepalive : 0;
+
+    // Plain SET unless something needs negotiating, to stay compatible with classic peers
+    if (offer.baudRate > 0 || offer.windowSize > 1 || offer.fcs != FCS_BCC2 || offer.keepalive > 0 ||
+        params->fastConnect == TRUE) {
+        offer.timeout = conn->timeoutMs;
+    }
+
+    LinkParams agreed = {baudRate, 1, conn->timeoutMs, FCS_BCC2, 0};
+
+    long long deadline = 0;
+    if (params->connectTimeout > 0) {
+        deadline = monotonicMs() + params->connectTimeout;
+    }
+    else if (params->fastConnect == TRUE && params->role == LLTX) {
+        deadline = monotonicMs() + (long long) params->nRetransmissions * conn->timeoutMs;
+    }
+
+    if (params->role == LLTX) {
+        if (connectTransmitter(conn, &offer, &agreed, deadline) == -1) return -1;
+
+        setWindowSize(conn, agreed.windowSize);
+        if (startSession(conn, agreed.fcs, conn->salt, agreed.salt) == -1) return -1;
+        conn->keepalive = agreed.keepalive;
+        if (conn->keepalive > 0) logInfo(conn, "Keepalive set to %d ms\n", conn->keepalive);
+        if (agreed.baudRate == baudRate) return 0;
+
+        // The round trip time at the initial rate no longer applies
+        conn->srttMs = -1;
+
+        // Confirm the new rate with a plain SET / UA exchange, falling back to
+        // the initial rate if the receiver cannot be reached at it
+        long long confirmDeadline = monotonicMs() + (long long) params->nRetransmissions * conn->timeoutMs;
+
+        if (serialSetBaudRate(conn->fd, agreed.baudRate) == 0 &&
+            connectTransmitter(conn, NULL, NULL, confirmDeadline) == 0) {
+            logInfo(conn, "Baud rate set to %d\n", agreed.baudRate);
+            conn->lineBaudRate = agreed.baudRate;
+            return 0;
+        }
+
+        logInfo(conn, "Could not switch to %d baud, falling back to %d\n", agreed.baudRate, baudRate);
+        if (serialSetBaudRate(conn->fd, baudRate) == -1) return -1;
+        flushSerial(conn);
+
+        return connectTransmitter(conn, NULL, NULL, deadline);
+    }
+
+    while (TRUE) {
+        if (connectReceiver(conn, &agreed, deadline) == -1) return -1;
+
+        setWindowSize(conn, agreed.windowSize);
+        if (startSession(conn, agreed.fcs, agreed.salt, conn->salt) == -1) return -1;
+        conn->timeoutMs = agreed.timeout;
+        if (agreed.baudRate == baudRate) return 0;
+
+        // Wait for the UA to leave the port before changing its speed
+        tcdrain(conn->fd);
+
+        long long confirmDeadline = monotonicMs() + (long long) params->nRetransmissions * conn->timeoutMs;
+
+        if (serialSetBaudRate(conn->fd, agreed.baudRate) == 0 &&
+            connectReceiver(conn, NULL, confirmDeadline) == 0) {
+            logInfo(conn, "Baud rate set to %d\n", agreed.baudRate);
+            conn->lineBaudRate = agreed.baudRate;
+            return 0;
+        }
 
-void alarmHandler()
-{
-    alarmEnabled = FALSE;
-    alarmCounter++;
-    printf("Timeout: Alarm #%d\n", alarmCounter);
+        logInfo(conn, "Could not switch to %d baud, falling back to %d\n", agreed.baudRate, baudRate);
+        if (serialSetBaudRate(conn->fd, baudRate) == -1) return -1;
+        flushSerial(conn);
+    }
 }
 
-////////////////////////////////////////////////
-// LLOPEN
-////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters)
+LinkConnection* linkOpen(LinkLayer connectionParameters)
 {
-    (void) signal(SIGALRM, alarmHandler);
+    int baudRate = connectionParameters.baudRate;
+
+    if (!serialIsValidBaudRate(baudRate)) {
+        printf("Unsupported baud rate: %d\n", baudRate);
+        return NULL;
+    }
+    if (connectionParameters.maxBaudRate != 0 && !serialIsValidBaudRate(connectionParameters.maxBaudRate)) {
+        printf("Unsupported maximum baud rate: %d\n", connectionParameters.maxBaudRate);
+        return NULL;
+    }
+    if (connectionParameters.windowSize < 1 || connectionParameters.windowSize > MAX_WINDOW_SIZE) {
+        printf("Invalid window size: %d\n", connectionParameters.windowSize);
+        return NULL;
+    }
+    if (connectionParameters.fcs != FCS_BCC2 && connectionParameters.fcs != FCS_CRC16 && connectionParameters.fcs != FCS_AEAD) {
+        printf("Invalid frame check sequence: %d\n", connectionParameters.fcs);
+        return NULL;
+    }
+    if (connectionParameters.fcs == FCS_AEAD && connectionParameters.keyFile[0] == '\0') {
+        printf("Encryption needs a key file\n");
+        return NULL;
+    }
+    if (connectionParameters.fer < 0 || connectionParameters.fer > 100) {
+        printf("Invalid frame error rate: %d\n", connectionParameters.fer);
+        return NULL;
+    }
+    if (connectionParameters.role != LLTX && connectionParameters.role != LLRX) {
+        printf("Invalid role\n");
+        return NULL;
+    }
+    if (connectionParameters.frameThreads < 0 || connectionParameters.frameThreads > FRAME_POOL_MAX_THREADS) {
+        printf("Invalid number of frame threads: %d\n", connectionParameters.frameThreads);
+        return NULL;
+    }
+
+    LinkConnection* conn = (LinkConnection*)calloc(1, sizeof(LinkConnection));
+    if (conn == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    conn->fd = -1;
+    conn->params = connectionParameters;
+    pthread_mutex_init(&conn->queueLock, NULL);
+
+    if (connectionParameters.keyFile[0] != '\0') {
+        if (aeadLoadKey(connectionParameters.keyFile, conn->key) == -1) {
+            freeConnection(conn);
+            return NULL;
+        }
+        if (getentropy(&conn->salt, sizeof(conn->salt)) == -1) {
+            perror("getentropy");
+            freeConnection(conn);
+            return NULL;
+        }
+        conn->hasKey = TRUE;
+    }
+
+    if (connectionParameters.role == LLTX && connectionParameters.frameThreads > 1) {
+        conn->framePool = acquireFramePool(connectionParameters.frameThreads);
+        if (conn->framePool == NULL) {
+            freeConnection(conn);
+            return NULL;
+        }
+    }
+
+    if (connectionParameters.traceFile[0] != '\0') {
+        if (acquireTrace(connectionParameters.traceFile, connectionParameters.role) == -1) {
+            freeConnection(conn);
+            return NULL;
+        }
+        conn->usesTrace = TRUE;
+    }
+    conn->traceId = atomic_fetch_add(&linksOpened, 1) + 1;
+    LINK_TRACE(conn, TRACE_LINK_OPEN, connectionParameters.windowSize, baudRate);
 
     int fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY);
     if (fd < 0)
     {
         perror(connectionParameters.serialPort);
-        return -1;
+        freeConnection(conn);
+        return NULL;
     }
 
     struct termios newtio;
 
-    if (tcgetattr(fd, &oldtio) == -1)
+    if (tcgetattr(fd, &conn->oldtio) == -1)
     { /* save current port settings */
         perror("tcgetattr");
-        return -1;
+        close(fd);
+        freeConnection(conn);
+        return NULL;
     }
+    conn->fd = fd;
 
     memset(&newtio, 0, sizeof(newtio));
 
-    newtio.c_cflag = connectionParameters.baudRate | CS8 | CLOCAL | CREAD;
+    newtio.c_cflag = CS8 | CLOCAL | CREAD;
     newtio.c_iflag = IGNPAR;
     newtio.c_oflag = 0;
 
+    if (connectionParameters.flowControl == FLOW_RTS_CTS) {
+        newtio.c_cflag |= CRTSCTS;
+    }
+    else if (connectionParameters.flowControl == FLOW_XON_XOFF) {
+        newtio.c_iflag |= IXON | IXOFF;
+        newtio.c_cc[VSTART] = XON;
+        newtio.c_cc[VSTOP] = XOFF;
+        conn->escapeFlowControl = TRUE;
+    }
+
     /* set input mode (non-canonical, no echo,...) */
     newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 0; 
-    newtio.c_cc[VMIN] = 0;                            
+    newtio.c_cc[VTIME] = 0;
+    newtio.c_cc[VMIN] = 0;
 
-    tcflush(fd, TCIOFLUSH);
+    flushSerial(conn);
 
     if (tcsetattr(fd, TCSANOW, &newtio) == -1)
     {
         perror("tcsetattr");
-        return -1;
+        freeConnection(conn);
+        return NULL;
     }
 
-    printf("New termios structure set\n");
-
-    State currState = START;
+    if (serialSetBaudRate(fd, baudRate) == -1) {
+        freeConnection(conn);
+        return NULL;
+    }
 
-    unsigned char bufW[5] = {0};
-    unsigned char byte;
+    if (connectionParameters.lowLatency == TRUE && serialSetLowLatency(fd) == -1) {
+        logInfo(conn, "Low latency mode not supported by %s\n", connectionParameters.serialPort);
+    }
 
-    if (connectionParameters.role == LLTX) {
-
-        bufW[0] = FLAG;
-        bufW[1] = A_TRANSMITTER;
-        bufW[2] = C_SET;
-        bufW[3] = bufW[1] ^ bufW[2];
-        bufW[4] = FLAG;
-
-        while (connectionParameters.nRetransmissions > alarmCounter) {
-            if (alarmEnabled == FALSE) {
-                int resW = write(fd, bufW, 5);
-            
-                if (resW < 0) {
-                    perror("write");
-                    return -1;
-                }
-                // printf("Sent SET\n");
-                alarm(connectionParameters.timeout);
-                alarmEnabled = TRUE;
-            }
-            if (read(fd, &byte, 1) > 0) {
-                switch (currState) {
-                    case START:
-                        if (byte == FLAG) currState = FLAG_RCV;
-                        break;
-                    case FLAG_RCV:
-                        if (byte == A_RECEIVER) currState = A_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case A_RCV:
-                        if (byte == C_UA) currState = C_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case C_RCV:
-                        if (byte == (C_UA ^ A_RECEIVER)) currState = BCC_OK;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case BCC_OK:
-                        if (byte == FLAG) { 
-                            currState = STOP; 
-                            alarm(0);
-                            // printf("Received UA\n"); 
-                            return fd; 
-                        }
-                        else currState = START;                    
-                        break;
-                    default:
-                        break;
+    logInfo(conn, "New termios structure set\n");
 
-                }
-            }
+    conn->timeoutMs = connectionParameters.timeout * 1000;
+    conn->lineBaudRate = baudRate;
+    conn->randSeed = connectionParameters.randomSeed != 0 ? connectionParameters.randomSeed : time(NULL) ^ (fd << 16);
+    conn->srttMs = -1;
+    setWindowSize(conn, 1);
+    setFcs(conn, FCS_BCC2);
 
+    if (connectionParameters.captureFile[0] != '\0') {
+        conn->capture = captureOpen(connectionParameters.captureFile, &connectionParameters, conn->randSeed);
+        if (conn->capture == NULL) {
+            freeConnection(conn);
+            return NULL;
         }
-        return -1;
+    }
 
-    } else if (connectionParameters.role == LLRX) {
-        while (currState != STOP) {
-            if (read(fd, &byte, 1) > 0) {
-                switch (currState) {
-                    case START:
-                        if (byte == FLAG) currState = FLAG_RCV;
-                        break;
-                    case FLAG_RCV:
-                        if (byte == A_TRANSMITTER) currState = A_RCV;
-                        else if (byte != FLAG) currState = START;
-                        break;
-                    case A_RCV:
-                        if (byte == C_SET) currState = C_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case C_RCV:
-                        if (byte == (C_SET ^ A_TRANSMITTER)) currState = BCC_OK;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case BCC_OK:
-                        if (byte == FLAG) { 
-                            currState = STOP; 
-                            // printf("Received SET\n"); 
-                        }
-                        else currState = START;                    
-                        break;
-                    default:
-                        break;
+    if (negotiate(conn, baudRate) == -1) {
+        freeConnection(conn);
+        return NULL;
+    }
+    return conn;
+}
 
-                }
-            }
-            
-        }
+int linkFd(const LinkConnection* conn)
+{
+    return conn->fd;
+}
+
+void linkSetCallbacks(LinkConnection* conn, const LinkCallbacks* callbacks)
+{
+    if (callbacks == NULL) memset(&conn->callbacks, 0, sizeof(conn->callbacks));
+    else conn->callbacks = *callbacks;
+}
 
-        bufW[0] = FLAG;
-        bufW[1] = A_RECEIVER;
-        bufW[2] = C_UA;
-        bufW[3] = bufW[1] ^ bufW[2];
-        bufW[4] = FLAG;
+unsigned char* linkFrame(const LinkConnection* conn, const unsigned char* buf, int bufSize, int* frameSize)
+{
+    if (conn->capture != NULL) captureRecord(conn->capture, CAPTURE_PACKET, buf, bufSize);
 
-        int resW = write(fd, bufW, 5);
+    // The control field depends on the sequence number, so linkSendFrame sets it
+    return buildInfoFrame(conn, buf, bufSize, 0, frameSize);
+}
 
-        if (resW != 5) {
-            perror("write");
-            return -1;
-        }
+int linkSendFrame(LinkConnection* conn, unsigned char* frame, int frameSize)
+{
+    // Queued messages go first, and may leave no room for the frame
+    if (conn->params.role == LLTX && !conn->failed && sendQueued(conn) == -1) {
+        free(frame);
+        return -1;
+    }
+    return sendInfoFrame(conn, frame, frameSize);
+}
 
-        return fd;
+int linkSend(LinkConnection* conn, const unsigned char* buf, int bufSize)
+{
+    if (seqDistance(conn, conn->sendBase, conn->sendNext) >= conn->windowSize) return 0;
 
-    } else printf("Invalid role\n");     
+    int frameSize = 0;
+    unsigned char* frame = linkFrame(conn, buf, bufSize, &frameSize);
 
-    return -1;
+    if (frame == NULL) return -1;
+
+    int res = linkSendFrame(conn, frame, frameSize);
+    if (res == 0) free(frame);
+    return res;
 }
 
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(int fd, LinkLayer connectionParameters, const unsigned char *buf, int bufSize)
-{   
-    unsigned char bcc2 = buf[0];
-    for (int i = 1; i < bufSize; i++) {
-        bcc2 ^= buf[i];
+int linkQueue(LinkConnection* conn, const unsigned char* buf, int bufSize, LinkPriority priority)
+{
+    if (priority < 0 || priority >= LINK_PRIORITIES) {
+        printf("Invalid priority: %d\n", priority);
+        return -1;
     }
 
-    int stuffedBufSize = 0;
-    unsigned char* stuffedBuf = byteStuffing(buf, bufSize, &stuffedBufSize);
-    if (stuffedBuf == NULL) {
+    QueuedFrame* queued = (QueuedFrame*)malloc(sizeof(QueuedFrame));
+    if (queued == NULL) {
+        perror("malloc");
         return -1;
     }
 
-    stuffedBufSize++;
-    if (bcc2 == FLAG || bcc2 == ESC) {
-        stuffedBufSize++;
-        stuffedBuf = (unsigned char*)realloc(stuffedBuf, stuffedBufSize * sizeof(unsigned char));
-        if (stuffedBuf == NULL) {
-            perror("realloc");
-            return -1;
+    queued->data = linkFrame(conn, buf, bufSize, &queued->size);
+    if (queued->data == NULL) {
+        free(queued);
+        return -1;
+    }
+    queued->next = NULL;
+
+    pthread_mutex_lock(&conn->queueLock);
+    if (conn->queueTail[priority] == NULL) conn->queueHead[priority] = queued;
+    else conn->queueTail[priority]->next = queued;
+    conn->queueTail[priority] = queued;
+    conn->queued++;
+    pthread_mutex_unlock(&conn->queueLock);
+
+    return 0;
+}
+
+int linkQueued(const LinkConnection* conn)
+{
+    return conn->queued;
+}
+
+int linkReceive(LinkConnection* conn, unsigned char* packet)
+{
+    if (conn->deliverNext == conn->recvBase) return 0;
+
+    int size = deliverPacket(conn, packet);
+
+    // Room was made in the window, so frames held back can be acknowledged
+    if (advanceReceiveWindow(conn) == -1) return -1;
+    return size;
+}
+
+int linkPoll(LinkConnection* conn)
+{
+    if (conn->closeState != CLOSE_NONE) {
+        if (!linkClosed(conn) && pollClose(conn) == -1) conn->closeState = CLOSE_FAILED;
+        if (linkClosed(conn)) {
+            stopTimer(conn);
+            conn->closeDeadline = 0;
         }
-        stuffedBuf[stuffedBufSize - 2] = ESC;
-        stuffedBuf[stuffedBufSize - 1] = bcc2 ^ 0x20;
+        return 0;
     }
-    else {
-        stuffedBuf = (unsigned char*)realloc(stuffedBuf, stuffedBufSize * sizeof(unsigned char));
-        stuffedBuf[stuffedBufSize - 1] = bcc2;
+    if (conn->failed) return -1;
+
+    int res = conn->params.role == LLTX ? pollTransmitter(conn) : pollReceiver(conn);
+
+    if (res == -1) {
+        conn->failed = TRUE;
+        if (conn->callbacks.onError != NULL) conn->callbacks.onError(conn, conn->callbacks.user);
     }
+    return res;
+}
 
-    int frameSize = FH_SIZE + stuffedBufSize + 1;
-    unsigned char* frame = (unsigned char *)malloc(frameSize * sizeof(unsigned char));
+int linkPending(const LinkConnection* conn)
+{
+    return seqDistance(conn, conn->sendBase, conn->sendNext);
+}
 
-    if (frame == NULL) {
-        perror("malloc");
-        return -1;
+int linkTimeout(const LinkConnection* conn)
+{
+    long long deadline = nextDeadline(conn);
+
+    if (deadline == 0) return -1;
+
+    long long remaining = deadline - monotonicMs();
+    return remaining > 0 ? remaining : 0;
+}
+
+// Returns the payload size with the best expected throughput when each byte
+// is lost with probability errorRate and a frame costs FRAME_OVERHEAD bytes
+// more: the positive root of L^2 + H*L - H/p, found by Newton's method.
+static int optimalPayloadSize(double errorRate)
+{
+    if (errorRate <= 0) return MAX_PAYLOAD_SIZE;
+
+    double overhead = FRAME_OVERHEAD;
+    double size = MAX_PAYLOAD_SIZE;
+
+    for (int i = 0; i < 32; i++) {
+        size -= (size * size + overhead * size - overhead / errorRate) / (2 * size + overhead);
     }
 
-    // Construct frame header
-    frame[0] = FLAG;
-    frame[1] = A_TRANSMITTER;
-    frame[2] = C_INFO_FRAME(Ns);
-    frame[3] = frame[1] ^ frame[2];
+    if (size < 64) return 64;
+    return size < MAX_PAYLOAD_SIZE ? (int) size : MAX_PAYLOAD_SIZE;
+}
+
+void linkGetQuality(const LinkConnection* conn, LinkQuality* quality)
+{
+    quality->rttMs = conn->srttMs < 0 ? -1 : (int) conn->srttMs;
+    quality->rttVarMs = conn->srttMs < 0 ? 0 : (int) conn->rttVarMs;
+    quality->timeoutMs = retransmissionTimeout(conn, FH_SIZE + MAX_PAYLOAD_SIZE + conn->fcsSize + 1);
+    quality->errorRate = conn->exposedBytes > 0 ? conn->lostFrames / conn->exposedBytes : 0;
+    quality->payloadSize = optimalPayloadSize(quality->errorRate);
+    quality->probesSent = conn->probesSent;
+    quality->probesLost = conn->probesLost;
+}
 
-    // Construct frame data and bcc2
-    memcpy(frame + FH_SIZE, stuffedBuf, stuffedBufSize);
+// Polls the connection, sleeping between attempts, until the condition on it holds.
+// Returns "0" on success or "-1" on error.
+static int waitUntil(LinkConnection* conn, int (*done)(const LinkConnection*))
+{
+    while (TRUE) {
+        if (linkPoll(conn) == -1) return -1;
+        if (done(conn)) return 0;
+        waitInput(conn, 0);
+    }
+}
 
-    // Construct flag from the frame trailer
-    frame[frameSize - 1] = FLAG;
+static int windowHasRoom(const LinkConnection* conn)
+{
+    return linkPending(conn) < conn->windowSize;
+}
 
-    State currState = START;
-    unsigned char byte, receivedC;
+static int allAcknowledged(const LinkConnection* conn)
+{
+    return linkPending(conn) == 0;
+}
 
-    alarmCounter = 0;
-    alarmEnabled = FALSE;
+// The transmitter gives up with DISC, so stop waiting for packets then.
+static int packetReady(const LinkConnection* conn)
+{
+    return conn->deliverNext != conn->recvBase || conn->peerDisconnected;
+}
 
-    while (connectionParameters.nRetransmissions > alarmCounter) {
-        if (alarmEnabled == FALSE) {
-            int resW = write(fd, frame, frameSize);
-            
-            if (resW != frameSize) {
-                perror("write");
-                return -1;
-            } 
+int linkWriteFrame(LinkConnection* conn, unsigned char* frame, int frameSize)
+{
+    int res = 0;
 
-            alarm(connectionParameters.timeout);
-            alarmEnabled = TRUE;
-        }
-        if (read(fd, &byte, 1) > 0) {
-            switch (currState) {
-                case START:
-                    if (byte == FLAG) currState = FLAG_RCV;
-                    break;
-                case FLAG_RCV:
-                    if (byte == A_RECEIVER) currState = A_RCV;
-                    else if (byte == FLAG) currState = FLAG_RCV;
-                    else currState = START;
-                    break;
-                case A_RCV:
-                    if (byte == C_RR(Ns)) currState = C_RCV;
-                    else if (byte == C_REJ(Ns)) currState = C_RCV;
-                    else if (byte == FLAG) currState = FLAG_RCV;
-                    else currState = START;
-                    receivedC = byte;
-                    break;
-                case C_RCV:
-                    if (byte == (C_RR(Ns) ^ A_RECEIVER) || byte == (C_REJ(Ns) ^ A_RECEIVER)) currState = BCC_OK;
-                    else if (byte == FLAG) currState = FLAG_RCV;
-                    else currState = START;
-                    break;
-                case BCC_OK:
-                    if (byte == FLAG) { 
-                        if (receivedC == C_RR(Ns)) {
-                            alarm(0);
-                            Ns = (Ns + 1) % 2;
-                            free(stuffedBuf);
-                            free(frame);
-                            return stuffedBufSize - 1;
-                        } else if (receivedC == C_REJ(Ns)) {
-                            printf("Received REJ. Retransmitting...\n");
-                            alarm(0);
-                            alarmEnabled = FALSE;
-                            currState = START;
-                        }
-                    }
-                    else currState = START;                    
-                    break;
-                default:
-                    break;
-            }
+    // Queued messages may take the room first
+    while (res == 0) {
+        if (waitUntil(conn, windowHasRoom) == -1) {
+            free(frame);
+            return -1;
         }
+        res = linkSendFrame(conn, frame, frameSize);
     }
-    return -1;
+    if (res == -1) return -1;
+
+    // Stop-and-wait returns once the frame was acknowledged
+    if (conn->windowSize == 1 && waitUntil(conn, allAcknowledged) == -1) return -1;
+    return res;
+}
+
+int linkRead(LinkConnection* conn, unsigned char* packet)
+{
+    if (waitUntil(conn, packetReady) == -1) return -1;
+    if (conn->deliverNext == conn->recvBase) {
+        printf("Disconnected by the transmitter\n");
+        return -1;
+    }
+    return linkReceive(conn, packet);
 }
 
 ////////////////////////////////////////////////
-// LLREAD
+// LLCLOSE
 ////////////////////////////////////////////////
-int llread(int fd, LinkLayer connectionParameters, unsigned char *packet)
+
+void linkShutdown(LinkConnection* conn, int timeoutMs)
 {
-    unsigned char byte, receivedC;
-    int packetSize = 0;
-    unsigned char* stuffedPacket = (unsigned char*)malloc((2 * (MAX_PAYLOAD_SIZE + 1)) * sizeof(unsigned char));
+    if (conn->closeState != CLOSE_NONE) return;
 
-    if (stuffedPacket == NULL) {
-        perror("malloc");
-        return -1;
+    if (timeoutMs <= 0) timeoutMs = (conn->params.nRetransmissions + 1) * conn->timeoutMs;
+    conn->closeStartMs = monotonicMs();
+    conn->closeDeadline = conn->closeStartMs + timeoutMs;
+
+    if (conn->params.role == LLTX) {
+        conn->closeState = CLOSE_DRAINING;
+        return;
     }
 
-    State currState = START;
-    alarmCounter = 0;
-    alarmEnabled = FALSE;
-
-    srand(time(NULL));
-    int r = rand() % 100 + 1;
-
-    while (currState != STOP) {
-        if (read(fd, &byte, 1) > 0) {
-            switch (currState) {
-                case START:
-                    if (byte == FLAG) currState = FLAG_RCV;
-                    break;
-                case FLAG_RCV:
-                    if (byte == A_TRANSMITTER) currState = A_RCV;
-                    else if (byte == FLAG) currState = FLAG_RCV;
-                    else currState = START;
-                    break;
-                case A_RCV:
-                    if (byte == C_INFO_FRAME(0) || byte == C_INFO_FRAME(1)) { 
-                        currState = C_RCV;
-                        receivedC = byte;
-                    }
-                    else if (byte == FLAG) currState = FLAG_RCV;
-                    else currState = START;
-                    break;
-                case C_RCV:
-                    if (byte == (receivedC ^ A_TRANSMITTER)) currState = BCC_OK;
-                    else if (byte == FLAG) currState = FLAG_RCV;
-                    else currState = START;
-                    break;
-                case BCC_OK:
-                    if (byte == FLAG) {
-                        stuffedPacket = (unsigned char*)realloc(stuffedPacket, packetSize * sizeof(unsigned char));
-
-                        unsigned char* destuffedPacket = byteDestuffing(stuffedPacket, packetSize, &packetSize);
-
-                        if (destuffedPacket == NULL) {
-                            return -1;
-                        }
-
-                        packetSize--;
-
-                        unsigned char bcc2 = destuffedPacket[packetSize];
-
-                        destuffedPacket = (unsigned char*)realloc(destuffedPacket, packetSize * sizeof(unsigned char));
-
-                        if (destuffedPacket == NULL) {
-                            return -1;
-                        }
-
-                        unsigned char bcc2Check = destuffedPacket[0];
-                        for (int i = 1; i < packetSize; i++) {
-                            bcc2Check ^= destuffedPacket[i];
-                        }
-
-                        unsigned char frame[5] = {0};
-
-                        frame[0] = FLAG;
-                        frame[1] = A_RECEIVER;
-                        frame[4] = FLAG;
-
-                        if (bcc2Check != bcc2 || r <= FER) {
-                            printf("BCC2 check failed\n");
-
-                            frame[2] = C_REJ(Nr);
-                            frame[3] = frame[1] ^ frame[2];
-
-                            int resW = write(fd, frame, 5);
-        
-                            if (resW != 5) {
-                                perror("write");
-                                return -1;
-                            }
-
-                            printf("Sent REJ frame\n");
-                            free(destuffedPacket);
-                            free(stuffedPacket);
-                            return packetSize;
-                        }
-                        else {
-                            frame[2] = C_RR(Nr);
-                            frame[3] = frame[1] ^ frame[2];
-
-                            Nr = (Nr + 1) % 2;
-
-                            int resW = write(fd, frame, 5);
-        
-                            if (resW != 5) {
-                                perror("write");
-                                return -1;
-                            }
-                            
-                            for (int i = 0; i < packetSize; i++) packet[i] = destuffedPacket[i];
-
-                            free(destuffedPacket);
-                            free(stuffedPacket);
-                            return packetSize;
-                        }
-
-                    }
-                    else stuffedPacket[packetSize++] = byte;       
-                    break;
-                default:
-                    break;
-            }
-        }
+    conn->closeState = CLOSE_WAIT_DISC;
+    conn->timeouts = 0;
+    if (conn->peerDisconnected && answerDisconnection(conn) == -1) conn->closeState = CLOSE_FAILED;
+}
+
+int linkClosed(const LinkConnection* conn)
+{
+    return conn->closeState == CLOSE_DONE || conn->closeState == CLOSE_FAILED;
+}
+
+static void printStatistics(const LinkConnection* conn, const Statistics* stats)
+{
+    printf("\t**Statistics**\n");
+    printf("Time taken to connect: %.3f seconds\n", stats->open_time);
+
+    if (conn->params.role == LLTX) {
+        printf("Average time taken to send a packet: %.3f seconds\n", stats->data_time);
+        printf("Average debit: %.3f bytes per second\n", stats->debit);
+        printf("Frames sent: %d (%d retransmitted), %llu bytes\n", stats->frames_sent, stats->frames_resent, stats->payload_bytes);
+        printf("Timeouts: %d\n", stats->timeouts);
     }
-    return 0;
+    else {
+        printf("Average time taken to receive a packet: %.3f seconds\n", stats->data_time);
+        printf("Frames received: %d (%d damaged, %d duplicate), %llu bytes\n", stats->frames_received,
+               stats->frames_damaged, stats->frames_duplicate, stats->payload_bytes);
+    }
+    printf("Time taken to disconnect: %.3f seconds%s\n", stats->close_time, stats->clean_close ? "" : " (incomplete)");
+}
+
+int linkClose(LinkConnection* conn, int showStatistics, Statistics* stats)
+{
+    linkShutdown(conn, 0);
+    waitUntil(conn, linkClosed);
+
+    int res = conn->closeState == CLOSE_DONE ? 1 : -1;
+
+    Statistics result = conn->counters;
+    if (stats != NULL) {
+        result.open_time = stats->open_time;
+        result.data_time = stats->data_time;
+        result.debit = stats->debit;
+    }
+    result.close_time = (monotonicMs() - conn->closeStartMs) / 1000.0;
+    result.clean_close = conn->cleanClose;
+
+    if (stats != NULL) *stats = result;
+    if (showStatistics == TRUE) printStatistics(conn, &result);
+
+    LINK_TRACE(conn, TRACE_LINK_CLOSE, 0, res == 1);
+    freeConnection(conn);
+    return res;
 }
 
 ////////////////////////////////////////////////
-// LLCLOSE
+// FILE DESCRIPTOR API
 ////////////////////////////////////////////////
-int llclose(int fd, LinkLayer connectionParameters, int showStatistics, Statistics stats)
+// llopen / llwrite / llread / llclose keep their original signatures over
+// connection handles, registered by file descriptor.
+
+static int registerConnection(LinkConnection* conn)
 {
-    (void) signal(SIGALRM, alarmHandler);
+    int res = -1;
+
+    pthread_mutex_lock(&connectionsLock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i] == NULL) {
+            connections[i] = conn;
+            res = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&connectionsLock);
 
-    State currState = START;
-    unsigned char bufW[5] = {0};
-    unsigned char byte;
+    if (res == -1) printf("Too many open connections\n");
+    return res;
+}
 
-    if (connectionParameters.role == LLTX) {
-    
-        if (showStatistics == TRUE) {
-            printf("\t**Statistics**\n");
-            printf("Time taken to connect: %.3f seconds\n", stats.open_time);
-            printf("Average time taken to send a packet: %.3f seconds\n", stats.data_time);
-            printf("Average debit: %.3f bytes per second\n", stats.debit);
+// Returns the connection open on fd, removing it from the registry if
+// unregister is TRUE, or NULL if there is none.
+static LinkConnection* findConnection(int fd, int unregister)
+{
+    LinkConnection* conn = NULL;
+
+    pthread_mutex_lock(&connectionsLock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i] != NULL && connections[i]->fd == fd) {
+            conn = connections[i];
+            if (unregister) connections[i] = NULL;
+            break;
         }
-        
-        bufW[0] = FLAG;
-        bufW[1] = A_TRANSMITTER;
-        bufW[2] = C_DISC;
-        bufW[3] = bufW[1] ^ bufW[2];
-        bufW[4] = FLAG;
-        
-        alarmCounter = 0;
-        alarmEnabled = FALSE;
-
-        while (connectionParameters.nRetransmissions > alarmCounter && currState != STOP) {
-            if (alarmEnabled == FALSE) { 
-                int resW = write(fd, bufW, 5);
-                
-                if (resW != 5) {
-                    perror("write");
-                    if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-                    close(fd);
-                    return -1;
-                } 
-                // printf("Sent DISC\n");
-                alarm(connectionParameters.timeout);
-                alarmEnabled = TRUE;
-            }
-            if (read(fd, &byte, 1) > 0) {
-                switch (currState) {
-                    case START:
-                        if (byte == FLAG) currState = FLAG_RCV;
-                        break;
-                    case FLAG_RCV:
-                        if (byte == A_RECEIVER) currState = A_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case A_RCV:
-                        if (byte == C_DISC) currState = C_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case C_RCV:
-                        if (byte == (C_DISC ^ A_RECEIVER)) currState = BCC_OK;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case BCC_OK:
-                        if (byte == FLAG) { 
-                            currState = STOP; 
-                            alarm(0);
-                            // printf("Received DISC\n"); 
-                        }
-                        else currState = START;                    
-                        break;
-                    default:
-                        break;
+    }
+    pthread_mutex_unlock(&connectionsLock);
 
-                }
-            }
-        }
-        if (currState == STOP) {
-            bufW[0] = FLAG;
-            bufW[1] = A_TRANSMITTER;    
-            bufW[2] = C_UA;
-            bufW[3] = bufW[1] ^ bufW[2];
-            bufW[4] = FLAG;
-
-            int resW = write(fd, bufW, 5);
-            if (resW != 5) {
-                perror("write");
-                if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-                close(fd);
-                return -1;
-            }
+    if (conn == NULL) printf("No connection open on descriptor %d\n", fd);
+    return conn;
+}
 
-            // printf("Sent UA\n");
-            if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-            close(fd);
-            return 1;
-        }
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+int llopen(LinkLayer connectionParameters)
+{
+    LinkConnection* conn = linkOpen(connectionParameters);
+    if (conn == NULL) return -1;
 
-        if (connectionParameters.nRetransmissions == alarmCounter) {
-            if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-            close(fd);
-            return -1;
-        }
+    if (registerConnection(conn) == -1) {
+        freeConnection(conn);
+        return -1;
+    }
+    return conn->fd;
+}
 
-        if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-        close(fd);
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+int llwrite(int fd, LinkLayer connectionParameters, const unsigned char *buf, int bufSize)
+{
+    int frameSize = 0;
+    unsigned char* frame = llframe(fd, buf, bufSize, &frameSize);
+
+    if (frame == NULL) {
         return -1;
     }
-    else if (connectionParameters.role == LLRX) {
-        if (showStatistics == TRUE) {
-            printf("\t**Statistics**\n");
-            printf("Time taken to connect: %.3f seconds\n", stats.open_time);
-            printf("Average time taken to receive a packet: %.3f seconds\n", stats.data_time);
-        }
-    
-        while (currState != STOP) {
-            if (read(fd, &byte, 1) > 0) {
-                switch (currState) {
-                    case START:
-                        if (byte == FLAG) currState = FLAG_RCV;
-                        break;
-                    case FLAG_RCV:
-                        if (byte == A_TRANSMITTER) currState = A_RCV;
-                        else if (byte != FLAG) currState = START;
-                        break;
-                    case A_RCV:
-                        if (byte == C_DISC) currState = C_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case C_RCV:
-                        if (byte == (C_DISC ^ A_TRANSMITTER)) currState = BCC_OK;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case BCC_OK:
-                        if (byte == FLAG) { 
-                            currState = STOP; 
-                            // printf("Received DISC\n"); 
-                        }
-                        else currState = START;                    
-                        break;
-                    default:
-                        break;
 
-                }
-            }
-            
-        }
+    return llwriteFrame(fd, connectionParameters, frame, frameSize);
+}
 
-        bufW[0] = FLAG;
-        bufW[1] = A_RECEIVER;
-        bufW[2] = C_DISC;
-        bufW[3] = bufW[1] ^ bufW[2];
-        bufW[4] = FLAG;
-
-        currState = START;
-        alarmCounter = 0;
-        alarmEnabled = FALSE;
-
-        while (connectionParameters.nRetransmissions > alarmCounter) {
-            if (alarmEnabled == FALSE) {
-                int resW = write(fd, bufW, 5);
-                if (resW != 5) {
-                    perror("write");
-                    if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-                    close(fd);
-                    return -1;
-                }
-        
-                // printf("Sent DISC\n");
-                alarm(connectionParameters.timeout);
-                alarmEnabled = TRUE;
-            }
-            if (read(fd, &byte, 1) > 0) {
-                switch (currState) {
-                    case START:
-                        if (byte == FLAG) currState = FLAG_RCV;
-                        break;
-                    case FLAG_RCV:
-                        if (byte == A_TRANSMITTER) currState = A_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case A_RCV:
-                        if (byte == C_UA) currState = C_RCV;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case C_RCV:
-                        if (byte == (C_UA ^ A_TRANSMITTER)) currState = BCC_OK;
-                        else if (byte == FLAG) currState = FLAG_RCV;
-                        else currState = START;
-                        break;
-                    case BCC_OK:
-                        if (byte == FLAG) { 
-                            currState = STOP; 
-                            alarm(0);
-                            // printf("Received UA\n"); 
-                            if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-                            close(fd);
-                            return 1;
-                        }
-                        else currState = START;                    
-                        break;
-                    default:
-                        break;
+unsigned char* llframe(int fd, const unsigned char* buf, int bufSize, int* frameSize)
+{
+    LinkConnection* conn = findConnection(fd, FALSE);
+    if (conn == NULL) return NULL;
 
-                }
-            }
-        }
+    return linkFrame(conn, buf, bufSize, frameSize);
+}
+
+int llwriteFrame(int fd, LinkLayer connectionParameters, unsigned char* frame, int frameSize)
+{
+    LinkConnection* conn = findConnection(fd, FALSE);
+    if (conn == NULL) {
+        free(frame);
+        return -1;
     }
-    else printf("Invalid role\n");
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1) perror("tcsetattr");
-    close(fd);
-    return -1;
+
+    return linkWriteFrame(conn, frame, frameSize);
+}
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int llread(int fd, LinkLayer connectionParameters, unsigned char *packet)
+{
+    LinkConnection* conn = findConnection(fd, FALSE);
+    if (conn == NULL) return -1;
+
+    return linkRead(conn, packet);
+}
+
+int llqueue(int fd, const unsigned char *buf, int bufSize, LinkPriority priority)
+{
+    LinkConnection* conn = findConnection(fd, FALSE);
+    if (conn == NULL) return -1;
+
+    return linkQueue(conn, buf, bufSize, priority);
+}
+
+int llquality(int fd, LinkQuality *quality)
+{
+    LinkConnection* conn = findConnection(fd, FALSE);
+    if (conn == NULL) return -1;
+
+    linkGetQuality(conn, quality);
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LLCLOSE
+////////////////////////////////////////////////
+int llclose(int fd, LinkLayer connectionParameters, int showStatistics, Statistics *stats)
+{
+    LinkConnection* conn = findConnection(fd, TRUE);
+    if (conn == NULL) return -1;
+
+    return linkClose(conn, showStatistics, stats);
+}
+
+int needsEscape(unsigned char byte) {
+    return frameByteClass[byte] != BYTE_PLAIN;
 }
 
 unsigned char* byteStuffing(const unsigned char* buf, int bufSize, int* stuffedBufSize) {
     *stuffedBufSize = bufSize;
 
     for (int i = 0; i < bufSize; i++) {
-        if (buf[i] == ESC || buf[i] == FLAG) (*stuffedBufSize)++;
+        if (needsEscape(buf[i])) (*stuffedBufSize)++;
     }
 
     unsigned char *res = (unsigned char *)malloc((*stuffedBufSize) * sizeof(unsigned char));
@@ -656,7 +2371,7 @@ unsigned char* byteStuffing(const unsigned char* buf, int bufSize, int* stuffedB
 
     int j = 0;
     for (int i = 0; i < bufSize; i++) {
-        if (buf[i] == ESC || buf[i] == FLAG) {
+        if (needsEscape(buf[i])) {
             res[j++] = ESC;
             res[j++] = buf[i] ^ 0x20;
             continue;
@@ -678,6 +2393,12 @@ unsigned char* byteDestuffing(const unsigned char* stuffedBuf, int stuffedBufSiz
     while (i < stuffedBufSize) {
         if (stuffedBuf[i] == ESC) {
             i++;
+
+            // A trailing ESC has nothing to escape
+            if (i == stuffedBufSize) {
+                free(destuffedBuf);
+                return NULL;
+            }
             destuffedBuf[j] = stuffedBuf[i] ^ 0x20;
         } else {
             destuffedBuf[j] = stuffedBuf[i];
@@ -688,7 +2409,11 @@ unsigned char* byteDestuffing(const unsigned char* stuffedBuf, int stuffedBufSiz
 
     *destuffedBufSize = j;
 
-    destuffedBuf = (unsigned char*)realloc(destuffedBuf, (*destuffedBufSize) * sizeof(unsigned char));
+    // Shrinking cannot lose data, so keep the larger buffer if it fails
+    if (j > 0) {
+        unsigned char* shrunk = (unsigned char*)realloc(destuffedBuf, j * sizeof(unsigned char));
+        if (shrunk != NULL) destuffedBuf = shrunk;
+    }
 
     return destuffedBuf;
 }
@@ -0,0 +1,79 @@
+// Transfer progress implementation
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+
+static long long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Writes one report: bytes, percentage, goodput since the last report and ETA
+// at the average rate so far.
+static void report(Progress *progress, long long now, int final)
+{
+    double elapsed = (now - progress->startMs) / 1000.0;
+    double interval = (now - progress->lastReportMs) / 1000.0;
+    double average = elapsed > 0 ? progress->done / elapsed : 0;
+    double current = final ? average : (interval > 0 ? (progress->done - progress->lastReportBytes) / interval : 0);
+
+    char line[160];
+    int size = snprintf(line, sizeof(line), "%s%s: %llu", progress->isTerminal ? "\r" : "", progress->label, progress->done);
+
+    if (progress->total > 0) {
+        size += snprintf(line + size, sizeof(line) - size, "/%llu bytes (%.1f%%)", progress->total,
+                         100.0 * progress->done / progress->total);
+    }
+    else size += snprintf(line + size, sizeof(line) - size, " bytes");
+
+    size += snprintf(line + size, sizeof(line) - size, ", %.1f kB/s", current / 1000);
+
+    if (final) {
+        size += snprintf(line + size, sizeof(line) - size, " in %.1f s", elapsed);
+    }
+    else if (progress->total > progress->done && average > 0) {
+        long long eta = (long long) ((progress->total - progress->done) / average);
+        size += snprintf(line + size, sizeof(line) - size, ", ETA %lld:%02lld", eta / 60, eta % 60);
+    }
+
+    // Pad over the remains of a longer previous line on a terminal
+    size += snprintf(line + size, sizeof(line) - size, progress->isTerminal && !final ? "    " : "\n");
+    if (size >= (int) sizeof(line)) size = sizeof(line) - 1;
+
+    if (write(progress->fd, line, size) < 0) progress->fd = -1;
+
+    progress->lastReportMs = now;
+    progress->lastReportBytes = progress->done;
+}
+
+void progressStart(Progress *progress, int fd, int intervalMs, const char *label, unsigned long long total)
+{
+    progress->fd = fd;
+    progress->isTerminal = fd >= 0 && isatty(fd);
+    progress->intervalMs = intervalMs;
+    progress->label = label;
+    progress->total = total;
+    progress->done = 0;
+    progress->startMs = progress->lastReportMs = nowMs();
+    progress->lastReportBytes = 0;
+}
+
+void progressAdd(Progress *progress, unsigned long long bytes)
+{
+    progress->done += bytes;
+    if (progress->fd < 0) return;
+
+    long long now = nowMs();
+    if (now - progress->lastReportMs >= progress->intervalMs) report(progress, now, 0);
+}
+
+void progressFinish(Progress *progress)
+{
+    if (progress->fd < 0) return;
+    report(progress, nowMs(), 1);
+}
@@ -0,0 +1,226 @@
+// Serial port helpers implementation
+// NOTE: On Linux this file uses <asm/termbits.h> instead of <termios.h>, as both
+// define "struct termios" and cannot be included in the same translation unit.
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#else
+#include <termios.h>
+#endif
+
+#include "serial_port.h"
+
+typedef struct {
+    int baudRate;
+    unsigned int speed;
+} BaudRateEntry;
+
+static const BaudRateEntry baudRateTable[] = {
+    {1200, B1200},
+    {1800, B1800},
+    {2400, B2400},
+    {4800, B4800},
+    {9600, B9600},
+    {19200, B19200},
+    {38400, B38400},
+#ifdef B57600
+    {57600, B57600},
+#endif
+#ifdef B115200
+    {115200, B115200},
+#endif
+#ifdef B230400
+    {230400, B230400},
+#endif
+#ifdef B460800
+    {460800, B460800},
+#endif
+#ifdef B500000
+    {500000, B500000},
+#endif
+#ifdef B576000
+    {576000, B576000},
+#endif
+#ifdef B921600
+    {921600, B921600},
+#endif
+#ifdef B1000000
+    {1000000, B1000000},
+#endif
+#ifdef B1152000
+    {1152000, B1152000},
+#endif
+#ifdef B1500000
+    {1500000, B1500000},
+#endif
+#ifdef B2000000
+    {2000000, B2000000},
+#endif
+#ifdef B2500000
+    {2500000, B2500000},
+#endif
+#ifdef B3000000
+    {3000000, B3000000},
+#endif
+#ifdef B3500000
+    {3500000, B3500000},
+#endif
+#ifdef B4000000
+    {4000000, B4000000},
+#endif
+};
+
+#define BAUD_RATE_TABLE_SIZE (sizeof(baudRateTable) / sizeof(baudRateTable[0]))
+
+// Returns the termios speed constant for the baud rate, or "0" if it is not a standard rate.
+static unsigned int baudRateToSpeed(int baudRate)
+{
+    for (unsigned int i = 0; i < BAUD_RATE_TABLE_SIZE; i++) {
+        if (baudRateTable[i].baudRate == baudRate) return baudRateTable[i].speed;
+    }
+    return 0;
+}
+
+int serialIsValidBaudRate(int baudRate)
+{
+    if (baudRate <= 0 || baudRate > MAX_BAUD_RATE) return 0;
+#ifdef BOTHER
+    return 1;
+#else
+    return baudRateToSpeed(baudRate) != 0;
+#endif
+}
+
+#ifdef __linux__
+
+int serialSetBaudRate(int fd, int baudRate)
+{
+    if (!serialIsValidBaudRate(baudRate)) {
+        printf("Unsupported baud rate: %d\n", baudRate);
+        return -1;
+    }
+
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        perror("TCGETS2");
+        return -1;
+    }
+
+    unsigned int speed = baudRateToSpeed(baudRate);
+
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag &= ~(CBAUD << IBSHIFT);
+
+    if (speed != 0) {
+        tio.c_cflag |= speed;
+    }
+    else {
+        tio.c_cflag |= BOTHER;
+        tio.c_cflag |= BOTHER << IBSHIFT;
+    }
+    tio.c_ispeed = baudRate;
+    tio.c_ospeed = baudRate;
+
+    if (ioctl(fd, TCSETS2, &tio) == -1) {
+        perror("TCSETS2");
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int serialSetBaudRate(int fd, int baudRate)
+{
+    speed_t speed = baudRateToSpeed(baudRate);
+
+    if (speed == 0) {
+        printf("Unsupported baud rate: %d\n", baudRate);
+        return -1;
+    }
+
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) == -1) {
+        perror("tcgetattr");
+        return -1;
+    }
+
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if (tcsetattr(fd, TCSANOW, &tio) == -1) {
+        perror("tcsetattr");
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+
+int serialSetLowLatency(int fd)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serial;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) == -1) return -1;
+
+    serial.flags |= ASYNC_LOW_LATENCY;
+
+    if (ioctl(fd, TIOCSSERIAL, &serial) == -1) return -1;
+    return 0;
+#else
+    (void) fd;
+    return -1;
+#endif
+}
+
+// Returns the number of bytes waiting in the kernel output queue, or "0" if unknown.
+static int serialOutputQueue(int fd)
+{
+#ifdef TIOCOUTQ
+    int queued = 0;
+    if (ioctl(fd, TIOCOUTQ, &queued) == -1) return 0;
+    return queued;
+#else
+    (void) fd;
+    return 0;
+#endif
+}
+
+int serialWrite(int fd, const unsigned char* buf, int bufSize, int baudRate)
+{
+    int written = 0;
+
+    while (written < bufSize) {
+        int queued = serialOutputQueue(fd);
+
+        if (queued > SERIAL_OUTQ_LIMIT / 2) {
+            // Sleep for roughly the time the line takes to send the excess (10 bits per byte)
+            long long excess = queued - SERIAL_OUTQ_LIMIT / 2;
+            long long sleepTime = baudRate > 0 ? excess * 10 * 1000000LL / baudRate : 1000;
+            usleep(sleepTime > 0 ? sleepTime : 1);
+            continue;
+        }
+
+        int chunk = bufSize - written;
+        if (chunk > SERIAL_OUTQ_LIMIT - queued) chunk = SERIAL_OUTQ_LIMIT - queued;
+
+        int res = write(fd, buf + written, chunk);
+
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            perror("write");
+            return -1;
+        }
+        written += res;
+    }
+    return written;
+}
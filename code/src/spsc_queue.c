@@ -0,0 +1,90 @@
+// Single-producer single-consumer queue implementation
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "spsc_queue.h"
+
+// Spins before a waiting thread starts sleeping between retries
+#define SPSC_SPINS 64
+#define SPSC_SLEEP_US 50
+
+int spscInit(SpscQueue *queue, unsigned int capacity)
+{
+    unsigned int size = 1;
+    while (size < capacity) size <<= 1;
+
+    queue->items = (void **)malloc(size * sizeof(void *));
+    if (queue->items == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return 0;
+}
+
+void spscDestroy(SpscQueue *queue)
+{
+    free(queue->items);
+    queue->items = NULL;
+}
+
+int spscPush(SpscQueue *queue, void *item)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head > queue->mask) return 0;
+
+    queue->items[tail & queue->mask] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+void *spscPop(SpscQueue *queue)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head == tail) return NULL;
+
+    void *item = queue->items[head & queue->mask];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
+
+// Backs off while waiting: yields first, then sleeps so an idle stage does not burn a core.
+static void spscBackoff(int *spins)
+{
+    if (*spins < SPSC_SPINS) {
+        (*spins)++;
+        sched_yield();
+    }
+    else usleep(SPSC_SLEEP_US);
+}
+
+int spscPushWait(SpscQueue *queue, void *item, atomic_int *cancel)
+{
+    int spins = 0;
+    while (!spscPush(queue, item)) {
+        if (cancel != NULL && atomic_load(cancel)) return 0;
+        spscBackoff(&spins);
+    }
+    return 1;
+}
+
+void *spscPopWait(SpscQueue *queue, atomic_int *cancel)
+{
+    int spins = 0;
+    void *item;
+    while ((item = spscPop(queue)) == NULL) {
+        if (cancel != NULL && atomic_load(cancel)) return NULL;
+        spscBackoff(&spins);
+    }
+    return item;
+}
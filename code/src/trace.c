@@ -0,0 +1,122 @@
+// Protocol event trace implementation
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+TraceHeader *traceHeader = NULL;
+
+static TraceEvent *traceEvents = NULL;
+static size_t traceMapSize = 0;
+
+static const char *eventNames[TRACE_EVENT_TYPES] = {
+    [TRACE_LINK_OPEN] = "LINK_OPEN",
+    [TRACE_LINK_CLOSE] = "LINK_CLOSE",
+    [TRACE_SET_SENT] = "SET_SENT",
+    [TRACE_SET_RECEIVED] = "SET_RECEIVED",
+    [TRACE_UA_SENT] = "UA_SENT",
+    [TRACE_UA_RECEIVED] = "UA_RECEIVED",
+    [TRACE_DISC_SENT] = "DISC_SENT",
+    [TRACE_DISC_RECEIVED] = "DISC_RECEIVED",
+    [TRACE_I_SENT] = "I_SENT",
+    [TRACE_I_RESENT] = "I_RESENT",
+    [TRACE_I_RECEIVED] = "I_RECEIVED",
+    [TRACE_I_DAMAGED] = "I_DAMAGED",
+    [TRACE_I_DUPLICATE] = "I_DUPLICATE",
+    [TRACE_RR_SENT] = "RR_SENT",
+    [TRACE_RR_RECEIVED] = "RR_RECEIVED",
+    [TRACE_REJ_SENT] = "REJ_SENT",
+    [TRACE_REJ_RECEIVED] = "REJ_RECEIVED",
+    [TRACE_SREJ_SENT] = "SREJ_SENT",
+    [TRACE_SREJ_RECEIVED] = "SREJ_RECEIVED",
+    [TRACE_TIMEOUT] = "TIMEOUT",
+    [TRACE_PROBE_SENT] = "PROBE_SENT",
+    [TRACE_PROBE_ANSWERED] = "PROBE_ANSWERED",
+    [TRACE_PROBE_LOST] = "PROBE_LOST",
+};
+
+static uint64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int traceOpen(const char *filename, int role, unsigned int capacity)
+{
+    unsigned int size = 1;
+    while (size < capacity) size <<= 1;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+
+    size_t mapSize = sizeof(TraceHeader) + (size_t) size * sizeof(TraceEvent);
+
+    if (ftruncate(fd, mapSize) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    TraceHeader *header = (TraceHeader *)map;
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->role = role;
+    header->capacity = size;
+    header->reserved = 0;
+    header->startNs = monotonicNs();
+    atomic_init(&header->next, 0);
+
+    traceEvents = (TraceEvent *)(header + 1);
+    traceMapSize = mapSize;
+    traceHeader = header;
+    return 0;
+}
+
+void traceRecord(int link, TraceEventType type, int seq, unsigned int value)
+{
+    TraceHeader *header = traceHeader;
+    if (header == NULL) return;
+
+    unsigned long long index = atomic_fetch_add_explicit(&header->next, 1, memory_order_relaxed);
+    TraceEvent *event = &traceEvents[index & (header->capacity - 1)];
+
+    event->timeNs = monotonicNs() - header->startNs;
+    event->type = type;
+    event->seq = seq;
+    event->link = link;
+    event->value = value;
+}
+
+void traceClose()
+{
+    if (traceHeader == NULL) return;
+
+    TraceHeader *header = traceHeader;
+    traceHeader = NULL;
+
+    msync(header, traceMapSize, MS_ASYNC);
+    munmap(header, traceMapSize);
+    traceEvents = NULL;
+}
+
+const char *traceEventName(int type)
+{
+    if (type < 0 || type >= TRACE_EVENT_TYPES) return "UNKNOWN";
+    return eventNames[type];
+}
@@ -0,0 +1,288 @@
+// Transmit pipeline implementation
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "application_layer.h"
+#include "link_layer.h"
+#include "tx_pipeline.h"
+
+// Pushes an item to the next stage.
+// Returns TRUE on success or FALSE if the pipeline is stopping.
+static int pushItem(TxPipeline *pipeline, SpscQueue *queue, TxFrame *item)
+{
+    if (spscPushWait(queue, item, &pipeline->stopping)) return TRUE;
+
+    free(item->data);
+    free(item);
+    return FALSE;
+}
+
+// Frees the items left in a queue.
+static void drainQueue(SpscQueue *queue)
+{
+    TxFrame *item;
+
+    while ((item = (TxFrame *)spscPop(queue)) != NULL) {
+        free(item->data);
+        free(item);
+    }
+}
+
+static TxFrame *newItem(unsigned char *data, int size, unsigned int dataSize, int error)
+{
+    TxFrame *item = (TxFrame *)malloc(sizeof(TxFrame));
+
+    if (item == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    item->data = data;
+    item->size = size;
+    item->dataSize = dataSize;
+    item->error = error;
+    return item;
+}
+
+// Queues a packet carrying dataSize bytes of the file for the framer.
+// Returns TRUE on success, or FALSE on error or if the pipeline is stopping.
+static int pushPacket(TxPipeline *pipeline, unsigned char *packet, unsigned int packetSize, unsigned int dataSize)
+{
+    if (packet == NULL) return FALSE;
+
+    TxFrame *item = newItem(packet, packetSize, dataSize, FALSE);
+    if (item == NULL) {
+        free(packet);
+        return FALSE;
+    }
+    return pushItem(pipeline, &pipeline->packets, item);
+}
+
+// Sends a run of zeros as DP_ZERO packets.
+// Returns TRUE on success, or FALSE on error or if the pipeline is stopping.
+static int pushZeroRun(TxPipeline *pipeline, unsigned long long size)
+{
+    while (size > 0) {
+        unsigned int runSize = size > MAX_ZERO_RUN_SIZE ? MAX_ZERO_RUN_SIZE : size;
+        unsigned int packetSize = 0;
+
+        unsigned char *packet = createZeroPacket(runSize, &packetSize);
+
+        fileHashUpdateZeros(&pipeline->hash, runSize);
+        if (!pushPacket(pipeline, packet, packetSize, runSize)) return FALSE;
+
+        pipeline->zeroBytes += runSize;
+        size -= runSize;
+    }
+    return TRUE;
+}
+
+// Returns the number of zero bytes data starts with.
+static unsigned int zeroPrefix(const unsigned char *data, unsigned int size)
+{
+    unsigned int i = 0;
+    while (i < size && data[i] == 0) i++;
+    return i;
+}
+
+// Returns where the data packet starting at start ends: at limit, or where a
+// run of at least ZERO_RUN_MIN_SIZE zeros (that may go on past limit) starts.
+static unsigned int dataEnd(const unsigned char *buf, unsigned int size, unsigned int start, unsigned int limit)
+{
+    for (unsigned int i = start; i < limit; i++) {
+        if (buf[i] == 0 && (i == start || buf[i - 1] != 0) && zeroPrefix(buf + i, size - i) >= ZERO_RUN_MIN_SIZE) return i;
+    }
+    return limit;
+}
+
+// Returns the offset of the first hole (SEEK_HOLE) or data (SEEK_DATA) at or
+// after offset, or fileSize if there is none or the file system cannot tell.
+static unsigned long long seekExtent(TxPipeline *pipeline, unsigned long long offset, int whence)
+{
+    off_t res = lseek(fileno(pipeline->file), offset, whence);
+
+    if (res == -1) return whence == SEEK_DATA && errno != ENXIO ? offset : pipeline->fileSize;
+    return (unsigned long long) res < pipeline->fileSize ? (unsigned long long) res : pipeline->fileSize;
+}
+
+// Reads the file into data packets. With sparse, the holes of the file (found
+// with SEEK_DATA / SEEK_HOLE, without reading them) and the runs of at least
+// ZERO_RUN_MIN_SIZE zeros in its data are sent as DP_ZERO packets instead.
+static void *packetizerStage(void *arg)
+{
+    TxPipeline *pipeline = (TxPipeline *)arg;
+    int fd = fileno(pipeline->file);
+    unsigned long long offset = 0;
+    unsigned long long zeroRun = 0; // Zeros before offset not sent yet
+    int error = FALSE;
+
+    unsigned char *buf = (unsigned char *)malloc(TX_READ_SIZE * sizeof(unsigned char));
+    if (buf == NULL) {
+        perror("malloc");
+        error = TRUE;
+    }
+
+    while (!error && offset < pipeline->fileSize) {
+        unsigned long long readEnd = pipeline->fileSize;
+
+        if (pipeline->sparse) {
+            unsigned long long dataStart = seekExtent(pipeline, offset, SEEK_DATA);
+
+            if (dataStart > offset) {
+                zeroRun += dataStart - offset;
+                offset = dataStart;
+                continue;
+            }
+            readEnd = seekExtent(pipeline, offset, SEEK_HOLE);
+        }
+
+        unsigned int readSize = readEnd - offset > TX_READ_SIZE ? TX_READ_SIZE : readEnd - offset;
+        unsigned int size = 0;
+
+        while (size < readSize) {
+            ssize_t res = pread(fd, buf + size, readSize - size, offset + size);
+            if (res <= 0) break;
+            size += res;
+        }
+        if (size < readSize) {
+            printf("Error reading file.\n");
+            error = TRUE;
+            break;
+        }
+        offset += size;
+
+        unsigned int pos = 0;
+
+        while (pos < size) {
+            unsigned int zeros = pipeline->sparse ? zeroPrefix(buf + pos, size - pos) : 0;
+
+            // Short runs of zeros stay in the data, unless they carry on a
+            // run or may go on in the next read
+            if (zeros >= ZERO_RUN_MIN_SIZE || (zeros > 0 && (zeroRun > 0 || pos + zeros == size))) {
+                zeroRun += zeros;
+                pos += zeros;
+                continue;
+            }
+
+            if (zeroRun > 0 && !pushZeroRun(pipeline, zeroRun)) {
+                error = TRUE;
+                break;
+            }
+            zeroRun = 0;
+
+            unsigned int limit = size - pos > pipeline->chunkSize ? pos + pipeline->chunkSize : size;
+            unsigned int end = pipeline->sparse ? dataEnd(buf, size, pos, limit) : limit;
+            unsigned int packetSize = end - pos;
+            unsigned char *packet = createDataPacket(buf + pos, &packetSize);
+
+            fileHashUpdate(&pipeline->hash, buf + pos, end - pos);
+            if (!pushPacket(pipeline, packet, packetSize, end - pos)) {
+                error = TRUE;
+                break;
+            }
+            pos = end;
+        }
+    }
+
+    if (!error && zeroRun > 0 && !pushZeroRun(pipeline, zeroRun)) error = TRUE;
+    free(buf);
+
+    // Allocated by txPipelineStart, so the transmitter always gets the end
+    TxFrame *end = pipeline->end;
+    end->error = error;
+    pushItem(pipeline, &pipeline->packets, end);
+    return NULL;
+}
+
+static void *framerStage(void *arg)
+{
+    TxPipeline *pipeline = (TxPipeline *)arg;
+
+    while (TRUE) {
+        TxFrame *item = (TxFrame *)spscPopWait(&pipeline->packets, &pipeline->stopping);
+        if (item == NULL) return NULL;
+
+        int end = item->data == NULL;
+
+        if (!end) {
+            int frameSize = 0;
+            unsigned char *frame = llframe(pipeline->fd, item->data, item->size, &frameSize);
+
+            free(item->data);
+            item->data = frame;
+            item->size = frameSize;
+
+            if (frame == NULL) {
+                item->error = TRUE;
+                end = TRUE;
+            }
+        }
+
+        if (!pushItem(pipeline, &pipeline->frames, item) || end) return NULL;
+    }
+}
+
+int txPipelineStart(TxPipeline *pipeline, int fd, FILE *file, unsigned long long fileSize, unsigned int chunkSize, int sparse)
+{
+    pipeline->fd = fd;
+    pipeline->file = file;
+    pipeline->fileSize = fileSize;
+    pipeline->chunkSize = chunkSize;
+    pipeline->sparse = sparse;
+    pipeline->zeroBytes = 0;
+    fileHashInit(&pipeline->hash);
+    atomic_init(&pipeline->stopping, FALSE);
+
+    pipeline->end = newItem(NULL, 0, 0, FALSE);
+    if (pipeline->end == NULL) return -1;
+
+    if (spscInit(&pipeline->packets, TX_PIPELINE_DEPTH) == -1) {
+        free(pipeline->end);
+        return -1;
+    }
+    if (spscInit(&pipeline->frames, TX_PIPELINE_DEPTH) == -1) {
+        spscDestroy(&pipeline->packets);
+        free(pipeline->end);
+        return -1;
+    }
+
+    int res = pthread_create(&pipeline->packetizer, NULL, packetizerStage, pipeline);
+    if (res != 0) free(pipeline->end);
+    else {
+        res = pthread_create(&pipeline->framer, NULL, framerStage, pipeline);
+        if (res != 0) {
+            atomic_store(&pipeline->stopping, TRUE);
+            pthread_join(pipeline->packetizer, NULL);
+            drainQueue(&pipeline->packets);
+        }
+    }
+
+    if (res != 0) {
+        printf("Error creating pipeline threads.\n");
+        spscDestroy(&pipeline->packets);
+        spscDestroy(&pipeline->frames);
+        return -1;
+    }
+    return 0;
+}
+
+TxFrame *txPipelineNext(TxPipeline *pipeline)
+{
+    return (TxFrame *)spscPopWait(&pipeline->frames, NULL);
+}
+
+void txPipelineStop(TxPipeline *pipeline)
+{
+    atomic_store(&pipeline->stopping, TRUE);
+    pthread_join(pipeline->packetizer, NULL);
+    pthread_join(pipeline->framer, NULL);
+
+    drainQueue(&pipeline->packets);
+    drainQueue(&pipeline->frames);
+
+    spscDestroy(&pipeline->packets);
+    spscDestroy(&pipeline->frames);
+}
@@ -0,0 +1,90 @@
+// Measures how building a large I-frame scales with the cores of a frame pool.
+// Usage: framebench [payload size] [max threads] [bcc2|crc16]
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame_pool.h"
+
+#define DEFAULT_PAYLOAD_SIZE (1 << 20)
+#define RUN_SECONDS 0.5
+
+// The single-threaded encoder of the link layer, without its payload bound
+static DEFINE_FRAME_ENCODER(encodeBcc2, A_TRANSMITTER, BCC2, ESCAPE_BASIC, INT_MAX)
+static DEFINE_FRAME_ENCODER(encodeCrc16, A_TRANSMITTER, CRC16, ESCAPE_BASIC, INT_MAX)
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int payloadSize = argc > 1 ? atoi(argv[1]) : DEFAULT_PAYLOAD_SIZE;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    FcsType fcs = argc > 3 && strcmp(argv[3], "bcc2") == 0 ? FCS_BCC2 : FCS_CRC16;
+
+    if (payloadSize < 1 || maxThreads < 1 || maxThreads > FRAME_POOL_MAX_THREADS) {
+        printf("Usage: %s [payload size] [max threads, up to %d] [bcc2|crc16]\n", argv[0], FRAME_POOL_MAX_THREADS);
+        return 1;
+    }
+
+    unsigned char *payload = (unsigned char *)malloc(payloadSize);
+    unsigned char *reference = (unsigned char *)malloc(FRAME_MAX_SIZE(payloadSize, FCS_MAX_SIZE));
+    unsigned char *frame = (unsigned char *)malloc(FRAME_MAX_SIZE(payloadSize, FCS_MAX_SIZE));
+    if (payload == NULL || reference == NULL || frame == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    srand(1);
+    for (int i = 0; i < payloadSize; i++) payload[i] = rand();
+
+    FrameEncoder encoder = fcs == FCS_CRC16 ? encodeCrc16 : encodeBcc2;
+    int frameSize = encoder(payload, payloadSize, 0x00, reference);
+
+    printf("Payload: %d bytes, %s, frame: %d bytes\n\n", payloadSize, fcs == FCS_CRC16 ? "CRC-16" : "BCC2", frameSize);
+    printf("%8s %12s %8s\n", "threads", "MB/s", "speedup");
+
+    double baseline = 0;
+
+    for (int threads = 1; threads <= maxThreads; threads++) {
+        FramePool *pool = threads > 1 ? framePoolCreate(threads - 1) : NULL;
+        if (threads > 1 && pool == NULL) return 1;
+
+        memset(frame, 0, frameSize);
+        if (framePoolEncode(pool, A_TRANSMITTER, fcs, FALSE, payload, payloadSize, 0x00, frame) != frameSize ||
+            memcmp(frame, reference, frameSize) != 0) {
+            printf("%8d  frame differs from the single-threaded encoder\n", threads);
+            framePoolDestroy(pool);
+            return 1;
+        }
+
+        long long frames = 0;
+        double start = seconds();
+        double elapsed;
+
+        do {
+            framePoolEncode(pool, A_TRANSMITTER, fcs, FALSE, payload, payloadSize, 0x00, frame);
+            frames++;
+            elapsed = seconds() - start;
+        } while (elapsed < RUN_SECONDS);
+
+        double rate = frames * (double) payloadSize / elapsed / 1e6;
+        if (threads == 1) baseline = rate;
+        printf("%8d %12.1f %7.2fx\n", threads, rate, rate / baseline);
+
+        framePoolDestroy(pool);
+    }
+
+    free(payload);
+    free(reference);
+    free(frame);
+    return 0;
+}
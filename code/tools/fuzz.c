@@ -0,0 +1,208 @@
+// Fuzz target for the receive-side parsers: byte destuffing, the incremental
+// frame field decoder and the application packet parsers.
+// The first input byte picks the parser, the rest is what it is fed.
+//
+// libFuzzer: make fuzz-libfuzzer, then bin/fuzz-libfuzzer [corpus dir]
+// AFL:       make CC=afl-gcc bin/fuzz, then afl-fuzz -i in -o out bin/fuzz
+// Replay:    bin/fuzz [files] (standard input if none)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "application_layer.h"
+#include "frame_codec.h"
+
+// Largest input read by the standalone driver
+#define MAX_INPUT_SIZE (1 << 20)
+
+// Aborts, so the fuzzer records the input, if an invariant does not hold
+#define CHECK(condition) \
+    do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); abort(); } } while (0)
+
+enum
+{
+    TARGET_DESTUFFING,
+    TARGET_FIELD_DECODER,
+    TARGET_DATA_PACKETS,
+    TARGET_CONTROL_PACKETS,
+    N_TARGETS
+};
+
+static void fuzzDestuffing(const unsigned char *data, int size)
+{
+    if (size < 1) return;
+
+    int destuffedSize;
+    unsigned char *destuffed = byteDestuffing(data, size, &destuffedSize);
+
+    if (destuffed == NULL) {
+        // Only a trailing unpaired ESC is refused
+        CHECK(data[size - 1] == ESC);
+        return;
+    }
+    CHECK(destuffedSize >= 1 && destuffedSize <= size);
+
+    // Whatever was accepted must survive a round trip
+    int stuffedSize;
+    unsigned char *stuffed = byteStuffing(destuffed, destuffedSize, &stuffedSize);
+    CHECK(stuffed != NULL);
+
+    int againSize;
+    unsigned char *again = byteDestuffing(stuffed, stuffedSize, &againSize);
+    CHECK(again != NULL && againSize == destuffedSize && memcmp(again, destuffed, destuffedSize) == 0);
+
+    free(again);
+    free(stuffed);
+    free(destuffed);
+}
+
+static void fuzzFieldDecoder(const unsigned char *data, int size)
+{
+    static FieldDecoder field;
+
+    if (size < 1) return;
+
+    // Split the bytes the way reads from the port would
+    int chunkSize = data[0] % 64 + 1;
+    data++;
+    size--;
+
+    fieldDecoderReset(&field);
+
+    while (size > 0) {
+        int complete;
+        int feedSize = size < chunkSize ? size : chunkSize;
+        int consumed = fieldDecoderFeed(&field, data, feedSize, &complete);
+
+        CHECK(consumed >= 1 && consumed <= feedSize);
+        CHECK(field.size >= 0 && field.size <= (int) sizeof(field.data));
+        data += consumed;
+        size -= consumed;
+
+        if (!complete) continue;
+
+        if (!field.malformed) {
+            for (FcsType fcs = FCS_BCC2; fcs <= FCS_CRC16; fcs++) {
+                int payloadSize = frameCheckerFor(fcs)(field.data, field.size);
+                CHECK(payloadSize == -1 || (payloadSize >= 1 && payloadSize <= MAX_PAYLOAD_SIZE));
+            }
+        }
+        fieldDecoderReset(&field);
+    }
+}
+
+static void fuzzDataPackets(const unsigned char *data, int size)
+{
+    unsigned char *packet = (unsigned char *)malloc(size + 1);
+    unsigned char *out = (unsigned char *)malloc(size + 1);
+    BlockSignature blocks[SIGNATURES_PER_PACKET];
+    unsigned int a, b;
+
+    CHECK(packet != NULL && out != NULL);
+
+    // A copy of the exact size, so reads past the packet are caught
+    memcpy(packet, data, size);
+
+    int dataSize = parseDataPacket(packet, size, out);
+    CHECK(dataSize == -1 || (dataSize >= 0 && dataSize <= size - DP_HEADER_SIZE));
+
+    int messageSize = parseMessagePacket(packet, size, out);
+    CHECK(messageSize == -1 || (messageSize >= 0 && messageSize <= size - DP_HEADER_SIZE));
+
+    int count = parseSignaturePacket(packet, size, blocks, SIGNATURES_PER_PACKET);
+    CHECK(count >= -1 && count <= SIGNATURES_PER_PACKET);
+
+    parseCopyPacket(packet, size, &a, &b);
+    parseZeroPacket(packet, size, &a);
+
+    free(out);
+    free(packet);
+}
+
+static void fuzzControlPackets(const unsigned char *data, int size)
+{
+    unsigned char *packet = (unsigned char *)malloc(size + 1);
+    unsigned long long value;
+    unsigned int blockSize;
+
+    CHECK(packet != NULL);
+    memcpy(packet, data, size);
+
+    if (parseControlPacket(packet, size, &value) == 0) CHECK(size >= 1);
+    parseFileHash(packet, size, &value);
+    parseBlockSize(packet, size, &blockSize);
+
+    free(packet);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < 1 || size > MAX_INPUT_SIZE) return 0;
+
+    const unsigned char *input = data + 1;
+    int inputSize = size - 1;
+
+    switch (data[0] % N_TARGETS) {
+        case TARGET_DESTUFFING:
+            fuzzDestuffing(input, inputSize);
+            break;
+        case TARGET_FIELD_DECODER:
+            fuzzFieldDecoder(input, inputSize);
+            break;
+        case TARGET_DATA_PACKETS:
+            fuzzDataPackets(input, inputSize);
+            break;
+        case TARGET_CONTROL_PACKETS:
+            fuzzControlPackets(input, inputSize);
+            break;
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+// Runs one input read from file to the end.
+// Returns "0" on success or "-1" if it cannot be read.
+static int runFile(FILE *file, unsigned char *buf)
+{
+    size_t size = fread(buf, 1, MAX_INPUT_SIZE, file);
+
+    if (ferror(file)) {
+        perror("fread");
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(buf, size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *buf = (unsigned char *)malloc(MAX_INPUT_SIZE);
+
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (argc < 2) return runFile(stdin, buf) == -1;
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+
+        if (file == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        int res = runFile(file, buf);
+        fclose(file);
+        if (res == -1) return 1;
+    }
+
+    free(buf);
+    return 0;
+}
+
+#endif // LIBFUZZER
@@ -0,0 +1,235 @@
+// Round-trip property tests over byte stuffing, I-frame framing and the
+// application packets, on random inputs. Each property runs for a fixed time
+// and reports its throughput, so a hardening change that slows the hot path
+// shows up next to its correctness.
+// Usage: proptest [seconds per property] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "application_layer.h"
+#include "frame_codec.h"
+
+#define DEFAULT_RUN_SECONDS 0.5
+
+// Payloads drawn ahead of the timed loop, which cycles through them
+#define N_PAYLOADS 256
+
+// Fails the current property, describing the case
+#define EXPECT(condition) \
+    do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); return -1; } } while (0)
+
+typedef struct
+{
+    const char *name;
+    // Checks one random case of the given payload size.
+    // Returns the bytes processed, or "-1" if the property does not hold.
+    int (*check)(const unsigned char *payload, int size);
+} Property;
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Fills buf with random bytes, a share of them FLAG, ESC, XON and XOFF
+// so stuffing is exercised far more than by uniform bytes.
+static void randomPayload(unsigned char *buf, int size)
+{
+    static const unsigned char special[] = {FLAG, ESC, XON, XOFF};
+    int specialShare = rand() % 4; // In quarters: none up to three out of four
+
+    for (int i = 0; i < size; i++) {
+        buf[i] = rand() % 4 < specialShare ? special[rand() % 4] : rand();
+    }
+}
+
+static int checkStuffing(const unsigned char *payload, int size)
+{
+    int stuffedSize, destuffedSize;
+    unsigned char *stuffed = byteStuffing(payload, size, &stuffedSize);
+    EXPECT(stuffed != NULL && stuffedSize >= size && stuffedSize <= 2 * size);
+
+    for (int i = 0; i < stuffedSize; i++) EXPECT(stuffed[i] != FLAG);
+
+    unsigned char *destuffed = byteDestuffing(stuffed, stuffedSize, &destuffedSize);
+    EXPECT(destuffed != NULL && destuffedSize == size && memcmp(destuffed, payload, size) == 0);
+
+    free(destuffed);
+    free(stuffed);
+    return size;
+}
+
+// Encodes an I-frame, decodes it back as the receiver does, then checks that
+// a damaged byte in the field is caught by the FCS.
+static int checkFraming(const unsigned char *payload, int size)
+{
+    static unsigned char frame[FRAME_MAX_SIZE(MAX_PAYLOAD_SIZE, FCS_MAX_SIZE)];
+    static FieldDecoder field;
+
+    FcsType fcs = rand() % 2 ? FCS_CRC16 : FCS_BCC2;
+    int escapeFlowControl = rand() % 2;
+    unsigned char control = C_INFO_FRAME(rand() % 2);
+
+    int frameSize = frameEncoderFor(fcs, escapeFlowControl)(payload, size, control, frame);
+    EXPECT(frameSize >= FH_SIZE + size + fcsSize(fcs) + 1);
+    EXPECT(frame[0] == FLAG && frame[1] == A_TRANSMITTER && frame[2] == control && frame[3] == (A_TRANSMITTER ^ control));
+    EXPECT(frame[frameSize - 1] == FLAG && memchr(frame + 1, FLAG, frameSize - 2) == NULL);
+
+    if (escapeFlowControl) {
+        EXPECT(memchr(frame + FH_SIZE, XON, frameSize - FH_SIZE) == NULL);
+        EXPECT(memchr(frame + FH_SIZE, XOFF, frameSize - FH_SIZE) == NULL);
+    }
+
+    // Fed in two pieces, as reads from the port split it
+    int complete;
+    int split = rand() % (frameSize - FH_SIZE);
+    fieldDecoderReset(&field);
+    EXPECT(fieldDecoderFeed(&field, frame + FH_SIZE, split, &complete) == split && !complete);
+    EXPECT(fieldDecoderFeed(&field, frame + FH_SIZE + split, frameSize - FH_SIZE - split, &complete) == frameSize - FH_SIZE - split);
+    EXPECT(complete && !field.malformed);
+
+    FrameChecker checker = frameCheckerFor(fcs);
+    EXPECT(checker(field.data, field.size) == size && memcmp(field.data, payload, size) == 0);
+
+    field.data[rand() % field.size] ^= 1 + rand() % 255;
+    EXPECT(checker(field.data, field.size) == -1);
+
+    return size;
+}
+
+static int checkDataPacket(const unsigned char *payload, int size)
+{
+    static unsigned char data[MAX_PAYLOAD_SIZE];
+
+    if (size > MAX_PAYLOAD_SIZE - DP_HEADER_SIZE) size = MAX_PAYLOAD_SIZE - DP_HEADER_SIZE;
+
+    unsigned int packetSize = size;
+    unsigned char *packet = createDataPacket((unsigned char *)payload, &packetSize);
+    EXPECT(packet != NULL && packetSize == size + DP_HEADER_SIZE);
+    EXPECT(parseDataPacket(packet, packetSize, data) == size && memcmp(data, payload, size) == 0);
+
+    // Truncated packets must be refused, never read past
+    EXPECT(size == 0 || parseDataPacket(packet, packetSize - 1, data) == -1);
+
+    free(packet);
+    return packetSize;
+}
+
+static int checkControlPackets(const unsigned char *payload, int size)
+{
+    unsigned long long fileSize = 0, parsedSize, fileHash = 0, parsedHash;
+    unsigned int blockSize = (payload[0] << 8) | size, parsedBlockSize;
+
+    // A size of 0 to 8 random bytes, to cover every length of the field
+    int sizeBytes = rand() % 9;
+    for (int i = 0; i < sizeBytes; i++) fileSize = (fileSize << 8) | (rand() & 0xFF);
+    for (int i = 0; i < 8; i++) fileHash = (fileHash << 8) | (rand() & 0xFF);
+
+    unsigned long long packetSize = fileSize;
+    unsigned char *packet = createBasisPacket(fileSize, blockSize, &packetSize);
+    EXPECT(packet != NULL);
+    EXPECT(parseControlPacket(packet, packetSize, &parsedSize) == 0 && parsedSize == fileSize);
+    EXPECT(parseBlockSize(packet, packetSize, &parsedBlockSize) == 0 && parsedBlockSize == blockSize);
+    EXPECT(parseControlPacket(packet, CP_HEADER_SIZE - 1, &parsedSize) == -1);
+    int bytes = packetSize;
+    free(packet);
+
+    packet = createEndPacket(fileHash, &packetSize);
+    EXPECT(packet != NULL);
+    EXPECT(parseControlPacket(packet, packetSize, &parsedSize) == 0);
+    EXPECT(parseFileHash(packet, packetSize, &parsedHash) == 0 && parsedHash == fileHash);
+    EXPECT(parseFileHash(packet, packetSize - 1, &parsedHash) == -1);
+    bytes += packetSize;
+    free(packet);
+
+    return bytes;
+}
+
+static int checkDeltaPackets(const unsigned char *payload, int size)
+{
+    unsigned int block = rand(), count = rand() % DELTA_MAX_COPY + 1, run = rand() % MAX_ZERO_RUN_SIZE + 1;
+    unsigned int parsedBlock, parsedCount, parsedRun, packetSize;
+
+    unsigned char *packet = createCopyPacket(block, count, &packetSize);
+    EXPECT(packet != NULL);
+    EXPECT(parseCopyPacket(packet, packetSize, &parsedBlock, &parsedCount) == 0);
+    EXPECT(parsedBlock == block && parsedCount == count);
+    EXPECT(parseCopyPacket(packet, packetSize - 1, &parsedBlock, &parsedCount) == -1);
+    int bytes = packetSize;
+    free(packet);
+
+    packet = createZeroPacket(run, &packetSize);
+    EXPECT(packet != NULL);
+    EXPECT(parseZeroPacket(packet, packetSize, &parsedRun) == 0 && parsedRun == run);
+    EXPECT(parseZeroPacket(packet, packetSize - 1, &parsedRun) == -1);
+    bytes += packetSize;
+    free(packet);
+
+    return bytes;
+}
+
+static const Property properties[] = {
+    {"stuffing", checkStuffing},
+    {"framing", checkFraming},
+    {"data packet", checkDataPacket},
+    {"control packets", checkControlPackets},
+    {"delta packets", checkDeltaPackets},
+};
+
+#define N_PROPERTIES (sizeof(properties) / sizeof(properties[0]))
+
+int main(int argc, char *argv[])
+{
+    double runSeconds = argc > 1 ? atof(argv[1]) : DEFAULT_RUN_SECONDS;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 10) : time(NULL);
+
+    if (runSeconds <= 0) {
+        printf("Usage: %s [seconds per property] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    static unsigned char payloads[N_PAYLOADS][MAX_PAYLOAD_SIZE];
+    int sizes[N_PAYLOADS];
+    int failed = 0;
+
+    printf("Seed: %u\n\n", seed);
+    printf("%-16s %10s %10s\n", "property", "cases", "MB/s");
+
+    for (unsigned int i = 0; i < N_PROPERTIES; i++) {
+        // Every property sees the same cases for a given seed
+        srand(seed);
+        for (int j = 0; j < N_PAYLOADS; j++) {
+            sizes[j] = 1 + rand() % MAX_PAYLOAD_SIZE;
+            randomPayload(payloads[j], sizes[j]);
+        }
+
+        long long cases = 0, bytes = 0;
+        double start = seconds();
+        double elapsed;
+
+        do {
+            int j = cases % N_PAYLOADS;
+            int processed = properties[i].check(payloads[j], sizes[j]);
+
+            if (processed == -1) {
+                printf("%-16s failed at case %lld (payload of %d bytes)\n", properties[i].name, cases, sizes[j]);
+                failed++;
+                break;
+            }
+            cases++;
+            bytes += processed;
+            elapsed = seconds() - start;
+        } while (elapsed < runSeconds);
+
+        if (cases > 0 && elapsed > 0) {
+            printf("%-16s %10lld %10.1f\n", properties[i].name, cases, bytes / elapsed / 1e6);
+        }
+    }
+
+    return failed > 0;
+}
@@ -0,0 +1,289 @@
+// Replays a capture (see LinkLayer.captureFile) against the link layer. The
+// captured side runs again on a pseudo terminal: a receiver is read with
+// llread, a transmitter sends the captured packets again with llwrite. The
+// bytes it received are fed back at their original times (divided by speed),
+// but only once it wrote everything it had written before them, so that
+// input and output interleave as they did. What it writes is compared
+// against the capture. Above 1x a transmitter measures shorter round trips,
+// so its adaptive timeouts may stop following the capture.
+// Usage: replay <capture file> [speed] [output file]
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+// Longest a record is held back past its time waiting for the output before it,
+// once the replay no longer follows the capture
+#define MAX_OUTPUT_WAIT_US 2000000
+
+typedef struct {
+    CaptureRecord *records;
+    int count;
+    unsigned char *sent; // Every byte the captured side wrote, in order
+    long long sentSize;
+} Recording;
+
+typedef struct {
+    const Recording *capture;
+    int master;
+    double speed;
+    long long startUs;
+    atomic_int stopping;
+    atomic_llong matched; // Bytes written that match the capture
+    atomic_llong written;
+    atomic_llong divergence; // Offset of the first byte that differs, "-1" for none
+} Replay;
+
+static long long nowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Loads every record of the capture.
+// Returns "0" on success or "-1" on error.
+static int loadCapture(CaptureReader *reader, Recording *capture)
+{
+    int capacity = 1024;
+    capture->records = (CaptureRecord *)malloc(capacity * sizeof(CaptureRecord));
+    capture->count = 0;
+    capture->sentSize = 0;
+
+    while (capture->records != NULL) {
+        if (capture->count == capacity) {
+            capacity *= 2;
+            CaptureRecord *records = (CaptureRecord *)realloc(capture->records, capacity * sizeof(CaptureRecord));
+            if (records == NULL) break;
+            capture->records = records;
+        }
+
+        int res = captureReaderNext(reader, &capture->records[capture->count]);
+        if (res == -1) printf("Truncated capture, replaying the first %d records\n", capture->count);
+        if (res != 1) break;
+
+        if (capture->records[capture->count].type == CAPTURE_SENT) capture->sentSize += capture->records[capture->count].size;
+        capture->count++;
+    }
+
+    capture->sent = (unsigned char *)malloc(capture->sentSize > 0 ? capture->sentSize : 1);
+    if (capture->records == NULL || capture->sent == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    long long offset = 0;
+    for (int i = 0; i < capture->count; i++) {
+        if (capture->records[i].type != CAPTURE_SENT) continue;
+        memcpy(capture->sent + offset, capture->records[i].data, capture->records[i].size);
+        offset += capture->records[i].size;
+    }
+    return 0;
+}
+
+// Writes the received records to the pseudo terminal on schedule.
+static void *feederThread(void *arg)
+{
+    Replay *replay = (Replay *)arg;
+    const Recording *capture = replay->capture;
+    long long sentBefore = 0;
+
+    for (int i = 0; i < capture->count && !atomic_load(&replay->stopping); i++) {
+        const CaptureRecord *record = &capture->records[i];
+
+        if (record->type == CAPTURE_SENT) sentBefore += record->size;
+        if (record->type != CAPTURE_RECEIVED) continue;
+
+        long long dueUs = replay->startUs + (long long) (record->timeUs / replay->speed);
+        long long wait = dueUs - nowUs();
+        if (wait > 0) usleep(wait);
+
+        while (atomic_load(&replay->written) < sentBefore && atomic_load(&replay->divergence) == -1 &&
+               nowUs() < dueUs + MAX_OUTPUT_WAIT_US && !atomic_load(&replay->stopping)) {
+            usleep(1000);
+        }
+
+        if (write(replay->master, record->data, record->size) != record->size) {
+            perror("write");
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Reads what the link layer writes and compares it against the capture.
+static void *drainThread(void *arg)
+{
+    Replay *replay = (Replay *)arg;
+    const Recording *capture = replay->capture;
+    unsigned char buf[4096];
+
+    while (!atomic_load(&replay->stopping)) {
+        struct pollfd pollFd = {replay->master, POLLIN, 0};
+        if (poll(&pollFd, 1, 100) <= 0) continue;
+
+        int res = read(replay->master, buf, sizeof(buf));
+        if (res <= 0) continue;
+
+        long long written = atomic_load(&replay->written);
+
+        for (int i = 0; i < res && atomic_load(&replay->divergence) == -1; i++) {
+            if (written + i < capture->sentSize && buf[i] == capture->sent[written + i]) atomic_fetch_add(&replay->matched, 1);
+            else atomic_store(&replay->divergence, written + i);
+        }
+        atomic_store(&replay->written, written + res);
+    }
+    return NULL;
+}
+
+// Opens a pseudo terminal, both ends raw.
+// Returns the master, with the path of the slave in slavePath and its
+// descriptor (kept open so the master does not hang up) in slave, or "-1" on error.
+static int openPty(char *slavePath, int slavePathSize, int *slave)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+    strncpy(slavePath, ptsname(master), slavePathSize - 1);
+    slavePath[slavePathSize - 1] = '\0';
+
+    *slave = open(slavePath, O_RDWR | O_NOCTTY);
+    if (*slave < 0) {
+        perror(slavePath);
+        close(master);
+        return -1;
+    }
+
+    struct termios tio;
+    int fds[2] = {master, *slave};
+
+    for (int i = 0; i < 2; i++) {
+        if (tcgetattr(fds[i], &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(fds[i], TCSANOW, &tio);
+        }
+    }
+    return master;
+}
+
+// Runs the captured side on fd until the transfer ends.
+// Returns the number of packets sent or received.
+static int runLink(int fd, LinkLayer *params, const Recording *capture, FILE *output)
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int packets = 0;
+
+    if (params->role == LLRX) {
+        int size;
+        while ((size = llread(fd, *params, packet)) >= 0) {
+            if (output != NULL && size > 0) fwrite(packet, 1, size, output);
+            packets++;
+        }
+        return packets;
+    }
+
+    for (int i = 0; i < capture->count; i++) {
+        if (capture->records[i].type != CAPTURE_PACKET) continue;
+
+        if (output != NULL) fwrite(capture->records[i].data, 1, capture->records[i].size, output);
+        if (llwrite(fd, *params, capture->records[i].data, capture->records[i].size) < 0) break;
+        packets++;
+    }
+    return packets;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s <capture file> [speed] [output file]\n", argv[0]);
+        return 1;
+    }
+
+    double speed = argc > 2 ? atof(argv[2]) : 1;
+    if (speed <= 0) {
+        printf("Invalid speed: %s\n", argv[2]);
+        return 1;
+    }
+
+    CaptureReader reader;
+    if (captureReaderOpen(&reader, argv[1]) == -1) return 1;
+
+    Recording capture;
+    int res = loadCapture(&reader, &capture);
+    captureReaderClose(&reader);
+    if (res == -1) return 1;
+
+    FILE *output = NULL;
+    if (argc > 3) {
+        output = fopen(argv[3], "wb");
+        if (output == NULL) {
+            perror(argv[3]);
+            return 1;
+        }
+    }
+
+    char slavePath[50];
+    int slave;
+    int master = openPty(slavePath, sizeof(slavePath), &slave);
+    if (master == -1) return 1;
+
+    LinkLayer params;
+    captureLinkLayer(&reader.header, slavePath, &params);
+
+    unsigned long long durationUs = capture.count > 0 ? capture.records[capture.count - 1].timeUs : 0;
+    printf("Replaying %d records of a %s capture (%.3f s) at %gx\n", capture.count,
+           params.role == LLTX ? "transmitter" : "receiver", durationUs / 1e6, speed);
+
+    Replay replay = {&capture, master, speed, nowUs()};
+    atomic_init(&replay.stopping, FALSE);
+    atomic_init(&replay.matched, 0);
+    atomic_init(&replay.written, 0);
+    atomic_init(&replay.divergence, -1);
+    pthread_t feeder, drain;
+    pthread_create(&drain, NULL, drainThread, &replay);
+    pthread_create(&feeder, NULL, feederThread, &replay);
+
+    int packets = 0;
+    int fd = llopen(params);
+    if (fd >= 0) {
+        packets = runLink(fd, &params, &capture, output);
+        llclose(fd, params, TRUE, NULL);
+    }
+    else printf("Connection failed\n");
+
+    long long elapsedUs = nowUs() - replay.startUs;
+
+    // Let the last frames reach the drain before comparing
+    usleep(100000);
+    atomic_store(&replay.stopping, TRUE);
+    pthread_join(feeder, NULL);
+    pthread_join(drain, NULL);
+
+    printf("\n\t**Replay**\n");
+    printf("Packets: %d, in %.3f s\n", packets, elapsedUs / 1e6);
+    printf("Bytes written: %lld, captured: %lld\n", (long long) replay.written, capture.sentSize);
+    if (replay.divergence != -1) printf("Diverged from the capture at byte %lld\n", (long long) replay.divergence);
+    else if (replay.written < capture.sentSize) printf("Matched the capture up to byte %lld\n", (long long) replay.matched);
+    else printf("Matched the capture\n");
+
+    if (output != NULL) fclose(output);
+    close(slave);
+    close(master);
+    free(capture.records);
+    free(capture.sent);
+    return 0;
+}
@@ -0,0 +1,88 @@
+// Decodes a link-layer event trace into a timeline.
+// Usage: tracedump <trace file> [stall threshold in ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+#define DEFAULT_STALL_MS 500
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [stall threshold in ms]\n", argv[0]);
+        return 1;
+    }
+
+    double stallMs = argc > 2 ? atof(argv[2]) : DEFAULT_STALL_MS;
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
+        printf("%s is not a trace file\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    if (header.version != TRACE_VERSION) {
+        printf("Unsupported trace version %d\n", header.version);
+        fclose(file);
+        return 1;
+    }
+
+    TraceEvent *events = (TraceEvent *)malloc(header.capacity * sizeof(TraceEvent));
+    if (events == NULL || fread(events, sizeof(TraceEvent), header.capacity, file) != header.capacity) {
+        printf("Truncated trace file\n");
+        free(events);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    unsigned long long recorded = atomic_load(&header.next);
+    unsigned long long first = recorded > header.capacity ? recorded - header.capacity : 0;
+
+    printf("Role of the first link: %s, %llu events", header.role == 0 ? "tx" : "rx", recorded);
+    if (first > 0) printf(" (oldest %llu overwritten)", first);
+    printf("\n\n%12s %10s %5s  %-14s %4s %10s\n", "time (ms)", "delta", "link", "event", "seq", "value");
+
+    unsigned long long counts[TRACE_EVENT_TYPES] = {0};
+    unsigned long long bytes = 0;
+    uint64_t previous = 0;
+    int stalls = 0;
+
+    for (unsigned long long i = first; i < recorded; i++) {
+        TraceEvent *event = &events[i & (header.capacity - 1)];
+        double delta = i == first ? 0 : (event->timeNs - previous) / 1e6;
+
+        if (delta >= stallMs) {
+            printf("%12s %10s %5s  -- stall of %.1f ms --\n", "", "", "", delta);
+            stalls++;
+        }
+
+        printf("%12.3f %+10.3f %5d  %-14s %4d %10u\n", event->timeNs / 1e6, delta, event->link,
+               traceEventName(event->type), event->seq, event->value);
+
+        if (event->type < TRACE_EVENT_TYPES) counts[event->type]++;
+        if (event->type == TRACE_I_RECEIVED) bytes += event->value;
+        previous = event->timeNs;
+    }
+
+    printf("\n\t**Summary**\n");
+    for (int type = 0; type < TRACE_EVENT_TYPES; type++) {
+        if (counts[type] > 0) printf("%-14s %llu\n", traceEventName(type), counts[type]);
+    }
+    if (bytes > 0) printf("Payload received: %llu bytes\n", bytes);
+    if (recorded > first + 1) {
+        double span = (events[(recorded - 1) & (header.capacity - 1)].timeNs - events[first & (header.capacity - 1)].timeNs) / 1e6;
+        printf("Time span: %.3f ms, %d stalls over %.0f ms\n", span, stalls, stallMs);
+    }
+
+    free(events);
+    return 0;
+}